@@ -0,0 +1,161 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+#include "firebase/firestore/firestore.h"
+
+using firebase::firestore::MessageArena;
+using firebase::firestore::Document;
+using firebase::firestore::Value;
+using firebase::firestore::DocumentFields;
+
+// Counts the heap allocations made while a benchmark runs.
+// With the debug CRT every module shares one heap, so the allocation hook also sees the
+// allocations made inside the Firestore and protobuf DLLs; otherwise only the allocations
+// made through this executable's operator new are counted.
+static std::atomic<uint64_t> allocation_count(0);
+
+#if defined(_MSC_VER) && defined(_DEBUG)
+#include <crtdbg.h>
+
+static int CountAllocation(int type, void*, size_t, int, long, const unsigned char*, int)
+{
+	if(type == _HOOK_ALLOC || type == _HOOK_REALLOC)
+	{
+		allocation_count++;
+	}
+	return TRUE;
+}
+
+static void InstallAllocationCounter()
+{
+	_CrtSetAllocHook(CountAllocation);
+}
+#else
+void *operator new(size_t size)
+{
+	allocation_count++;
+	if(void *ptr = std::malloc(size > 0 ? size : 1))
+	{
+		return ptr;
+	}
+	throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+	operator delete(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+	operator delete(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+	operator delete(ptr);
+}
+
+static void InstallAllocationCounter()
+{
+}
+#endif
+
+// A document with a mix of field types, similar to the hot config and player documents
+static Document CreateDocument(const int num_fields)
+{
+	Document document;
+	document.set_name("projects/benchmark/databases/(default)/documents/players/player_0");
+	DocumentFields &fields = *document.mutable_fields();
+	for(int i = 0; i < num_fields; i++)
+	{
+		Value v;
+		switch(i % 3)
+		{
+			case 0: v.set_integer_value(i); break;
+			case 1: v.set_string_value("a string value that does not fit in a small string buffer " + std::to_string(i)); break;
+			case 2: v.mutable_map_value()->mutable_fields()->insert({ "nested", Value() }); break;
+		}
+		fields["Field " + std::to_string(i)] = v;
+	}
+	return document;
+}
+
+template<typename Function>
+static void Run(const char *name, const int iterations, const Function &function)
+{
+	const uint64_t allocations_before = allocation_count;
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for(int i = 0; i < iterations; i++)
+	{
+		function();
+	}
+	const std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+	const uint64_t allocations = allocation_count - allocations_before;
+	std::cout << name << ": " << (double)allocations / iterations << " allocations and "
+		<< elapsed.count() / iterations << " us per iteration" << std::endl;
+}
+
+int main()
+{
+	InstallAllocationCounter();
+
+	const int iterations = 10000;
+	const Document document = CreateDocument(30);
+
+	// Listen loop: parse every response into a message and hand it over
+	std::string serialized_response;
+	{
+		google::firestore::v1::ListenResponse response;
+		*response.mutable_document_change()->mutable_document() = document;
+		response.mutable_document_change()->add_target_ids(1);
+		response.SerializeToString(&serialized_response);
+	}
+
+	Run("ListenResponse, new message per response", iterations, [&]()
+	{
+		google::firestore::v1::ListenResponse *response = new google::firestore::v1::ListenResponse;
+		response->ParseFromString(serialized_response);
+		delete response;
+	});
+
+	MessageArena response_arena;
+	Run("ListenResponse, arena reset per response", iterations, [&]()
+	{
+		response_arena.Reset();
+		google::firestore::v1::ListenResponse *response = response_arena.Create<google::firestore::v1::ListenResponse>();
+		response->ParseFromString(serialized_response);
+	});
+
+	// UpdateDocument: copy the document into a request and serialize it
+	std::string serialized_request;
+	Run("UpdateDocumentRequest, heap allocated", iterations, [&]()
+	{
+		google::firestore::v1::UpdateDocumentRequest request;
+		request.set_allocated_document(new Document(document));
+		request.SerializeToString(&serialized_request);
+	});
+
+	Run("UpdateDocumentRequest, arena per call", iterations, [&]()
+	{
+		MessageArena arena;
+		google::firestore::v1::UpdateDocumentRequest *request = arena.Create<google::firestore::v1::UpdateDocumentRequest>();
+		*request->mutable_document() = document;
+		request->SerializeToString(&serialized_request);
+	});
+
+	return 0;
+}
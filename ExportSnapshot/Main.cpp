@@ -0,0 +1,33 @@
+#include <iostream>
+
+#include "firebase/firestore/firestore.h"
+
+using firebase::firestore::Firestore;
+
+// Exports collections to snapshot files, to ship with the application
+// and mount with Firestore::MountSnapshot at startup
+int main(int argc, char **argv)
+{
+	if(argc < 4 || (argc - 2) % 2 != 0)
+	{
+		std::cerr << "Usage: ExportSnapshot <project_id> <collection_path> <file_path> [<collection_path> <file_path> ...]" << std::endl;
+		std::cerr << "Credentials are read from the file named by GOOGLE_APPLICATION_CREDENTIALS." << std::endl;
+		return 1;
+	}
+
+	Firestore firestore(argv[1], "(default)");
+	int num_failed = 0;
+	for(int i = 2; i + 1 < argc; i += 2)
+	{
+		if(firestore.ExportSnapshot(argv[i], argv[i + 1]))
+		{
+			std::cout << "Exported " << argv[i] << " to " << argv[i + 1] << std::endl;
+		}
+		else
+		{
+			std::cerr << "Failed to export " << argv[i] << std::endl;
+			num_failed++;
+		}
+	}
+	return num_failed == 0 ? 0 : 1;
+}
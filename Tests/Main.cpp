@@ -1,9 +1,28 @@
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 
 #include "firebase/firestore/firestore.h"
+#include "firebase/firestore/bulk_writer.h"
+#include "firebase/firestore/write_stream.h"
+#include "firebase/firestore/mutation_queue.h"
+#include "firebase/firestore/local_query.h"
 
 using firebase::firestore::Firestore;
+using firebase::firestore::FirestoreSettings;
+using firebase::firestore::READ_CACHE_FIRST;
+using firebase::firestore::READ_CACHE_ONLY;
 using firebase::firestore::Transaction;
+using firebase::firestore::BulkWriter;
+using firebase::firestore::BulkWriterOptions;
+using firebase::firestore::WriteStream;
+using firebase::firestore::MutationQueue;
+using firebase::firestore::QueryIterator;
+using firebase::firestore::QueryChange;
+using firebase::firestore::DocumentHandle;
+using firebase::firestore::DocumentCache;
+using firebase::firestore::MaybeDocument;
+using firebase::firestore::StructuredQuery;
 using firebase::firestore::Document;
 using firebase::firestore::Value;
 using firebase::firestore::DocumentFields;
@@ -131,6 +150,710 @@ int main()
 		}
 	}
 
+	// Testing: UpdateDocumentAsync() and GetDocumentAsync() with many requests in flight
+	{
+		const int num_documents = 32;
+		const int random_value = rand();
+
+		// Issue all writes before waiting on any of them
+		std::vector<std::future<bool>> update_futures;
+		for(int i = 0; i < num_documents; i++)
+		{
+			Document new_document;
+			DocumentFields& fields = *new_document.mutable_fields();
+			Value v;
+			v.set_integer_value(random_value + i);
+			fields["Value"] = v;
+			update_futures.push_back(firestore->UpdateDocumentAsync(collection + "/async_test_" + std::to_string(i), new_document, nullptr));
+		}
+		for(std::future<bool>& f : update_futures)
+		{
+			assert(f.get() == true);
+		}
+
+		// Read the documents back the same way
+		std::vector<Document> documents(num_documents);
+		std::vector<std::future<bool>> get_futures;
+		for(int i = 0; i < num_documents; i++)
+		{
+			get_futures.push_back(firestore->GetDocumentAsync(collection + "/async_test_" + std::to_string(i), &documents[i]));
+		}
+		for(int i = 0; i < num_documents; i++)
+		{
+			assert(get_futures[i].get() == true);
+			DocumentFields fields = documents[i].fields();
+			DocumentFields::iterator itr = fields.find("Value");
+			assert(itr != fields.end());
+			assert(itr->second.integer_value() == random_value + i);
+		}
+
+		// Callback variant on a missing document
+		std::atomic<bool> callback_invoked = false;
+		firestore->GetDocumentAsync(collection + "/null", [&](bool success, const Document *document)
+		{
+			assert(success == false);
+			assert(document == nullptr);
+			callback_invoked = true;
+		});
+		waitUntil(callback_invoked);
+	}
+
+	// Testing: Concurrent reads of the same document share one RPC and its result
+	{
+		const std::string document_path = collection + "/async_test_0";
+		const int num_readers = 16;
+		std::vector<Document> documents(num_readers * 2);
+		std::vector<std::future<bool>> get_futures;
+		std::vector<std::thread> readers;
+		std::vector<char> results(num_readers, 0);
+		for(int i = 0; i < num_readers; i++)
+		{
+			get_futures.push_back(firestore->GetDocumentAsync(document_path, &documents[i]));
+			readers.push_back(std::thread([&, i]() { results[i] = firestore->GetDocument(document_path, &documents[num_readers + i]); }));
+		}
+		for(int i = 0; i < num_readers; i++)
+		{
+			assert(get_futures[i].get() == true);
+			readers[i].join();
+			assert(results[i] == 1);
+		}
+		for(const Document &document : documents)
+		{
+			assert(document.fields().at("Value").integer_value() == documents[0].fields().at("Value").integer_value());
+		}
+
+		// Missing documents are shared the same way
+		get_futures.clear();
+		for(int i = 0; i < num_readers; i++)
+		{
+			get_futures.push_back(firestore->GetDocumentAsync(collection + "/null", &documents[i]));
+		}
+		for(std::future<bool>& f : get_futures)
+		{
+			assert(f.get() == false);
+		}
+
+		// A read that starts after a write never shares a read from before it
+		{
+			Document stale_document;
+			std::future<bool> stale_future = firestore->GetDocumentAsync(document_path, &stale_document);
+			Document new_document;
+			DocumentFields& fields = *new_document.mutable_fields();
+			Value v;
+			v.set_integer_value(documents[0].fields().at("Value").integer_value() + 1);
+			fields["Value"] = v;
+			assert(firestore->UpdateDocument(document_path, new_document) == true);
+
+			Document read_document;
+			assert(firestore->GetDocument(document_path, &read_document) == true);
+			assert(read_document.fields().at("Value").integer_value() == v.integer_value());
+			assert(stale_future.get() == true);
+		}
+	}
+
+	// Testing: GetDocuments() with a mix of existing and missing documents,
+	// split over several batches
+	{
+		FirestoreSettings settings;
+		settings.max_documents_per_batch_get = 5;
+		Firestore batch_firestore(project_id, database_id, settings);
+
+		// Documents written by the async test above
+		std::vector<std::string> document_paths;
+		for(int i = 0; i < 16; i++)
+		{
+			document_paths.push_back(collection + "/async_test_" + std::to_string(i));
+		}
+		document_paths.push_back(collection + "/null");
+
+		std::vector<Document> documents;
+		assert(batch_firestore.GetDocuments(document_paths, &documents) == true);
+		assert(documents.size() == document_paths.size());
+		for(int i = 0; i < 16; i++)
+		{
+			assert(documents[i].name() == batch_firestore.GetFullDocumentPath(document_paths[i]));
+		}
+		assert(documents.back().name().empty());
+
+		// Callback variant reports the missing document with nullptr
+		int num_found = 0, num_missing = 0;
+		assert(batch_firestore.GetDocuments(document_paths, [&](const std::string&, const Document *document)
+		{
+			if(document) num_found++;
+			else         num_missing++;
+		}) == true);
+		assert(num_found == 16);
+		assert(num_missing == 1);
+	}
+
+	// Testing: The document cache keeps the newer of a document and a missing document,
+	// whichever order they arrive in
+	{
+		DocumentCache cache(1024 * 1024);
+		const std::string name = firestore->GetFullDocumentPath(collection + "/out_of_order_test");
+
+		Document document;
+		document.set_name(name);
+		document.mutable_update_time()->set_seconds(200);
+		google::protobuf::Timestamp earlier_read_time, later_read_time;
+		earlier_read_time.set_seconds(100);
+		later_read_time.set_seconds(300);
+
+		// A read that found the document missing before it was created arrives late
+		MaybeDocument cached;
+		cache.PutDocument(document);
+		cache.PutNoDocument(name, earlier_read_time);
+		assert(cache.Get(name, &cached) == true);
+		assert(cached.has_document() && cached.document().update_time().seconds() == 200);
+
+		// A read that found the document before it was deleted arrives late
+		cache.Remove(name);
+		cache.PutNoDocument(name, later_read_time);
+		cache.PutDocument(document);
+		assert(cache.Get(name, &cached) == true);
+		assert(cached.has_no_document() && cached.no_document().read_time().seconds() == 300);
+
+		// Newer entries replace older ones either way
+		cache.Remove(name);
+		cache.PutNoDocument(name, earlier_read_time);
+		cache.PutDocument(document);
+		assert(cache.Get(name, &cached) == true && cached.has_document());
+		cache.PutNoDocument(name, later_read_time);
+		assert(cache.Get(name, &cached) == true && cached.has_no_document());
+	}
+
+	// Testing: Reading documents through the document cache,
+	// with a byte budget that only fits a few documents
+	{
+		FirestoreSettings settings;
+		settings.document_cache_size = 8 * 1024;
+		Firestore cached_firestore(project_id, database_id, settings);
+
+		const int num_documents = 16;
+		const int random_value = rand();
+		const std::string padding(1024, 'x');
+		for(int i = 0; i < num_documents; i++)
+		{
+			Document new_document;
+			DocumentFields& fields = *new_document.mutable_fields();
+			{
+				Value v;
+				v.set_integer_value(random_value + i);
+				fields["Value"] = v;
+			}
+			{
+				Value v;
+				v.set_string_value(padding);
+				fields["Padding"] = v;
+			}
+			assert(cached_firestore.UpdateDocument(collection + "/cache_test_" + std::to_string(i), new_document) == true);
+		}
+
+		// The most recently written document is served from the cache
+		Document document;
+		const std::string last_document_path = collection + "/cache_test_" + std::to_string(num_documents - 1);
+		assert(cached_firestore.GetDocument(last_document_path, &document, READ_CACHE_ONLY) == true);
+		assert(document.fields().at("Value").integer_value() == random_value + num_documents - 1);
+
+		// The first one was evicted to stay within the budget
+		const std::string first_document_path = collection + "/cache_test_0";
+		assert(cached_firestore.GetDocument(first_document_path, &document, READ_CACHE_ONLY) == false);
+
+		// A cache miss goes to the server and fills the cache
+		assert(cached_firestore.GetDocument(first_document_path, &document, READ_CACHE_FIRST) == true);
+		assert(document.fields().at("Value").integer_value() == random_value);
+		assert(cached_firestore.GetDocument(first_document_path, &document, READ_CACHE_ONLY) == true);
+
+		// The asynchronous reads share the cache
+		assert(cached_firestore.GetDocumentAsync(first_document_path, &document, READ_CACHE_ONLY).get() == true);
+		assert(cached_firestore.GetDocumentAsync(collection + "/null", &document, READ_CACHE_ONLY).get() == false);
+	}
+
+	// Testing: Missing documents are answered from the cache until missing_document_ttl passes
+	{
+		FirestoreSettings settings;
+		settings.document_cache_size = 64 * 1024;
+		settings.missing_document_ttl = std::chrono::seconds(2);
+		Firestore ttl_firestore(project_id, database_id, settings);
+
+		const std::string document_path = collection + "/missing_test_" + getRandomAZString(12);
+		Document document;
+		assert(ttl_firestore.GetDocument(document_path, &document) == false);
+
+		// The document is created behind the cache's back, which goes unnoticed for a while
+		Document new_document;
+		Value v;
+		v.set_integer_value(1);
+		(*new_document.mutable_fields())["Value"] = v;
+		assert(firestore->UpdateDocument(document_path, new_document) == true);
+		assert(ttl_firestore.GetDocument(document_path, &document) == false);
+		assert(ttl_firestore.GetDocumentAsync(document_path, &document).get() == false);
+
+		std::this_thread::sleep_for(settings.missing_document_ttl);
+		assert(ttl_firestore.GetDocument(document_path, &document, READ_CACHE_FIRST) == true);
+		assert(document.fields().at("Value").integer_value() == 1);
+
+		// Writes through the Firestore object replace the missing entry right away
+		const std::string written_path = document_path + "_written";
+		assert(ttl_firestore.GetDocument(written_path, &document) == false);
+		assert(ttl_firestore.UpdateDocument(written_path, new_document) == true);
+		assert(ttl_firestore.GetDocument(written_path, &document) == true);
+	}
+
+	// Testing: Serving reads from the on-disk document store
+	// of an earlier Firestore object
+	{
+		FirestoreSettings settings;
+		settings.document_store_path = ".";
+		const std::string document_path = collection + "/store_test";
+		const int random_value = rand();
+		for(int i = 0; i < 2; i++)
+		{
+			Firestore stored_firestore(project_id, database_id, settings);
+
+			// The store holds what the previous object wrote
+			Document document;
+			if(i > 0)
+			{
+				assert(stored_firestore.GetDocument(document_path, &document, READ_CACHE_ONLY) == true);
+				assert(document.fields().at("Value").integer_value() == random_value + i - 1);
+				assert(stored_firestore.GetDocument(collection + "/null", &document, READ_CACHE_ONLY) == false);
+			}
+
+			Document new_document;
+			DocumentFields& fields = *new_document.mutable_fields();
+			Value v;
+			v.set_integer_value(random_value + i);
+			fields["Value"] = v;
+			assert(stored_firestore.UpdateDocument(document_path, new_document) == true);
+			assert(stored_firestore.GetDocument(collection + "/null", &document) == false);
+		}
+
+		// The store is not used unless asked for
+		Document document;
+		Firestore uncached_firestore(project_id, database_id);
+		assert(uncached_firestore.GetDocument(document_path, &document, READ_CACHE_ONLY) == false);
+	}
+
+	// Testing: Writing many documents with a BulkWriter
+	{
+		const int num_documents = 1200; // Spans several commits
+		const int random_value = rand();
+
+		std::vector<std::future<bool>> results;
+		{
+			BulkWriterOptions options;
+			options.max_batches_in_flight = 4;
+			BulkWriter bulk_writer(*firestore, options);
+			for(int i = 0; i < num_documents; i++)
+			{
+				Document new_document;
+				DocumentFields& fields = *new_document.mutable_fields();
+				Value v;
+				v.set_integer_value(random_value + i);
+				fields["Value"] = v;
+				results.push_back(bulk_writer.UpdateDocument(collection + "/bulk_writer_test_" + std::to_string(i), new_document));
+			}
+			bulk_writer.Flush();
+
+			// Every future is ready after Flush
+			for(std::future<bool>& result : results)
+			{
+				assert(result.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+				assert(result.get() == true);
+			}
+
+			// Writing the same document twice ends up in two commits
+			std::future<bool> first = bulk_writer.DeleteDocument(collection + "/bulk_writer_test_0");
+			std::future<bool> second = bulk_writer.DeleteDocument(collection + "/bulk_writer_test_0");
+			// The destructor flushes the remaining writes
+			results.clear();
+			results.push_back(std::move(first));
+			results.push_back(std::move(second));
+		}
+		for(std::future<bool>& result : results)
+		{
+			assert(result.get() == true);
+		}
+
+		// Spot check a written document
+		Document document;
+		assert(firestore->GetDocument(collection + "/bulk_writer_test_" + std::to_string(num_documents - 1), &document) == true);
+		DocumentFields fields = document.fields();
+		DocumentFields::iterator itr = fields.find("Value");
+		assert(itr != fields.end());
+		assert(itr->second.integer_value() == random_value + num_documents - 1);
+	}
+
+	// Testing: A BulkWriter commits the writes to a document in order,
+	// even with several commits in flight
+	{
+		const std::string document_path = collection + "/bulk_writer_order_test";
+		const int num_writes = 40; // Every write to the document closes a commit
+		const int random_value = rand();
+
+		std::vector<std::future<bool>> results;
+		{
+			BulkWriterOptions options;
+			options.max_batches_in_flight = 8;
+			BulkWriter bulk_writer(*firestore, options);
+			for(int i = 0; i < num_writes; i++)
+			{
+				Document new_document;
+				DocumentFields& fields = *new_document.mutable_fields();
+				Value v;
+				v.set_integer_value(random_value + i);
+				fields["Value"] = v;
+				results.push_back(bulk_writer.UpdateDocument(document_path, new_document));
+
+				// Other documents are still written alongside
+				results.push_back(bulk_writer.UpdateDocument(document_path + "_" + std::to_string(i), new_document));
+			}
+		}
+		for(std::future<bool>& result : results)
+		{
+			assert(result.get() == true);
+		}
+
+		// The last write wins
+		Document document;
+		assert(firestore->GetDocument(document_path, &document) == true);
+		assert(document.fields().at("Value").integer_value() == random_value + num_writes - 1);
+	}
+
+	// Testing: Queueing writes on disk with a MutationQueue
+	{
+		const int num_batches = 10;
+		const int random_value = rand();
+		std::mutex acknowledged_mutex;
+		std::vector<int32_t> acknowledged_batch_ids;
+		{
+			MutationQueue queue(*firestore, ".", [&](const int32_t batch_id, const bool committed)
+			{
+				assert(committed == true);
+				std::lock_guard<std::mutex> lock(acknowledged_mutex);
+				acknowledged_batch_ids.push_back(batch_id);
+			});
+			assert(queue.IsOpen() == true);
+
+			int32_t first_batch_id = 0;
+			for(int i = 0; i < num_batches; i++)
+			{
+				Document new_document;
+				DocumentFields& fields = *new_document.mutable_fields();
+				Value v;
+				v.set_integer_value(random_value + i);
+				fields["Value"] = v;
+
+				int32_t batch_id;
+				assert(queue.UpdateDocument(collection + "/mutation_queue_test", new_document, &batch_id) == true);
+				if(i == 0) first_batch_id = batch_id;
+				assert(batch_id == first_batch_id + i);
+			}
+
+			// The batches are committed in order, so the last write wins
+			assert(queue.Flush(std::chrono::seconds(30)) == true);
+			assert(queue.GetNumPendingBatches() == 0);
+			assert(queue.GetLastAcknowledgedBatchId() == first_batch_id + num_batches - 1);
+
+			// Every batch is acknowledged once, in order, with the id UpdateDocument returned
+			{
+				std::lock_guard<std::mutex> lock(acknowledged_mutex);
+				assert(acknowledged_batch_ids.size() == (size_t)num_batches);
+				for(int i = 0; i < num_batches; i++)
+				{
+					assert(acknowledged_batch_ids[i] == first_batch_id + i);
+				}
+			}
+
+			Document document;
+			assert(firestore->GetDocument(collection + "/mutation_queue_test", &document) == true);
+			assert(document.fields().at("Value").integer_value() == random_value + num_batches - 1);
+
+			// Writes queued when the queue is destroyed are kept for the next run
+			Document new_document;
+			DocumentFields& fields = *new_document.mutable_fields();
+			Value v;
+			v.set_integer_value(random_value + num_batches);
+			fields["Value"] = v;
+			assert(queue.UpdateDocument(collection + "/mutation_queue_test", new_document) == true);
+		}
+
+		// A new queue on the same directory commits what was left
+		MutationQueue queue(*firestore, ".");
+		assert(queue.Flush(std::chrono::seconds(30)) == true);
+		Document document;
+		assert(firestore->GetDocument(collection + "/mutation_queue_test", &document) == true);
+		assert(document.fields().at("Value").integer_value() == random_value + num_batches);
+	}
+
+	// Testing: Pipelining writes over a WriteStream
+	{
+		const std::string document_path = collection + "/write_stream_test_0";
+		const int num_writes = 100;
+		const int random_value = rand();
+
+		std::vector<std::future<bool>> results;
+		{
+			WriteStream write_stream(*firestore);
+			assert(write_stream.IsOpen());
+
+			// Send every write without waiting for the acknowledgements
+			for(int i = 0; i < num_writes; i++)
+			{
+				Document new_document;
+				DocumentFields& fields = *new_document.mutable_fields();
+				Value v;
+				v.set_integer_value(random_value + i);
+				fields["Value"] = v;
+				results.push_back(write_stream.UpdateDocument(document_path, new_document));
+			}
+			write_stream.Flush();
+			assert(!write_stream.GetStreamToken().empty());
+		}
+		for(std::future<bool>& result : results)
+		{
+			assert(result.get() == true);
+		}
+
+		// The writes are applied in order, so the last one wins
+		Document document;
+		assert(firestore->GetDocument(document_path, &document) == true);
+		DocumentFields fields = document.fields();
+		DocumentFields::iterator itr = fields.find("Value");
+		assert(itr != fields.end());
+		assert(itr->second.integer_value() == random_value + num_writes - 1);
+	}
+
+	// Testing: RunQuery() and QueryIterator on a fresh sub-collection
+	{
+		const int num_documents = 10;
+		const std::string query_tag = getRandomAZString(12);
+		const std::string parent_path = collection + "/query_test_" + query_tag;
+
+		for(int i = 0; i < num_documents; i++)
+		{
+			Document new_document;
+			DocumentFields& fields = *new_document.mutable_fields();
+			{
+				Value v;
+				v.set_string_value(query_tag);
+				fields["QueryTag"] = v;
+			}
+			{
+				Value v;
+				v.set_integer_value(i);
+				fields["Value"] = v;
+			}
+			assert(firestore->UpdateDocument(parent_path + "/items/" + std::to_string(i), new_document) == true);
+		}
+
+		// WHERE QueryTag == query_tag
+		StructuredQuery query;
+		query.add_from()->set_collection_id("items");
+		{
+			google::firestore::v1::StructuredQuery::FieldFilter *filter = query.mutable_where()->mutable_field_filter();
+			filter->mutable_field()->set_field_path("QueryTag");
+			filter->set_op(google::firestore::v1::StructuredQuery::FieldFilter::EQUAL);
+			filter->mutable_value()->set_string_value(query_tag);
+		}
+
+		// Every matching document is delivered
+		int num_results = 0;
+		assert(firestore->RunQuery(parent_path, query, [&](const Document *document)
+		{
+			assert(document != nullptr);
+			assert(document->fields().at("QueryTag").string_value() == query_tag);
+			num_results++;
+		}) == true);
+		assert(num_results == num_documents);
+
+		// ORDER BY Value DESC LIMIT 4; the iterator sees the documents in query order
+		query.clear_where();
+		{
+			google::firestore::v1::StructuredQuery::Order *order = query.add_order_by();
+			order->mutable_field()->set_field_path("Value");
+			order->set_direction(google::firestore::v1::StructuredQuery::DESCENDING);
+			query.mutable_limit()->set_value(4);
+		}
+		QueryIterator itr(*firestore, parent_path, query);
+		int64_t expected_value = num_documents - 1;
+		while(itr.Next())
+		{
+			assert(itr.GetDocument().fields().at("Value").integer_value() == expected_value);
+			expected_value--;
+		}
+		assert(itr.Succeeded());
+		assert(expected_value == num_documents - 1 - 4);
+
+		// Abandoning an iterator half way cancels the query
+		{
+			QueryIterator partial_itr(*firestore, parent_path, query);
+			assert(partial_itr.Next());
+		}
+	}
+
+	// Testing: Serving documents from a snapshot exported by an earlier Firestore object
+	{
+		const std::string snapshot_collection = collection + "/snapshot_test_" + getRandomAZString(12) + "/items";
+		const int num_documents = 5;
+		for(int i = 0; i < num_documents; i++)
+		{
+			Document new_document;
+			DocumentFields& fields = *new_document.mutable_fields();
+			Value v;
+			v.set_integer_value(i);
+			fields["Value"] = v;
+			assert(firestore->UpdateDocument(snapshot_collection + "/" + std::to_string(i), new_document) == true);
+		}
+		assert(firestore->ExportSnapshot(snapshot_collection, "snapshot_test.snap") == true);
+
+		// Writes made after the export are not seen through the snapshot
+		Firestore snapshot_firestore(project_id, database_id);
+		assert(snapshot_firestore.MountSnapshot("snapshot_test.snap") == true);
+		assert(snapshot_firestore.MountSnapshot("missing.snap") == false);
+		{
+			Document new_document;
+			Value v;
+			v.set_integer_value(-1);
+			(*new_document.mutable_fields())["Value"] = v;
+			assert(firestore->UpdateDocument(snapshot_collection + "/0", new_document) == true);
+		}
+		for(int i = 0; i < num_documents; i++)
+		{
+			Document document;
+			assert(snapshot_firestore.GetDocument(snapshot_collection + "/" + std::to_string(i), &document, READ_CACHE_ONLY) == true);
+			assert(document.fields().at("Value").integer_value() == i);
+			assert(snapshot_firestore.GetDocumentAsync(snapshot_collection + "/" + std::to_string(i), &document).get() == true);
+			assert(document.fields().at("Value").integer_value() == i);
+		}
+
+		// Documents outside the snapshot are read as usual
+		Document document;
+		assert(snapshot_firestore.GetDocument(snapshot_collection + "/" + std::to_string(num_documents), &document) == false);
+	}
+
+	// Testing: RunQuery() over the cached documents gives the same results as the server
+	{
+		FirestoreSettings settings;
+		settings.document_cache_size = 1024 * 1024;
+		Firestore cached_firestore(project_id, database_id, settings);
+
+		// Integers and doubles are ordered by their numerical value, NaN first
+		const std::string parent_path = collection + "/local_query_test_" + getRandomAZString(12);
+		const double values[] = { 3, 1.5, -2, 2, std::nan(""), 2.5, 10, -0.5 };
+		for(size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+		{
+			Document new_document;
+			DocumentFields& fields = *new_document.mutable_fields();
+			Value v;
+			if(std::isnan(values[i]) || values[i] != (int64_t)values[i])
+			{
+				v.set_double_value(values[i]);
+			}
+			else
+			{
+				v.set_integer_value((int64_t)values[i]);
+			}
+			fields["Value"] = v;
+			assert(cached_firestore.UpdateDocument(parent_path + "/items/" + std::to_string(i), new_document) == true);
+		}
+		{
+			Value nan_value, integer_value;
+			nan_value.set_double_value(std::nan(""));
+			integer_value.set_integer_value(-100);
+			assert(firebase::firestore::CompareValues(nan_value, integer_value) < 0);
+		}
+
+		// WHERE Value > -1 ORDER BY Value DESC, starting after 3, LIMIT 3
+		StructuredQuery query;
+		query.add_from()->set_collection_id("items");
+		{
+			google::firestore::v1::StructuredQuery::FieldFilter *filter = query.mutable_where()->mutable_field_filter();
+			filter->mutable_field()->set_field_path("Value");
+			filter->set_op(google::firestore::v1::StructuredQuery::FieldFilter::GREATER_THAN);
+			filter->mutable_value()->set_integer_value(-1);
+
+			google::firestore::v1::StructuredQuery::Order *order = query.add_order_by();
+			order->mutable_field()->set_field_path("Value");
+			order->set_direction(google::firestore::v1::StructuredQuery::DESCENDING);
+			query.mutable_start_at()->add_values()->set_integer_value(3);
+			query.mutable_start_at()->set_before(false);
+			query.mutable_limit()->set_value(3);
+		}
+
+		std::vector<std::string> server_results, cached_results;
+		assert(cached_firestore.RunQuery(parent_path, query, [&](const Document *document)
+		{
+			server_results.push_back(document->name());
+		}) == true);
+		assert(cached_firestore.RunQuery(parent_path, query, [&](const Document *document)
+		{
+			cached_results.push_back(document->name());
+		}, READ_CACHE_ONLY) == true);
+		assert(server_results.size() == 3);
+		assert(cached_results == server_results);
+
+		// A collection the cache knows nothing about has no results
+		cached_results.clear();
+		assert(cached_firestore.RunQuery(parent_path + "/items/0", query, [&](const Document *document)
+		{
+			cached_results.push_back(document->name());
+		}, READ_CACHE_ONLY) == true);
+		assert(cached_results.empty());
+	}
+
+	// Testing: Prefetch() loads a collection into the cache with parallel queries
+	{
+		const std::string prefetch_collection = collection + "/prefetch_test_" + getRandomAZString(12) + "/items";
+		const int num_documents = 20;
+		std::vector<std::string> document_paths;
+		for(int i = 0; i < num_documents; i++)
+		{
+			// Ids spread over the ranges of the partitions
+			document_paths.push_back(prefetch_collection + "/" + (char)(i % 2 == 0 ? 'a' + i : 'A' + i) + std::to_string(i));
+			Document new_document;
+			Value v;
+			v.set_integer_value(i);
+			(*new_document.mutable_fields())["Value"] = v;
+			assert(firestore->UpdateDocument(document_paths.back(), new_document) == true);
+		}
+
+		FirestoreSettings settings;
+		settings.document_cache_size = 1024 * 1024;
+		{
+			Firestore prefetched_firestore(project_id, database_id, settings);
+			size_t num_prefetched = 0;
+			assert(prefetched_firestore.Prefetch(prefetch_collection, firebase::firestore::PrefetchOptions(), &num_prefetched) == true);
+			assert(num_prefetched == num_documents);
+			for(int i = 0; i < num_documents; i++)
+			{
+				Document document;
+				assert(prefetched_firestore.GetDocument(document_paths[i], &document, READ_CACHE_ONLY) == true);
+				assert(document.fields().at("Value").integer_value() == i);
+			}
+		}
+
+		// WHERE Value == 3
+		{
+			Firestore prefetched_firestore(project_id, database_id, settings);
+			firebase::firestore::PrefetchOptions options;
+			google::firestore::v1::StructuredQuery::FieldFilter *filter = options.filter.mutable_field_filter();
+			filter->mutable_field()->set_field_path("Value");
+			filter->set_op(google::firestore::v1::StructuredQuery::FieldFilter::EQUAL);
+			filter->mutable_value()->set_integer_value(3);
+			size_t num_prefetched = 0;
+			assert(prefetched_firestore.Prefetch(prefetch_collection, options, &num_prefetched) == true);
+			assert(num_prefetched == 1);
+			Document document;
+			assert(prefetched_firestore.GetDocument(document_paths[3], &document, READ_CACHE_ONLY) == true);
+			assert(prefetched_firestore.GetDocument(document_paths[4], &document, READ_CACHE_ONLY) == false);
+		}
+
+		// Without a cache there is nowhere to put the documents
+		assert(firestore->Prefetch(prefetch_collection) == false);
+	}
+
 	// Testing: Listen() when callback is invalid
 	{
 		assert(firestore->Listen("null/null", nullptr) < 0);
@@ -208,6 +931,533 @@ int main()
 		assert(firestore->Unlisten(listen_id) == true);
 	}
 
+	// Testing: Listen() on several documents at once;
+	// every listener should only see changes to its own document
+	{
+		const int num_listeners = 8;
+		const int random_value = rand();
+
+		std::atomic<int> num_initialized = 0;
+		std::vector<int32_t> listen_ids;
+		for(int i = 0; i < num_listeners; i++)
+		{
+			const std::string document_path = collection + "/listen_multiplex_test_" + std::to_string(i);
+			Document new_document;
+			DocumentFields& fields = *new_document.mutable_fields();
+			Value v;
+			v.set_integer_value(random_value + i);
+			fields["Value"] = v;
+			assert(firestore->UpdateDocument(document_path, new_document) == true);
+
+			const std::string full_path = firestore->GetFullDocumentPath(document_path);
+			int32_t listen_id = firestore->Listen(document_path, [&, i, full_path](const Document *document)
+			{
+				assert(document != nullptr);
+				assert(document->name() == full_path);
+				DocumentFields fields = document->fields();
+				DocumentFields::iterator itr = fields.find("Value");
+				assert(itr != fields.end());
+				assert(itr->second.integer_value() == random_value + i);
+				num_initialized++;
+			});
+			assert(listen_id >= 0);
+			listen_ids.push_back(listen_id);
+		}
+
+		// Wait until every listener received its document
+		while(num_initialized < num_listeners) { std::this_thread::sleep_for(std::chrono::milliseconds(100)); }
+
+		for(int32_t listen_id : listen_ids)
+		{
+			assert(firestore->Unlisten(listen_id) == true);
+			assert(firestore->Unlisten(listen_id) == false); // Listener is gone
+		}
+	}
+
+	// Testing: ListenShared() hands out documents that can be kept past the callback
+	{
+		const std::string document_path = collection + "/listen_shared_test_0";
+		const int num_writes = 3;
+		const int random_value = rand();
+
+		std::mutex documents_mutex;
+		std::vector<DocumentHandle> documents;
+		std::atomic<int> num_documents = 0;
+		int32_t listen_id = -1;
+		for(int i = 0; i <= num_writes; i++)
+		{
+			Document new_document;
+			DocumentFields& fields = *new_document.mutable_fields();
+			Value v;
+			v.set_integer_value(random_value + i);
+			fields["Value"] = v;
+			assert(firestore->UpdateDocument(document_path, new_document) == true);
+
+			if(i == 0)
+			{
+				listen_id = firestore->ListenShared(document_path, [&](const DocumentHandle &document)
+				{
+					assert(document != nullptr);
+					std::lock_guard<std::mutex> lock(documents_mutex);
+					documents.push_back(document);
+					num_documents++;
+				});
+				assert(listen_id >= 0);
+			}
+			while(num_documents <= i) { std::this_thread::sleep_for(std::chrono::milliseconds(100)); }
+		}
+		assert(firestore->Unlisten(listen_id) == true);
+
+		// Every version is still intact once the stream has moved on
+		std::lock_guard<std::mutex> lock(documents_mutex);
+		assert(documents.size() == num_writes + 1);
+		for(int i = 0; i <= num_writes; i++)
+		{
+			assert(documents[i]->name() == firestore->GetFullDocumentPath(document_path));
+			assert(documents[i]->fields().at("Value").integer_value() == random_value + i);
+		}
+		assert(firestore->ListenShared(document_path, nullptr) < 0);
+	}
+
+	// Testing: Listen() with consistent_listen_snapshots delivers a burst of writes
+	// as snapshots, never going back to an older version
+	{
+		FirestoreSettings settings;
+		settings.consistent_listen_snapshots = true;
+		Firestore snapshot_firestore(project_id, database_id, settings);
+		const std::string document_path = collection + "/listen_snapshot_test_0";
+		const int num_writes = 10;
+		const int random_value = rand();
+
+		{
+			Document new_document;
+			DocumentFields& fields = *new_document.mutable_fields();
+			Value v;
+			v.set_integer_value(random_value);
+			fields["Value"] = v;
+			assert(firestore->UpdateDocument(document_path, new_document) == true);
+		}
+
+		std::atomic<int> num_callbacks = 0;
+		std::atomic<int64_t> last_value = -1;
+		int32_t listen_id = snapshot_firestore.Listen(document_path, [&](const Document *document)
+		{
+			assert(document != nullptr);
+			const int64_t value = document->fields().at("Value").integer_value();
+			assert(value > last_value);
+			last_value = value;
+			num_callbacks++;
+		});
+		assert(listen_id >= 0);
+		while(last_value != random_value) { std::this_thread::sleep_for(std::chrono::milliseconds(100)); }
+
+		// Back-to-back writes; the listener may see them in fewer callbacks
+		for(int i = 1; i <= num_writes; i++)
+		{
+			Document new_document;
+			DocumentFields& fields = *new_document.mutable_fields();
+			Value v;
+			v.set_integer_value(random_value + i);
+			fields["Value"] = v;
+			assert(firestore->UpdateDocument(document_path, new_document) == true);
+		}
+
+		while(last_value != random_value + num_writes) { std::this_thread::sleep_for(std::chrono::milliseconds(100)); }
+		assert(num_callbacks <= num_writes + 1);
+		assert(snapshot_firestore.Unlisten(listen_id) == true);
+	}
+
+	// Testing: Listen() with a slow callback on a listener callback thread;
+	// superseded versions are coalesced, but the latest one always arrives
+	{
+		FirestoreSettings settings;
+		settings.num_listen_callback_threads = 1;
+		settings.max_queued_listen_callbacks = 2;
+		settings.listen_overflow_policy = firebase::firestore::CallbackExecutor::OVERFLOW_COALESCE_LATEST;
+		Firestore executor_firestore(project_id, database_id, settings);
+		const std::string document_path = collection + "/listen_executor_test_0";
+		const int num_writes = 10;
+		const int random_value = rand();
+
+		{
+			Document new_document;
+			DocumentFields& fields = *new_document.mutable_fields();
+			Value v;
+			v.set_integer_value(random_value);
+			fields["Value"] = v;
+			assert(firestore->UpdateDocument(document_path, new_document) == true);
+		}
+
+		std::atomic<int64_t> last_value = -1;
+		const std::thread::id test_thread_id = std::this_thread::get_id();
+		int32_t listen_id = executor_firestore.Listen(document_path, [&](const Document *document)
+		{
+			assert(std::this_thread::get_id() != test_thread_id);
+			assert(document != nullptr);
+			const int64_t value = document->fields().at("Value").integer_value();
+			assert(value > last_value);
+			last_value = value;
+			std::this_thread::sleep_for(std::chrono::milliseconds(500));
+		});
+		assert(listen_id >= 0);
+		while(last_value != random_value) { std::this_thread::sleep_for(std::chrono::milliseconds(100)); }
+
+		for(int i = 1; i <= num_writes; i++)
+		{
+			Document new_document;
+			DocumentFields& fields = *new_document.mutable_fields();
+			Value v;
+			v.set_integer_value(random_value + i);
+			fields["Value"] = v;
+			assert(firestore->UpdateDocument(document_path, new_document) == true);
+		}
+
+		while(last_value != random_value + num_writes) { std::this_thread::sleep_for(std::chrono::milliseconds(100)); }
+		assert(executor_firestore.Unlisten(listen_id) == true);
+	}
+
+	// Testing: ListenQuery() delivers the initial result set, then only what changed in it
+	{
+		const std::string query_tag = getRandomAZString(12);
+		const std::string parent_path = collection + "/listen_query_test_" + query_tag;
+		auto write_item = [&](const int i, const std::string &tag, const int64_t value)
+		{
+			Document new_document;
+			DocumentFields& fields = *new_document.mutable_fields();
+			{
+				Value v;
+				v.set_string_value(tag);
+				fields["QueryTag"] = v;
+			}
+			{
+				Value v;
+				v.set_integer_value(value);
+				fields["Value"] = v;
+			}
+			assert(firestore->UpdateDocument(parent_path + "/items/" + std::to_string(i), new_document) == true);
+		};
+		for(int i = 0; i < 3; i++)
+		{
+			write_item(i, query_tag, i);
+		}
+
+		// WHERE QueryTag == query_tag
+		StructuredQuery query;
+		query.add_from()->set_collection_id("items");
+		{
+			google::firestore::v1::StructuredQuery::FieldFilter *filter = query.mutable_where()->mutable_field_filter();
+			filter->mutable_field()->set_field_path("QueryTag");
+			filter->set_op(google::firestore::v1::StructuredQuery::FieldFilter::EQUAL);
+			filter->mutable_value()->set_string_value(query_tag);
+		}
+
+		// Every callback is recorded as "<type>:<document id>" entries
+		std::mutex changes_mutex;
+		std::vector<std::vector<std::string>> deliveries;
+		std::atomic<int> num_deliveries = 0;
+		int32_t listen_id = firestore->ListenQuery(parent_path, query, [&](const std::vector<QueryChange> &changes)
+		{
+			std::vector<std::string> delivery;
+			for(const QueryChange &change : changes)
+			{
+				assert(change.document != nullptr);
+				const std::string &name = change.document->name();
+				delivery.push_back(std::to_string(change.type) + ":" + name.substr(name.rfind('/') + 1));
+			}
+			std::sort(delivery.begin(), delivery.end());
+			std::lock_guard<std::mutex> lock(changes_mutex);
+			deliveries.push_back(delivery);
+			num_deliveries++;
+		});
+		assert(listen_id >= 0);
+		auto wait_for_delivery = [&](const int count, const std::vector<std::string> &expected)
+		{
+			while(num_deliveries < count) { std::this_thread::sleep_for(std::chrono::milliseconds(100)); }
+			std::lock_guard<std::mutex> lock(changes_mutex);
+			assert(deliveries[count - 1] == expected);
+		};
+		const std::string added = std::to_string(firebase::firestore::QUERY_DOCUMENT_ADDED) + ":";
+		const std::string modified = std::to_string(firebase::firestore::QUERY_DOCUMENT_MODIFIED) + ":";
+		const std::string removed = std::to_string(firebase::firestore::QUERY_DOCUMENT_REMOVED) + ":";
+
+		// The initial result set
+		wait_for_delivery(1, { added + "0", added + "1", added + "2" });
+
+		// A matching document is updated
+		write_item(0, query_tag, 100);
+		wait_for_delivery(2, { modified + "0" });
+
+		// A new document matches the query
+		write_item(3, query_tag, 3);
+		wait_for_delivery(3, { added + "3" });
+
+		// A document no longer matches the query
+		write_item(1, "not_" + query_tag, 1);
+		wait_for_delivery(4, { removed + "1" });
+
+		// Documents outside of the result set are not delivered
+		write_item(4, "not_" + query_tag, 4);
+		write_item(2, query_tag, 200);
+		wait_for_delivery(5, { modified + "2" });
+
+		assert(firestore->Unlisten(listen_id) == true);
+
+		// With a slow callback on a listener callback thread, the changes queued
+		// meanwhile are merged, and still build up the latest result set
+		FirestoreSettings settings;
+		settings.num_listen_callback_threads = 1;
+		settings.max_queued_listen_callbacks = 2;
+		settings.listen_overflow_policy = firebase::firestore::CallbackExecutor::OVERFLOW_COALESCE_LATEST;
+		Firestore executor_firestore(project_id, database_id, settings);
+		std::map<std::string, int64_t> results;
+		std::atomic<bool> initial_delivered = false;
+		listen_id = executor_firestore.ListenQuery(parent_path, query, [&](const std::vector<QueryChange> &changes)
+		{
+			std::lock_guard<std::mutex> lock(changes_mutex);
+			for(const QueryChange &change : changes)
+			{
+				const std::string &name = change.document->name();
+				const std::string id = name.substr(name.rfind('/') + 1);
+				assert((change.type == firebase::firestore::QUERY_DOCUMENT_ADDED) == (results.count(id) == 0));
+				if(change.type == firebase::firestore::QUERY_DOCUMENT_REMOVED)
+				{
+					results.erase(id);
+				}
+				else
+				{
+					results[id] = change.document->fields().at("Value").integer_value();
+				}
+			}
+			initial_delivered = true;
+			std::this_thread::sleep_for(std::chrono::milliseconds(500));
+		});
+		assert(listen_id >= 0);
+		waitUntil(initial_delivered);
+
+		const int num_writes = 10;
+		for(int i = 1; i <= num_writes; i++)
+		{
+			write_item(0, query_tag, 100 + i);
+			write_item(5, i % 2 == 0 ? query_tag : "not_" + query_tag, i);
+		}
+		const std::map<std::string, int64_t> expected_results = { { "0", 100 + num_writes }, { "2", 200 }, { "3", 3 }, { "5", num_writes } };
+		while(true)
+		{
+			{
+				std::lock_guard<std::mutex> lock(changes_mutex);
+				if(results == expected_results)
+				{
+					break;
+				}
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+		assert(executor_firestore.Unlisten(listen_id) == true);
+	}
+
+	// Testing: A document that no longer matches a query is not taken for deleted,
+	// neither by the listeners of the document nor by the cache
+	{
+		FirestoreSettings settings;
+		settings.document_cache_size = 1024 * 1024;
+		Firestore cached_firestore(project_id, database_id, settings);
+
+		const std::string query_tag = getRandomAZString(12);
+		const std::string parent_path = collection + "/leave_query_test_" + query_tag;
+		const std::string document_path = parent_path + "/items/0";
+		auto write_item = [&](const std::string &tag)
+		{
+			// Written through another instance, so the cached one only learns of it from the listen stream
+			Document new_document;
+			DocumentFields& fields = *new_document.mutable_fields();
+			Value v;
+			v.set_string_value(tag);
+			fields["QueryTag"] = v;
+			assert(firestore->UpdateDocument(document_path, new_document) == true);
+		};
+		write_item(query_tag);
+
+		std::mutex tag_mutex;
+		std::string last_tag;
+		int32_t document_listen_id = cached_firestore.Listen(document_path, [&](const Document *document)
+		{
+			assert(document != nullptr);
+			std::lock_guard<std::mutex> lock(tag_mutex);
+			last_tag = document->fields().at("QueryTag").string_value();
+		});
+		assert(document_listen_id >= 0);
+
+		// WHERE QueryTag == query_tag
+		StructuredQuery query;
+		query.add_from()->set_collection_id("items");
+		{
+			google::firestore::v1::StructuredQuery::FieldFilter *filter = query.mutable_where()->mutable_field_filter();
+			filter->mutable_field()->set_field_path("QueryTag");
+			filter->set_op(google::firestore::v1::StructuredQuery::FieldFilter::EQUAL);
+			filter->mutable_value()->set_string_value(query_tag);
+		}
+		std::atomic<bool> in_results = false;
+		std::atomic<bool> left_results = false;
+		int32_t query_listen_id = cached_firestore.ListenQuery(parent_path, query, [&](const std::vector<QueryChange> &changes)
+		{
+			for(const QueryChange &change : changes)
+			{
+				if(change.type == firebase::firestore::QUERY_DOCUMENT_REMOVED)
+				{
+					left_results = true;
+				}
+				else
+				{
+					in_results = true;
+				}
+			}
+		});
+		assert(query_listen_id >= 0);
+		waitUntil(in_results);
+
+		// The document leaves the result set
+		const std::string new_tag = "not_" + query_tag;
+		write_item(new_tag);
+		waitUntil(left_results);
+		while(true)
+		{
+			{
+				std::lock_guard<std::mutex> lock(tag_mutex);
+				if(last_tag == new_tag)
+				{
+					break;
+				}
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+
+		// It is still there, both for the document listener's copy and for the cache
+		Document document;
+		assert(cached_firestore.GetDocument(document_path, &document) == true);
+		assert(document.fields().at("QueryTag").string_value() == new_tag);
+		assert(cached_firestore.Unlisten(document_listen_id) == true);
+		assert(cached_firestore.Unlisten(query_listen_id) == true);
+		assert(cached_firestore.GetDocument(document_path, &document, READ_CACHE_ONLY) == true);
+		assert(document.fields().at("QueryTag").string_value() == new_tag);
+	}
+
+	// Testing: GetDocument() on a watched document is served by the listen stream
+	{
+		const std::string document_path = collection + "/listen_cache_test_0";
+		const int initial_value = rand();
+		const int changed_value = initial_value + 1;
+
+		{
+			Document new_document;
+			DocumentFields& fields = *new_document.mutable_fields();
+			Value v;
+			v.set_integer_value(initial_value);
+			fields["Value"] = v;
+			assert(firestore->UpdateDocument(document_path, new_document) == true);
+		}
+
+		std::atomic<int64_t> last_value = -1;
+		int32_t listen_id = firestore->Listen(document_path, [&](const Document *document)
+		{
+			assert(document != nullptr);
+			last_value = document->fields().at("Value").integer_value();
+		});
+		assert(listen_id >= 0);
+		while(last_value != initial_value) { std::this_thread::sleep_for(std::chrono::milliseconds(100)); }
+
+		// Change the document behind the back of the first Firestore object
+		{
+			Firestore other_firestore(project_id, database_id);
+			Document new_document;
+			DocumentFields& fields = *new_document.mutable_fields();
+			Value v;
+			v.set_integer_value(changed_value);
+			fields["Value"] = v;
+			assert(other_firestore.UpdateDocument(document_path, new_document) == true);
+		}
+		while(last_value != changed_value) { std::this_thread::sleep_for(std::chrono::milliseconds(100)); }
+
+		// The reads see the change without going to the server,
+		// so they take far less than a round trip each
+		const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for(int i = 0; i < 100; i++)
+		{
+			Document document;
+			assert(firestore->GetDocument(document_path, &document) == true);
+			assert(document.fields().at("Value").integer_value() == changed_value);
+		}
+		assert(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(100));
+
+		assert(firestore->Unlisten(listen_id) == true);
+	}
+
+	// Testing: Listen() resumes the listeners of an earlier Firestore object
+	// that shared its document store
+	{
+		FirestoreSettings settings;
+		settings.document_store_path = ".";
+		const std::string document_path = collection + "/listen_resume_test_0";
+		const int random_value = rand();
+
+		// The second run finds the document changed while it was down,
+		// the third one finds it unchanged and is served from the store
+		for(int i = 0; i < 3; i++)
+		{
+			if(i < 2)
+			{
+				Document new_document;
+				DocumentFields& fields = *new_document.mutable_fields();
+				Value v;
+				v.set_integer_value(random_value + i);
+				fields["Value"] = v;
+				assert(firestore->UpdateDocument(document_path, new_document) == true);
+			}
+
+			Firestore resumed_firestore(project_id, database_id, settings);
+			const int expected_value = random_value + std::min(i, 1);
+			std::atomic<int64_t> last_value = -1;
+			int32_t listen_id = resumed_firestore.Listen(document_path, [&](const Document *document)
+			{
+				assert(document != nullptr);
+				last_value = document->fields().at("Value").integer_value();
+			});
+			assert(listen_id >= 0);
+			while(last_value != expected_value) { std::this_thread::sleep_for(std::chrono::milliseconds(100)); }
+
+			// Give the server time to send a resume token
+			std::this_thread::sleep_for(std::chrono::seconds(2));
+		}
+	}
+
+	// Testing: No callbacks are invoked after Unlisten() returns
+	{
+		const std::string document_path = collection + "/unlisten_test_0";
+		const std::string full_document_path = firestore->GetFullDocumentPath(document_path);
+
+		std::atomic<bool> listen_initialized = false;
+		std::atomic<bool> unlistened = false;
+		int32_t listen_id = firestore->Listen(document_path, [&](const Document *document)
+		{
+			assert(!unlistened);
+			assert(document == nullptr || document->name() == full_document_path);
+			listen_initialized = true;
+		});
+		assert(listen_id >= 0);
+		waitUntil(listen_initialized);
+
+		assert(firestore->Unlisten(listen_id) == true);
+		unlistened = true;
+
+		// Changing the document must not reach the removed listener
+		Document new_document;
+		DocumentFields& fields = *new_document.mutable_fields();
+		Value v;
+		v.set_integer_value(rand());
+		fields["Value"] = v;
+		assert(firestore->UpdateDocument(document_path, new_document) == true);
+		std::this_thread::sleep_for(std::chrono::seconds(2));
+	}
+
 	// Testing: Unlisten() when listening thread does not exists
 	{
 		assert(firestore->Unlisten(-1) == false);
@@ -307,10 +1557,58 @@ int main()
 	//	}
 	//}
 
+	// Testing: Spreading calls over a pool of channels
+	{
+		FirestoreSettings settings;
+		settings.num_channels = 4;
+		settings.channel_selection = FirestoreSettings::LEAST_IN_FLIGHT;
+		Firestore pooled_firestore(project_id, database_id, settings);
+		assert(pooled_firestore.GetChannelInFlightCounts().size() == 4);
+
+		std::vector<Document> documents(32);
+		std::vector<std::future<bool>> futures;
+		for(size_t i = 0; i < documents.size(); i++)
+		{
+			futures.push_back(pooled_firestore.GetDocumentAsync(collection + "/user", &documents[i]));
+		}
+		for(std::future<bool>& f : futures)
+		{
+			assert(f.get() == true);
+		}
+
+		// Every call has completed, so the counters should drop back to zero
+		// (a call is released right after its future is set)
+		std::atomic<bool> drained = false;
+		while(!drained)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			drained = true;
+			for(int32_t count : pooled_firestore.GetChannelInFlightCounts())
+			{
+				drained = drained && count == 0;
+			}
+		}
+	}
+
 	// Verify that destructor works as expected
-	// (may take a minute for the listerner threads to finish
-	//  as they may be waiting for a NO_CHANGE signal)
-	delete firestore;
+	// (the listen stream is cancelled, so this should not wait for the server)
+	{
+		const std::string document_path = collection + "/user";
+		const std::string full_document_path = firestore->GetFullDocumentPath(document_path);
+		std::atomic<bool> listen_initialized = false;
+		int32_t listen_id = firestore->Listen(document_path, [&](const Document *document)
+		{
+			// Written by the first test
+			assert(document != nullptr && document->name() == full_document_path);
+			listen_initialized = true;
+		});
+		assert(listen_id >= 0);
+		waitUntil(listen_initialized);
+
+		const auto start = std::chrono::steady_clock::now();
+		delete firestore;
+		assert(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+	}
 
 	std::cout << "All tests passed successfully" << std::endl;
 
@@ -0,0 +1,284 @@
+#include "bulk_writer.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace firebase {
+namespace firestore {
+
+BulkWriter::BulkWriter(Firestore &firestore, const BulkWriterOptions &options) :
+	firestore(firestore),
+	options(options),
+	next_sequence(0),
+	batches_in_flight(0),
+	stopping(false),
+	started(false),
+	available_writes(0.0)
+{
+	thread = std::thread(&BulkWriter::Run, this);
+}
+
+BulkWriter::~BulkWriter()
+{
+	Flush();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	condition.notify_all();
+	thread.join();
+}
+
+std::future<bool> BulkWriter::UpdateDocument(const std::string &document_path, const Document &new_document)
+{
+	google::firestore::v1::Write write;
+	Document *document = write.mutable_update();
+	*document = new_document;
+	document->set_name(firestore.GetFullDocumentPath(document_path));
+	return Write(write);
+}
+
+std::future<bool> BulkWriter::DeleteDocument(const std::string &document_path)
+{
+	google::firestore::v1::Write write;
+	write.set_delete_(firestore.GetFullDocumentPath(document_path));
+	return Write(write);
+}
+
+std::future<bool> BulkWriter::Write(const google::firestore::v1::Write &write)
+{
+	const std::string document_name = Firestore::GetWriteDocumentName(write);
+	if(document_name.empty())
+	{
+		std::cerr << "BulkWriter::Write(): Write has no operation; skipping." << std::endl;
+		std::promise<bool> failed;
+		failed.set_value(false);
+		return failed.get_future();
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// A document may only be written once per commit
+	if(current_batch && current_batch->document_names.count(document_name) > 0)
+	{
+		CloseBatch();
+	}
+
+	if(!current_batch)
+	{
+		current_batch.reset(new Batch);
+		current_batch->request.set_database(firestore.database_base_path);
+		current_batch->sequence = next_sequence++;
+		current_batch->attempts = 0;
+	}
+	*current_batch->request.add_writes() = write;
+	current_batch->document_names.insert(document_name);
+	current_batch->results.emplace_back();
+	std::future<bool> future = current_batch->results.back().get_future();
+
+	if((uint32_t)current_batch->request.writes_size() >= options.max_batch_size)
+	{
+		CloseBatch();
+	}
+	return future;
+}
+
+void BulkWriter::Flush()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	CloseBatch();
+	condition.wait(lock, [this]() { return pending_batches.empty() && batches_in_flight == 0; });
+}
+
+void BulkWriter::CloseBatch()
+{
+	// Hand the batch over to the dispatcher thread
+	if(current_batch)
+	{
+		pending_batches.push_back(std::move(current_batch));
+		condition.notify_all();
+	}
+}
+
+void BulkWriter::SendBatch(std::unique_ptr<Batch> batch)
+{
+	batches_in_flight++;
+	batch->attempts++;
+	for(const std::string &document_name : batch->document_names)
+	{
+		claimed_documents[document_name] = batch.get();
+	}
+
+	// The batch is owned by the commit callback until it completes
+	Batch *sent_batch = batch.release();
+	firestore.CommitAsync(sent_batch->request, [this, sent_batch](const grpc::Status &status, google::firestore::v1::CommitResponse*)
+	{
+		OnBatchCommitted(sent_batch, status);
+	});
+}
+
+void BulkWriter::OnBatchCommitted(Batch *batch, const grpc::Status &status)
+{
+	std::unique_ptr<Batch> committed_batch(batch);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	batches_in_flight--;
+
+	if(status.ok())
+	{
+		ReleaseDocuments(*committed_batch);
+		for(std::promise<bool> &result : committed_batch->results)
+		{
+			result.set_value(true);
+		}
+	}
+	else
+	{
+		// Transient errors (including being throttled) are retried with exponential backoff
+		const grpc::StatusCode code = status.error_code();
+		const bool retryable =
+			code == grpc::StatusCode::ABORTED ||
+			code == grpc::StatusCode::UNAVAILABLE ||
+			code == grpc::StatusCode::RESOURCE_EXHAUSTED ||
+			code == grpc::StatusCode::DEADLINE_EXCEEDED;
+		if(retryable && committed_batch->attempts <= options.max_retries)
+		{
+			verbose << "BulkWriter::OnBatchCommitted(): Commit failed with code=" << code << "; retrying" << std::endl;
+			const std::chrono::milliseconds backoff(std::min(100 << std::min(committed_batch->attempts, 8u), 30000));
+			committed_batch->not_before = std::chrono::steady_clock::now() + backoff;
+
+			// The batch keeps its documents, and goes back ahead of the later batches
+			const uint64_t sequence = committed_batch->sequence;
+			auto itr = std::upper_bound(pending_batches.begin(), pending_batches.end(), sequence,
+				[](const uint64_t sequence, const std::unique_ptr<Batch> &batch) { return sequence < batch->sequence; });
+			pending_batches.insert(itr, std::move(committed_batch));
+		}
+		else
+		{
+			ReleaseDocuments(*committed_batch);
+			std::cout << "BulkWriter::OnBatchCommitted(): Received ok=false" << std::endl;
+			std::cout << "Message:" << std::endl;
+			std::cout << status.error_message() << std::endl;
+			std::cout << status.error_details() << std::endl;
+			for(std::promise<bool> &result : committed_batch->results)
+			{
+				result.set_value(false);
+			}
+		}
+	}
+	condition.notify_all();
+}
+
+void BulkWriter::ReleaseDocuments(const Batch &batch)
+{
+	for(const std::string &document_name : batch.document_names)
+	{
+		auto itr = claimed_documents.find(document_name);
+		if(itr != claimed_documents.end() && itr->second == &batch)
+		{
+			claimed_documents.erase(itr);
+		}
+	}
+}
+
+std::deque<std::unique_ptr<BulkWriter::Batch>>::iterator BulkWriter::FindNextBatch(const std::chrono::steady_clock::time_point now,
+	std::chrono::steady_clock::time_point *retry_time_out)
+{
+	// The oldest batch whose documents are not written by another batch in flight or
+	// waiting to be retried, nor by an older batch that has to wait
+	std::set<std::string> waiting_documents;
+	*retry_time_out = std::chrono::steady_clock::time_point::max();
+	for(auto itr = pending_batches.begin(); itr != pending_batches.end(); ++itr)
+	{
+		const Batch &batch = **itr;
+		bool ready = batch.not_before <= now; // Batches that are being retried wait for their backoff to expire
+		for(auto name_itr = batch.document_names.begin(); name_itr != batch.document_names.end() && ready; ++name_itr)
+		{
+			auto claim_itr = claimed_documents.find(*name_itr);
+			ready = (claim_itr == claimed_documents.end() || claim_itr->second == &batch) && waiting_documents.count(*name_itr) == 0;
+		}
+		if(ready)
+		{
+			return itr;
+		}
+		if(batch.not_before > now)
+		{
+			*retry_time_out = std::min(*retry_time_out, batch.not_before);
+		}
+		waiting_documents.insert(batch.document_names.begin(), batch.document_names.end());
+	}
+	return pending_batches.end();
+}
+
+double BulkWriter::GetWritesPerSecond(const std::chrono::steady_clock::time_point now) const
+{
+	if(!started)
+	{
+		return options.initial_writes_per_second;
+	}
+	const double ramp_ups = std::floor(std::chrono::duration<double>(now - start_time) / options.ramp_up_interval);
+	return std::min(options.initial_writes_per_second * std::pow(options.ramp_up_factor, ramp_ups), options.max_writes_per_second);
+}
+
+void BulkWriter::Run()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while(!stopping)
+	{
+		if(pending_batches.empty() || batches_in_flight >= options.max_batches_in_flight)
+		{
+			condition.wait(lock);
+			continue;
+		}
+
+		// Wait for a batch whose earlier writes to the same documents have settled
+		const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		std::chrono::steady_clock::time_point retry_time;
+		auto next_itr = FindNextBatch(now, &retry_time);
+		if(next_itr == pending_batches.end())
+		{
+			if(retry_time != std::chrono::steady_clock::time_point::max())
+			{
+				condition.wait_until(lock, retry_time);
+			}
+			else
+			{
+				condition.wait(lock);
+			}
+			continue;
+		}
+		const Batch &batch = **next_itr;
+
+		// The ramp-up starts with the first commit
+		if(!started)
+		{
+			started = true;
+			start_time = now;
+			last_refill_time = now;
+			available_writes = options.initial_writes_per_second;
+		}
+
+		// Refill the token bucket; it holds at most one second worth of writes
+		const double writes_per_second = GetWritesPerSecond(now);
+		available_writes = std::min(writes_per_second, available_writes + writes_per_second * std::chrono::duration<double>(now - last_refill_time).count());
+		last_refill_time = now;
+
+		// Wait until there is room for the batch
+		// (or for a full second worth of writes, if the batch is larger than that)
+		const double batch_size = batch.request.writes_size();
+		const double required_writes = std::min(batch_size, writes_per_second);
+		if(available_writes < required_writes)
+		{
+			condition.wait_for(lock, std::chrono::duration<double>((required_writes - available_writes) / writes_per_second));
+			continue;
+		}
+		available_writes -= batch_size;
+
+		std::unique_ptr<Batch> next_batch = std::move(*next_itr);
+		pending_batches.erase(next_itr);
+		SendBatch(std::move(next_batch));
+	}
+}
+
+} // namespace firestore
+} // namespace firebase
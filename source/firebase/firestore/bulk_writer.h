@@ -0,0 +1,140 @@
+#ifndef FIRESTORE_SRC_FIREBASE_FIRESTORE_BULK_WRITER_H
+#define FIRESTORE_SRC_FIREBASE_FIRESTORE_BULK_WRITER_H
+
+#include <chrono>
+
+#include "firestore.h"
+
+namespace firebase {
+namespace firestore {
+
+/**
+ * Tuning parameters for a BulkWriter
+ */
+struct BulkWriterOptions
+{
+	/** Maximum number of writes per commit (Firestore allows at most 500) */
+	uint32_t max_batch_size = 500;
+
+	/** Maximum number of commits in flight at the same time */
+	uint32_t max_batches_in_flight = 10;
+
+	/**
+	 * The write rate starts at 'initial_writes_per_second' and is multiplied by
+	 * 'ramp_up_factor' every 'ramp_up_interval', until it reaches 'max_writes_per_second'.
+	 * The defaults follow Firestore's 500/50/5 rule for ramping up traffic.
+	 */
+	double initial_writes_per_second = 500.0;
+	double max_writes_per_second = 10000.0;
+	double ramp_up_factor = 1.5;
+	std::chrono::steady_clock::duration ramp_up_interval = std::chrono::minutes(5);
+
+	/** Number of times a commit is retried after a transient error */
+	uint32_t max_retries = 5;
+};
+
+/**
+ * This class writes large numbers of documents to a Firestore database.
+ *
+ * Writes are accumulated into commits of up to 500 writes, and several
+ * commits are kept in flight at once. The write rate is ramped up gradually,
+ * so that the database is not hit with a sudden spike of traffic.
+ *
+ * Every write returns a future that becomes true once the commit containing
+ * the write has succeeded. Note that the writes of one commit succeed or fail together.
+ *
+ * Writes to the same document are committed in the order they were made:
+ * a commit that writes a document is only sent once the earlier commits
+ * writing it have succeeded or failed for good, retries included.
+ *
+ * The Firestore object must outlive the BulkWriter.
+ */
+class FIRESTORE_EXPORT BulkWriter
+{
+public:
+	BulkWriter(Firestore &firestore, const BulkWriterOptions &options=BulkWriterOptions());
+
+	/**
+	 * Waits for all the outstanding writes (see BulkWriter::Flush)
+	 */
+	~BulkWriter();
+
+	/**
+	 * Updates or inserts a new document at path 'document_path'.
+	 *
+	 * \param document_path The path of the document to update or insert
+	 * \param new_document  Document to update or insert
+	 * \returns             A future that becomes true once the write is committed
+	 */
+	std::future<bool> UpdateDocument(const std::string &document_path, const Document &new_document);
+
+	/**
+	 * Deletes the document at path 'document_path'.
+	 *
+	 * \param document_path The path of the document to delete
+	 * \returns             A future that becomes true once the delete is committed
+	 */
+	std::future<bool> DeleteDocument(const std::string &document_path);
+
+	/**
+	 * Adds a write operation. Document names in the write must be full paths
+	 * (see Firestore::GetFullDocumentPath).
+	 *
+	 * \param write The write to commit
+	 * \returns     A future that becomes true once the write is committed
+	 */
+	std::future<bool> Write(const google::firestore::v1::Write &write);
+
+	/**
+	 * Sends any partially filled commit and blocks until every write
+	 * added so far has either been committed or has failed.
+	 */
+	void Flush();
+
+private:
+	struct Batch
+	{
+		google::firestore::v1::CommitRequest request;
+		std::vector<std::promise<bool>> results;
+		std::set<std::string> document_names;
+		uint64_t sequence; // Batches are sent in this order, unless they write different documents
+		uint32_t attempts;
+		std::chrono::steady_clock::time_point not_before;
+	};
+
+	void CloseBatch();
+	void SendBatch(std::unique_ptr<Batch> batch);
+	void OnBatchCommitted(Batch *batch, const grpc::Status &status);
+	void ReleaseDocuments(const Batch &batch);
+	std::deque<std::unique_ptr<Batch>>::iterator FindNextBatch(const std::chrono::steady_clock::time_point now,
+		std::chrono::steady_clock::time_point *retry_time_out);
+	double GetWritesPerSecond(const std::chrono::steady_clock::time_point now) const;
+	void Run();
+
+	Firestore &firestore;
+	const BulkWriterOptions options;
+
+	std::thread thread; // Dispatches the batches at the allowed rate
+
+	std::mutex mutex; // Guards everything below
+	std::condition_variable condition;
+	std::unique_ptr<Batch> current_batch;
+	std::deque<std::unique_ptr<Batch>> pending_batches; // By sequence
+	uint64_t next_sequence;
+	uint32_t batches_in_flight;
+
+	// Documents written by the batches in flight or waiting to be retried, and the batch writing them
+	std::map<std::string, const Batch*> claimed_documents;
+	bool stopping;
+
+	// Token bucket limiting the write rate
+	bool started;
+	std::chrono::steady_clock::time_point start_time;
+	std::chrono::steady_clock::time_point last_refill_time;
+	double available_writes;
+};
+
+} // namespace firestore
+} // namespace firebase
+
+#endif // FIRESTORE_SRC_FIREBASE_FIRESTORE_BULK_WRITER_H
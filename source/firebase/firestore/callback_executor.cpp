@@ -0,0 +1,131 @@
+#include "callback_executor.h"
+
+#include <algorithm>
+
+namespace firebase {
+namespace firestore {
+
+CallbackExecutor::CallbackExecutor(const uint32_t num_threads, const size_t max_queued, const OverflowPolicy overflow_policy) :
+	max_queued_per_worker(std::max<size_t>(max_queued / std::max<uint32_t>(num_threads, 1), 1)),
+	overflow_policy(overflow_policy)
+{
+	for(uint32_t i = 0; i < std::max<uint32_t>(num_threads, 1); i++)
+	{
+		workers.emplace_back(new Worker());
+		Worker &worker = *workers.back();
+		worker.running = false;
+		worker.running_key = 0;
+		worker.stopping = false;
+		worker.thread = std::thread(&CallbackExecutor::Run, this, std::ref(worker));
+	}
+}
+
+CallbackExecutor::~CallbackExecutor()
+{
+	for(std::unique_ptr<Worker> &worker : workers)
+	{
+		std::lock_guard<std::mutex> lock(worker->mutex);
+		worker->stopping = true;
+		worker->queue.clear();
+		worker->condition.notify_all();
+	}
+	for(std::unique_ptr<Worker> &worker : workers)
+	{
+		if(worker->thread.joinable())
+		{
+			worker->thread.join();
+		}
+	}
+}
+
+void CallbackExecutor::Post(const int32_t key, const std::function<void()> &callback, const bool droppable)
+{
+	Worker &worker = *workers[(uint32_t)key % workers.size()];
+	std::unique_lock<std::mutex> lock(worker.mutex);
+	if(overflow_policy == OVERFLOW_COALESCE_LATEST && droppable)
+	{
+		// The new callback supersedes the one queued with the same key, even while there is room
+		Coalesce(worker, key);
+	}
+	if(worker.queue.size() >= max_queued_per_worker && !MakeRoom(worker))
+	{
+		// A callback posted from the worker itself would wait for itself forever,
+		// so the queue goes over its bound instead
+		if(std::this_thread::get_id() != worker.thread.get_id())
+		{
+			worker.condition.wait(lock, [&worker, this]() { return worker.stopping || worker.queue.size() < max_queued_per_worker; });
+		}
+	}
+	if(worker.stopping)
+	{
+		return;
+	}
+	worker.queue.push_back({ key, callback, droppable });
+	worker.condition.notify_all();
+}
+
+void CallbackExecutor::Coalesce(Worker &worker, const int32_t key)
+{
+	worker.queue.erase(std::remove_if(worker.queue.begin(), worker.queue.end(),
+		[key](const Task &task) { return task.droppable && task.key == key; }), worker.queue.end());
+}
+
+bool CallbackExecutor::MakeRoom(Worker &worker)
+{
+	if(overflow_policy != OVERFLOW_DROP_OLDEST)
+	{
+		return false;
+	}
+	for(auto itr = worker.queue.begin(); itr != worker.queue.end(); ++itr)
+	{
+		if(itr->droppable)
+		{
+			worker.queue.erase(itr);
+			return true;
+		}
+	}
+	return false;
+}
+
+void CallbackExecutor::Cancel(const int32_t key)
+{
+	Worker &worker = *workers[(uint32_t)key % workers.size()];
+	std::unique_lock<std::mutex> lock(worker.mutex);
+	worker.queue.erase(std::remove_if(worker.queue.begin(), worker.queue.end(), [key](const Task &task) { return task.key == key; }),
+		worker.queue.end());
+	worker.condition.notify_all();
+	if(std::this_thread::get_id() != worker.thread.get_id())
+	{
+		worker.condition.wait(lock, [&worker, key]() { return !worker.running || worker.running_key != key; });
+	}
+}
+
+void CallbackExecutor::Run(Worker &worker)
+{
+	std::unique_lock<std::mutex> lock(worker.mutex);
+	while(true)
+	{
+		worker.condition.wait(lock, [&worker]() { return worker.stopping || !worker.queue.empty(); });
+		if(worker.stopping)
+		{
+			return;
+		}
+
+		Task task = std::move(worker.queue.front());
+		worker.queue.pop_front();
+		worker.running = true;
+		worker.running_key = task.key;
+		worker.condition.notify_all(); // There is room in the queue
+
+		// Run the callback without holding the lock, so that it may post or cancel callbacks itself
+		lock.unlock();
+		task.callback();
+		lock.lock();
+
+		worker.running = false;
+		worker.condition.notify_all();
+	}
+}
+
+} // namespace firestore
+} // namespace firebase
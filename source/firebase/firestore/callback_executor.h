@@ -0,0 +1,103 @@
+#ifndef FIRESTORE_SRC_FIREBASE_FIRESTORE_CALLBACK_EXECUTOR_H
+#define FIRESTORE_SRC_FIREBASE_FIRESTORE_CALLBACK_EXECUTOR_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace firebase {
+namespace firestore {
+
+/**
+ * Runs callbacks on a set of threads of its own, so that the thread handing
+ * them over does not have to wait for them to return.
+ *
+ * Every callback is posted with a key. Callbacks with the same key always run
+ * on the same thread, one at a time and in the order they were posted.
+ * Each thread has a queue of bounded size; what happens when a callback is
+ * posted to a full queue is decided by the overflow policy.
+ */
+class CallbackExecutor
+{
+public:
+	/**
+	 * What to do when a callback is posted to a full queue
+	 */
+	enum OverflowPolicy
+	{
+		OVERFLOW_BLOCK,          // Wait for room in the queue
+		OVERFLOW_DROP_OLDEST,    // Drop the oldest droppable callback in the queue
+		OVERFLOW_COALESCE_LATEST // A droppable callback always replaces the droppable one queued with the same key
+	};
+
+	/**
+	 * \param num_threads      Number of threads running the callbacks
+	 * \param max_queued       Maximum number of callbacks waiting to run, over all threads
+	 * \param overflow_policy  What to do when a callback is posted to a full queue
+	 */
+	CallbackExecutor(const uint32_t num_threads, const size_t max_queued, const OverflowPolicy overflow_policy);
+
+	/**
+	 * Drops the callbacks that are still queued, and waits for the running ones to return
+	 */
+	~CallbackExecutor();
+
+	CallbackExecutor(const CallbackExecutor&) = delete;
+	CallbackExecutor &operator=(const CallbackExecutor&) = delete;
+
+	/**
+	 * Queues a callback to run on the thread of 'key'.
+	 *
+	 * With OVERFLOW_COALESCE_LATEST, a droppable callback first replaces the droppable
+	 * callback queued with the same key, whether the queue is full or not. When the queue
+	 * is still full and no droppable callback can make room for this one, this waits
+	 * for room, whatever the overflow policy.
+	 *
+	 * \param key       Callbacks with the same key run one at a time, in order
+	 * \param callback  The callback to run
+	 * \param droppable Whether the callback may be dropped to make room for another
+	 */
+	void Post(const int32_t key, const std::function<void()> &callback, const bool droppable);
+
+	/**
+	 * Drops the queued callbacks of 'key', and waits for the running one to return,
+	 * unless this is called from that callback.
+	 */
+	void Cancel(const int32_t key);
+
+private:
+	struct Task
+	{
+		int32_t key;
+		std::function<void()> callback;
+		bool droppable;
+	};
+
+	struct Worker
+	{
+		std::mutex mutex; // Guards everything below
+		std::condition_variable condition;
+		std::deque<Task> queue;
+		bool running; // Whether a callback is running
+		int32_t running_key;
+		bool stopping;
+		std::thread thread;
+	};
+
+	void Run(Worker &worker);
+	void Coalesce(Worker &worker, const int32_t key);
+	bool MakeRoom(Worker &worker);
+
+	const size_t max_queued_per_worker;
+	const OverflowPolicy overflow_policy;
+	std::vector<std::unique_ptr<Worker>> workers;
+};
+
+} // namespace firestore
+} // namespace firebase
+
+#endif // FIRESTORE_SRC_FIREBASE_FIRESTORE_CALLBACK_EXECUTOR_H
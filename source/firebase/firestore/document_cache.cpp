@@ -0,0 +1,173 @@
+#include "document_cache.h"
+
+namespace firebase {
+namespace firestore {
+
+DocumentCache::DocumentCache(const size_t max_size) :
+	max_size(max_size),
+	size(0)
+{
+}
+
+bool DocumentCache::Get(const std::string &name, MaybeDocument *document_out)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	auto itr = entry_index.find(name);
+	if(itr == entry_index.end())
+	{
+		return false;
+	}
+
+	// Move the entry to the front of the LRU list
+	entries.splice(entries.begin(), entries, itr->second);
+	if(document_out != nullptr)
+	{
+		*document_out = itr->second->document;
+	}
+	return true;
+}
+
+void DocumentCache::Put(const std::string &name, const MaybeDocument &document)
+{
+	Entry entry;
+	entry.name = name;
+	entry.document = document;
+	Insert(std::move(entry));
+}
+
+void DocumentCache::PutDocument(const google::firestore::v1::Document &document)
+{
+	Entry entry;
+	entry.name = document.name();
+	*entry.document.mutable_document() = document;
+	Insert(std::move(entry));
+}
+
+void DocumentCache::PutNoDocument(const std::string &name, const google::protobuf::Timestamp &read_time)
+{
+	Entry entry;
+	entry.name = name;
+	::firestore::client::NoDocument *no_document = entry.document.mutable_no_document();
+	no_document->set_name(name);
+	*no_document->mutable_read_time() = read_time;
+	Insert(std::move(entry));
+}
+
+void DocumentCache::Remove(const std::string &name)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	auto itr = entry_index.find(name);
+	if(itr == entry_index.end())
+	{
+		return;
+	}
+	size -= itr->second->size;
+	entries.erase(itr->second);
+	entry_index.erase(itr);
+}
+
+void DocumentCache::Clear()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	entries.clear();
+	entry_index.clear();
+	size = 0;
+}
+
+void DocumentCache::ForEach(const std::string &name_prefix, const std::function<void(const std::string &name, const MaybeDocument &document)> &function) const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	for(const Entry &entry : entries)
+	{
+		if(entry.name.compare(0, name_prefix.size(), name_prefix) == 0)
+		{
+			function(entry.name, entry.document);
+		}
+	}
+}
+
+size_t DocumentCache::GetSize() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return size;
+}
+
+// The server time at which an entry describes the document:
+// the update time of an existing document, or the read time of a missing one
+static const google::protobuf::Timestamp *GetVersion(const MaybeDocument &document)
+{
+	switch(document.document_type_case())
+	{
+		case MaybeDocument::kDocument:   return &document.document().update_time();
+		case MaybeDocument::kNoDocument: return &document.no_document().read_time();
+		default:                         return nullptr;
+	}
+}
+
+static bool IsBefore(const google::protobuf::Timestamp &a, const google::protobuf::Timestamp &b)
+{
+	return a.seconds() < b.seconds() || (a.seconds() == b.seconds() && a.nanos() < b.nanos());
+}
+
+bool DocumentCache::IsOlder(const MaybeDocument &document, const MaybeDocument &existing)
+{
+	const google::protobuf::Timestamp *version = GetVersion(document);
+	const google::protobuf::Timestamp *existing_version = GetVersion(existing);
+	if(version == nullptr || existing_version == nullptr)
+	{
+		return false;
+	}
+
+	// A read at some time sees every update made up to that time, so a document
+	// updated no later than it was last read missing has been deleted since
+	if(document.has_document() && existing.has_no_document())
+	{
+		return !IsBefore(*existing_version, *version);
+	}
+	return IsBefore(*version, *existing_version);
+}
+
+void DocumentCache::Insert(Entry &&entry)
+{
+	// The name is stored twice: in the entry and as the key of the index
+	entry.size = sizeof(Entry) + 2 * entry.name.size() + entry.document.SpaceUsedLong();
+
+	std::lock_guard<std::mutex> lock(mutex);
+	auto itr = entry_index.find(entry.name);
+	if(itr != entry_index.end())
+	{
+		// A slow read must not replace a version stored by a later write or listener
+		if(IsOlder(entry.document, itr->second->document))
+		{
+			return;
+		}
+		size -= itr->second->size;
+		entries.erase(itr->second);
+		entry_index.erase(itr);
+	}
+
+	// Entries that do not fit in the cache on their own are not cached
+	if(entry.size > max_size)
+	{
+		return;
+	}
+
+	size += entry.size;
+	entries.push_front(std::move(entry));
+	entry_index[entries.front().name] = entries.begin();
+	EvictLeastRecentlyUsed();
+}
+
+void DocumentCache::EvictLeastRecentlyUsed()
+{
+	while(size > max_size && !entries.empty())
+	{
+		const Entry &entry = entries.back();
+		size -= entry.size;
+		entry_index.erase(entry.name);
+		entries.pop_back();
+	}
+}
+
+} // namespace firestore
+} // namespace firebase
@@ -0,0 +1,110 @@
+#ifndef FIRESTORE_SRC_FIREBASE_FIRESTORE_DOCUMENT_CACHE_H
+#define FIRESTORE_SRC_FIREBASE_FIRESTORE_DOCUMENT_CACHE_H
+
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "firestore/local/maybe_document.pb.h"
+
+namespace firebase {
+namespace firestore {
+
+typedef ::firestore::client::MaybeDocument MaybeDocument;
+
+/**
+ * An in-memory cache of documents, keyed by their full path
+ * (projects/{project_id}/databases/{database_id}/documents/{document_path}).
+ *
+ * Entries are MaybeDocuments, so the cache remembers documents that are
+ * known not to exist as well. Once the entries take up more than the byte
+ * budget, the least recently used entries are evicted.
+ *
+ * The cache is thread-safe.
+ */
+class FIRESTORE_EXPORT DocumentCache
+{
+public:
+	/**
+	 * \param max_size Byte budget of the cache
+	 */
+	explicit DocumentCache(const size_t max_size);
+
+	/**
+	 * Looks up the entry of a document and marks it as recently used.
+	 *
+	 * \param name           Full path of the document
+	 * \param document_out   Receives a copy of the entry
+	 * \returns              True if the cache has an entry for the document
+	 */
+	bool Get(const std::string &name, MaybeDocument *document_out);
+
+	/**
+	 * Adds or replaces the entry of a document. An entry is only replaced
+	 * by one that is at least as recent (see IsOlder).
+	 */
+	void Put(const std::string &name, const MaybeDocument &document);
+
+	/**
+	 * Stores an existing document under its name
+	 */
+	void PutDocument(const google::firestore::v1::Document &document);
+
+	/**
+	 * Stores that the document at 'name' did not exist at 'read_time'
+	 */
+	void PutNoDocument(const std::string &name, const google::protobuf::Timestamp &read_time);
+
+	/**
+	 * Removes the entry of a document, if any
+	 */
+	void Remove(const std::string &name);
+
+	/**
+	 * Removes every entry
+	 */
+	void Clear();
+
+	/**
+	 * Calls 'function' with every entry whose name starts with 'name_prefix',
+	 * without marking them as recently used. The cache is locked meanwhile.
+	 */
+	void ForEach(const std::string &name_prefix, const std::function<void(const std::string &name, const MaybeDocument &document)> &function) const;
+
+	/**
+	 * Returns the number of bytes taken up by the entries
+	 */
+	size_t GetSize() const;
+
+	/**
+	 * Returns true if 'document' describes the document at an earlier server time
+	 * than 'existing', so it must not replace it. Existing documents are dated by
+	 * their update time and missing ones by their read time.
+	 */
+	static bool IsOlder(const MaybeDocument &document, const MaybeDocument &existing);
+
+private:
+	struct Entry
+	{
+		std::string name;
+		MaybeDocument document;
+		size_t size;
+	};
+
+	void Insert(Entry &&entry);
+	void EvictLeastRecentlyUsed();
+
+	const size_t max_size;
+
+	mutable std::mutex mutex; // Guards everything below
+	std::list<Entry> entries; // Most recently used first
+	std::unordered_map<std::string, std::list<Entry>::iterator> entry_index;
+	size_t size;
+};
+
+} // namespace firestore
+} // namespace firebase
+
+#endif // FIRESTORE_SRC_FIREBASE_FIRESTORE_DOCUMENT_CACHE_H
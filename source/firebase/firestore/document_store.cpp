@@ -0,0 +1,845 @@
+#include "document_store.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+namespace firebase {
+namespace firestore {
+
+static const char log_magic[8] = {'F', 'S', 'D', 'S', 'L', 'O', 'G', '1'};
+static const char index_magic[8] = {'F', 'S', 'D', 'S', 'I', 'D', 'X', '1'};
+
+// The log is checkpointed once this much has been appended since the last
+// index was written, and the appended part is larger than the indexed part
+static const uint64_t min_checkpoint_size = 4 * 1024 * 1024;
+
+// Logs smaller than this are never compacted
+static const uint64_t min_compaction_size = 1024 * 1024;
+
+static bool SeekFile(FILE *file, const uint64_t offset, const int origin)
+{
+#ifdef _WIN32
+	return _fseeki64(file, (__int64)offset, origin) == 0;
+#else
+	return fseeko(file, (off_t)offset, origin) == 0;
+#endif
+}
+
+static uint64_t TellFile(FILE *file)
+{
+#ifdef _WIN32
+	return (uint64_t)_ftelli64(file);
+#else
+	return (uint64_t)ftello(file);
+#endif
+}
+
+DocumentStore::DocumentStore() :
+	open(false),
+	log_writer(nullptr),
+	log_reader(nullptr),
+	flush_requested(false),
+	log_generation(0),
+	log_size(0),
+	index_valid(false),
+	indexed_log_size(0),
+	checkpoint_requested(false),
+	stopping(false)
+{
+}
+
+DocumentStore::~DocumentStore()
+{
+	Close();
+}
+
+bool DocumentStore::Open(const std::string &directory)
+{
+	Close();
+
+	std::lock_guard<std::mutex> checkpoint_lock(checkpoint_mutex);
+	std::unique_lock<std::mutex> lock(mutex);
+	this->directory = directory;
+	const std::string log_path = directory + "/documents.log";
+	const std::string index_path = directory + "/documents.index";
+
+	// Map the index; a missing or damaged index is rebuilt from the log
+	uint64_t index_generation = 0;
+	index_valid = false;
+	if(index.Open(index_path) && index.GetSize() >= sizeof(IndexHeader))
+	{
+		IndexHeader header;
+		memcpy(&header, index.GetData(), sizeof(IndexHeader));
+		if(memcmp(header.magic, index_magic, sizeof(index_magic)) == 0 &&
+			index.GetSize() == sizeof(IndexHeader) + header.num_entries * sizeof(IndexEntry))
+		{
+			index_generation = header.generation;
+			indexed_log_size = header.log_size;
+			index_valid = true;
+		}
+	}
+
+	// Read the header of the log
+	LogHeader log_header;
+	uint64_t log_file_size = 0;
+	bool log_valid = false;
+	if(FILE *file = fopen(log_path.c_str(), "rb"))
+	{
+		log_valid = fread(&log_header, sizeof(LogHeader), 1, file) == 1 &&
+			memcmp(log_header.magic, log_magic, sizeof(log_magic)) == 0 &&
+			SeekFile(file, 0, SEEK_END);
+		log_file_size = TellFile(file);
+		fclose(file);
+	}
+
+	// Start a new log if there is none
+	if(log_valid)
+	{
+		log_generation = log_header.generation;
+	}
+	else
+	{
+		// A new log never matches the index of an older one
+		memcpy(log_header.magic, log_magic, sizeof(log_magic));
+		log_header.generation = index_generation + 1;
+		FILE *file = fopen(log_path.c_str(), "wb");
+		if(file == nullptr)
+		{
+			std::cerr << "DocumentStore::Open(): Failed to create " << log_path << std::endl;
+			index.Close();
+			return false;
+		}
+		const bool written = fwrite(&log_header, sizeof(LogHeader), 1, file) == 1;
+		if(fclose(file) != 0 || !written)
+		{
+			std::cerr << "DocumentStore::Open(): Failed to write " << log_path << std::endl;
+			index.Close();
+			return false;
+		}
+		log_generation = log_header.generation;
+		log_file_size = sizeof(LogHeader);
+	}
+
+	// An index written for another log is of no use
+	if(!index_valid || index_generation != log_generation || indexed_log_size < sizeof(LogHeader) || indexed_log_size > log_file_size)
+	{
+		index.Close();
+		index_valid = false;
+		indexed_log_size = sizeof(LogHeader);
+	}
+
+	if(!OpenLog())
+	{
+		std::cerr << "DocumentStore::Open(): Failed to open " << log_path << std::endl;
+		index.Close();
+		return false;
+	}
+	open = true;
+
+	// Pick up the records appended after the index was written.
+	// A log that ends in a half-written record is rewritten without it,
+	// as new records would otherwise be appended after the broken one.
+	if(!ReplayLog(indexed_log_size, log_file_size) && !CheckpointLocked(lock, true))
+	{
+		std::cerr << "DocumentStore::Open(): Failed to repair " << log_path << std::endl;
+		CloseLog();
+		index.Close();
+		appended_records.clear();
+		open = false;
+		return false;
+	}
+
+	checkpoint_requested = false;
+	stopping = false;
+	checkpoint_thread = std::thread(&DocumentStore::RunCheckpoints, this);
+	return true;
+}
+
+void DocumentStore::Close()
+{
+	// The checkpoint thread takes the locks itself
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	checkpoint_condition.notify_all();
+	if(checkpoint_thread.joinable())
+	{
+		checkpoint_thread.join();
+	}
+
+	std::lock_guard<std::mutex> checkpoint_lock(checkpoint_mutex);
+	std::unique_lock<std::mutex> lock(mutex);
+	if(open)
+	{
+		CheckpointLocked(lock, false);
+	}
+	CloseLog();
+	index.Close();
+	index_valid = false;
+	appended_records.clear();
+	open = false;
+}
+
+bool DocumentStore::IsOpen() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return open;
+}
+
+bool DocumentStore::Get(const std::string &name, MaybeDocument *document_out) const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return GetLocked(name, document_out);
+}
+
+bool DocumentStore::GetLocked(const std::string &name, MaybeDocument *document_out) const
+{
+	if(!open)
+	{
+		return false;
+	}
+
+	// Find the latest record of the document
+	std::string record;
+	bool found = false;
+	auto itr = appended_records.find(name);
+	if(itr != appended_records.end())
+	{
+		found = !itr->second.removed && ReadRecord(itr->second.offset, itr->second.size, &record);
+	}
+	else if(index_valid)
+	{
+		// Entries with the same hash are sorted newest first
+		const uint64_t hash = HashName(name);
+		const IndexEntry *entries_end = GetIndexEntries() + GetNumIndexEntries();
+		const IndexEntry *entry = std::lower_bound(GetIndexEntries(), entries_end, hash,
+			[](const IndexEntry &entry, const uint64_t hash) { return entry.hash < hash; });
+		for(; entry != entries_end && entry->hash == hash && !found; entry++)
+		{
+			found = ReadRecord(entry->offset, entry->size, &record) &&
+				record.compare(sizeof(RecordHeader), name.size(), name) == 0 &&
+				((const RecordHeader*)record.data())->name_size == name.size();
+		}
+	}
+	if(!found)
+	{
+		return false;
+	}
+
+	RecordHeader header;
+	memcpy(&header, record.data(), sizeof(RecordHeader));
+	if(header.document_size == 0)
+	{
+		return false; // The record forgets the document
+	}
+	return document_out == nullptr ||
+		document_out->ParseFromArray(record.data() + sizeof(RecordHeader) + header.name_size, header.document_size);
+}
+
+void DocumentStore::ForEach(const std::string &name_prefix, const std::function<void(const std::string &name, const MaybeDocument &document)> &function) const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if(!open)
+	{
+		return;
+	}
+
+	std::string record;
+	std::string name;
+	MaybeDocument document;
+	auto visit_record = [&]()
+	{
+		RecordHeader header;
+		memcpy(&header, record.data(), sizeof(RecordHeader));
+		if(header.document_size != 0 &&
+			document.ParseFromArray(record.data() + sizeof(RecordHeader) + header.name_size, header.document_size))
+		{
+			function(name, document);
+		}
+	};
+
+	// Documents written since the index was written are visited from the appended records;
+	// should the index hold more than one entry for a document, the first one is the latest
+	if(index_valid)
+	{
+		const IndexEntry *entries = GetIndexEntries();
+		const uint64_t num_entries = GetNumIndexEntries();
+		std::vector<std::string> hash_names; // Names visited with the current hash
+		for(uint64_t i = 0; i < num_entries; i++)
+		{
+			if(i == 0 || entries[i].hash != entries[i - 1].hash)
+			{
+				hash_names.clear();
+			}
+			if(!ReadRecord(entries[i].offset, entries[i].size, &record))
+			{
+				continue;
+			}
+			name.assign(record, sizeof(RecordHeader), ((const RecordHeader*)record.data())->name_size);
+			if(name.compare(0, name_prefix.size(), name_prefix) != 0 ||
+				appended_records.count(name) != 0 ||
+				std::find(hash_names.begin(), hash_names.end(), name) != hash_names.end())
+			{
+				continue;
+			}
+			hash_names.push_back(name);
+			visit_record();
+		}
+	}
+
+	for(const auto &appended_record : appended_records)
+	{
+		if(appended_record.second.removed ||
+			appended_record.first.compare(0, name_prefix.size(), name_prefix) != 0 ||
+			!ReadRecord(appended_record.second.offset, appended_record.second.size, &record))
+		{
+			continue;
+		}
+		name = appended_record.first;
+		visit_record();
+	}
+}
+
+bool DocumentStore::Put(const std::string &name, const MaybeDocument &document)
+{
+	std::string serialized_document;
+	if(!document.SerializeToString(&serialized_document))
+	{
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// A slow read must not replace a version stored by a later write or listener
+	MaybeDocument existing;
+	if(GetLocked(name, &existing) && DocumentCache::IsOlder(document, existing))
+	{
+		return true;
+	}
+	return Append(name, serialized_document);
+}
+
+bool DocumentStore::PutDocument(const google::firestore::v1::Document &document)
+{
+	MaybeDocument maybe_document;
+	*maybe_document.mutable_document() = document;
+	return Put(document.name(), maybe_document);
+}
+
+bool DocumentStore::PutNoDocument(const std::string &name, const google::protobuf::Timestamp &read_time)
+{
+	MaybeDocument maybe_document;
+	::firestore::client::NoDocument *no_document = maybe_document.mutable_no_document();
+	no_document->set_name(name);
+	*no_document->mutable_read_time() = read_time;
+	return Put(name, maybe_document);
+}
+
+bool DocumentStore::Remove(const std::string &name)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// Most writes are to documents the store never held, which need no record
+	if(!GetLocked(name, nullptr))
+	{
+		return open;
+	}
+	return Append(name, std::string());
+}
+
+bool DocumentStore::Checkpoint()
+{
+	std::lock_guard<std::mutex> checkpoint_lock(checkpoint_mutex);
+	std::unique_lock<std::mutex> lock(mutex);
+	return CheckpointLocked(lock, false);
+}
+
+void DocumentStore::RunCheckpoints()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while(true)
+	{
+		checkpoint_condition.wait(lock, [this]() { return stopping || checkpoint_requested || flush_requested; });
+		if(stopping)
+		{
+			return;
+		}
+		if(!FlushLog())
+		{
+			std::cerr << "DocumentStore::RunCheckpoints(): Failed to write to " << directory << "/documents.log" << std::endl;
+			FailLog();
+		}
+		if(!checkpoint_requested)
+		{
+			continue;
+		}
+		checkpoint_requested = false;
+
+		lock.unlock();
+		Checkpoint();
+		lock.lock();
+	}
+}
+
+bool DocumentStore::Append(const std::string &name, const std::string &serialized_document)
+{
+	if(!open)
+	{
+		return false;
+	}
+
+	RecordHeader header;
+	header.name_size = (uint32_t)name.size();
+	header.document_size = (uint32_t)serialized_document.size();
+
+	std::string record;
+	record.reserve(sizeof(RecordHeader) + name.size() + serialized_document.size());
+	record.append((const char*)&header, sizeof(RecordHeader));
+	record.append(name);
+	record.append(serialized_document);
+	header.checksum = Checksum(record.data() + sizeof(uint32_t), record.size() - sizeof(uint32_t));
+	memcpy(&record[0], &header.checksum, sizeof(uint32_t));
+
+	// The record is only buffered here, as the caller may be a poller thread;
+	// the checkpoint thread flushes it, or the first read that needs it
+	if(fwrite(record.data(), 1, record.size(), log_writer) != record.size())
+	{
+		std::cerr << "DocumentStore::Append(): Failed to write to " << directory << "/documents.log" << std::endl;
+		FailLog();
+		return false;
+	}
+	if(!flush_requested)
+	{
+		flush_requested = true;
+		checkpoint_condition.notify_one();
+	}
+
+	Location &location = appended_records[name];
+	location.offset = log_size;
+	location.size = (uint32_t)record.size();
+	location.removed = serialized_document.empty();
+	log_size += record.size();
+
+	// Keep the part of the log that has to be replayed on Open small.
+	// The caller may be a poller thread, so the checkpoint thread does the work.
+	const uint64_t appended_size = log_size - indexed_log_size;
+	if(appended_size > min_checkpoint_size && appended_size > indexed_log_size && !checkpoint_requested)
+	{
+		checkpoint_requested = true;
+		checkpoint_condition.notify_one();
+	}
+	return true;
+}
+
+bool DocumentStore::FlushLog() const
+{
+	// The log is read through other files, which only see what was flushed
+	if(flush_requested)
+	{
+		if(log_writer == nullptr || fflush(log_writer) != 0)
+		{
+			return false;
+		}
+		flush_requested = false;
+	}
+	return true;
+}
+
+void DocumentStore::FailLog()
+{
+	// The log may end in a partial record now, which only Open can cut off
+	CloseLog();
+	index_valid = false; // The index stays mapped until Close, as a checkpoint may be reading it
+	appended_records.clear();
+	open = false;
+}
+
+bool DocumentStore::ReadRecord(const uint64_t offset, const uint32_t size, std::string *record_out) const
+{
+	return FlushLog() && ReadRecord(log_reader, offset, size, record_out);
+}
+
+bool DocumentStore::ReadRecord(FILE *reader, const uint64_t offset, const uint32_t size, std::string *record_out)
+{
+	if(size < sizeof(RecordHeader))
+	{
+		return false;
+	}
+
+	record_out->resize(size);
+	if(!SeekFile(reader, offset, SEEK_SET) || fread(&(*record_out)[0], 1, size, reader) != size)
+	{
+		return false;
+	}
+
+	RecordHeader header;
+	memcpy(&header, record_out->data(), sizeof(RecordHeader));
+	return sizeof(RecordHeader) + (uint64_t)header.name_size + header.document_size == size &&
+		header.checksum == Checksum(record_out->data() + sizeof(uint32_t), size - sizeof(uint32_t));
+}
+
+bool DocumentStore::ReplayLog(uint64_t offset, const uint64_t end)
+{
+	std::string record;
+	while(offset + sizeof(RecordHeader) <= end)
+	{
+		RecordHeader header;
+		if(!SeekFile(log_reader, offset, SEEK_SET) || fread(&header, sizeof(RecordHeader), 1, log_reader) != 1)
+		{
+			break;
+		}
+
+		const uint64_t size = sizeof(RecordHeader) + (uint64_t)header.name_size + header.document_size;
+		if(offset + size > end || !ReadRecord(offset, (uint32_t)size, &record))
+		{
+			break;
+		}
+
+		Location &location = appended_records[record.substr(sizeof(RecordHeader), header.name_size)];
+		location.offset = offset;
+		location.size = (uint32_t)size;
+		location.removed = header.document_size == 0;
+		offset += size;
+	}
+	log_size = offset;
+	return offset == end;
+}
+
+bool DocumentStore::CheckpointLocked(std::unique_lock<std::mutex> &lock, const bool compact)
+{
+	if(!open)
+	{
+		return false;
+	}
+	if(!compact && index_valid && appended_records.empty())
+	{
+		return true; // The index is up to date
+	}
+
+	// The checkpoint covers the log as it is now. Records are never changed once appended,
+	// so they are read without holding the lock, through a reader of our own, while
+	// reads and writes carry on. Only checkpoints replace the index, so it stays mapped.
+	const std::string log_path = directory + "/documents.log";
+	if(!FlushLog())
+	{
+		return false;
+	}
+	FILE *reader = fopen(log_path.c_str(), "rb");
+	if(reader == nullptr)
+	{
+		return false;
+	}
+	const uint64_t covered_log_size = log_size;
+	const uint64_t covered_log_generation = log_generation;
+	const std::vector<std::pair<std::string, Location>> covered_records(appended_records.begin(), appended_records.end());
+	const IndexEntry *index_entries = GetIndexEntries();
+	const uint64_t num_index_entries = GetNumIndexEntries();
+	lock.unlock();
+
+	// Drop the index entries of the documents that have been written since
+	std::vector<bool> superseded(num_index_entries, false);
+	std::string record;
+	for(const auto &covered_record : covered_records)
+	{
+		const std::string &name = covered_record.first;
+		const uint64_t hash = HashName(name);
+		const IndexEntry *entry = std::lower_bound(index_entries, index_entries + num_index_entries, hash,
+			[](const IndexEntry &entry, const uint64_t hash) { return entry.hash < hash; });
+		for(; entry != index_entries + num_index_entries && entry->hash == hash; entry++)
+		{
+			if(ReadRecord(reader, entry->offset, entry->size, &record) &&
+				((const RecordHeader*)record.data())->name_size == name.size() &&
+				record.compare(sizeof(RecordHeader), name.size(), name) == 0)
+			{
+				superseded[entry - index_entries] = true;
+			}
+		}
+	}
+
+	// Merge the remaining entries with the appended records
+	std::vector<IndexEntry> entries;
+	entries.reserve(num_index_entries + covered_records.size());
+	uint64_t live_size = 0;
+	for(uint64_t i = 0; i < num_index_entries; i++)
+	{
+		if(!superseded[i])
+		{
+			entries.push_back(index_entries[i]);
+			live_size += index_entries[i].size;
+		}
+	}
+	for(const auto &covered_record : covered_records)
+	{
+		if(!covered_record.second.removed)
+		{
+			IndexEntry entry;
+			entry.hash = HashName(covered_record.first);
+			entry.offset = covered_record.second.offset;
+			entry.size = covered_record.second.size;
+			entry.reserved = 0;
+			entries.push_back(entry);
+			live_size += entry.size;
+		}
+	}
+
+	// Should a record fail to read above, its stale entry is kept;
+	// sorting newer records first makes lookups still find the latest one
+	std::sort(entries.begin(), entries.end(),
+		[](const IndexEntry &a, const IndexEntry &b) { return a.hash < b.hash || (a.hash == b.hash && a.offset > b.offset); });
+
+	// Rewrite the log once stale records take up more than half of it
+	const uint64_t records_size = covered_log_size - sizeof(LogHeader);
+	if(compact || (covered_log_size > min_compaction_size && records_size > 2 * live_size))
+	{
+		uint64_t copied_log_size;
+		if(!WriteLog(lock, reader, &entries, covered_log_size, covered_log_generation + 1, &copied_log_size))
+		{
+			return false;
+		}
+
+		// Until the index is written, the live records can only be found through it
+		if(!WriteIndex(lock, entries, log_generation, copied_log_size))
+		{
+			// The log is complete on its own; find the documents by reading it
+			if(open)
+			{
+				appended_records.clear();
+				ReplayLog(sizeof(LogHeader), log_size);
+			}
+			return false;
+		}
+		return true;
+	}
+
+	fclose(reader);
+	if(!WriteIndex(lock, entries, covered_log_generation, covered_log_size))
+	{
+		return false;
+	}
+
+	// Records appended while the index was written are left for the next checkpoint
+	for(auto itr = appended_records.begin(); itr != appended_records.end();)
+	{
+		if(itr->second.offset < covered_log_size)
+		{
+			itr = appended_records.erase(itr);
+		}
+		else
+		{
+			++itr;
+		}
+	}
+	return true;
+}
+
+bool DocumentStore::WriteLog(std::unique_lock<std::mutex> &lock, FILE *reader, std::vector<IndexEntry> *entries, const uint64_t covered_log_size,
+	const uint64_t generation, uint64_t *copied_log_size_out)
+{
+	const std::string log_path = directory + "/documents.log";
+	const std::string temporary_path = log_path + ".tmp";
+	FILE *file = fopen(temporary_path.c_str(), "wb");
+	if(file == nullptr)
+	{
+		fclose(reader);
+		lock.lock();
+		return false;
+	}
+
+	LogHeader header;
+	memcpy(header.magic, log_magic, sizeof(log_magic));
+	header.generation = generation;
+	bool written = fwrite(&header, sizeof(LogHeader), 1, file) == 1;
+
+	// Copy the live records, leaving out entries that repeat a document
+	std::vector<IndexEntry> new_entries;
+	new_entries.reserve(entries->size());
+	std::vector<std::string> names; // Of the documents with the current hash
+	std::string record;
+	uint64_t offset = sizeof(LogHeader);
+	for(size_t i = 0; i < entries->size() && written; i++)
+	{
+		const IndexEntry &entry = (*entries)[i];
+		if(i == 0 || entry.hash != (*entries)[i - 1].hash)
+		{
+			names.clear();
+		}
+		if(!ReadRecord(reader, entry.offset, entry.size, &record))
+		{
+			continue; // Damaged records are lost
+		}
+
+		std::string name = record.substr(sizeof(RecordHeader), ((const RecordHeader*)record.data())->name_size);
+		if(std::find(names.begin(), names.end(), name) != names.end())
+		{
+			continue;
+		}
+		names.push_back(std::move(name));
+
+		written = fwrite(record.data(), 1, record.size(), file) == record.size();
+		IndexEntry new_entry = entry;
+		new_entry.offset = offset;
+		new_entries.push_back(new_entry);
+		offset += record.size();
+	}
+
+	// The records appended meanwhile follow the live records as they are
+	lock.lock();
+	const uint64_t copied_log_size = offset;
+	written = written && open && FlushLog() && SeekFile(reader, covered_log_size, SEEK_SET);
+	char buffer[64 * 1024];
+	for(uint64_t remaining = log_size - covered_log_size; remaining > 0 && written;)
+	{
+		const size_t size = (size_t)std::min<uint64_t>(remaining, sizeof(buffer));
+		written = fread(buffer, 1, size, reader) == size && fwrite(buffer, 1, size, file) == size;
+		remaining -= size;
+	}
+	fclose(reader);
+	if(fclose(file) != 0 || !written)
+	{
+		remove(temporary_path.c_str());
+		return false;
+	}
+
+	// Files can't be replaced while they are open on Windows
+	CloseLog();
+	index.Close();
+	index_valid = false;
+	if(!RenameFile(temporary_path, log_path))
+	{
+		remove(temporary_path.c_str());
+		OpenLog();
+		index_valid = index.Open(directory + "/documents.index");
+		return false;
+	}
+
+	std::unordered_map<std::string, Location> moved_records;
+	for(const auto &appended_record : appended_records)
+	{
+		if(appended_record.second.offset >= covered_log_size)
+		{
+			Location location = appended_record.second;
+			location.offset = copied_log_size + (location.offset - covered_log_size);
+			moved_records.emplace(appended_record.first, location);
+		}
+	}
+	appended_records.swap(moved_records);
+	log_generation = generation;
+	log_size = copied_log_size + (log_size - covered_log_size);
+	indexed_log_size = sizeof(LogHeader);
+	entries->swap(new_entries);
+	*copied_log_size_out = copied_log_size;
+	if(!OpenLog())
+	{
+		open = false;
+		return false;
+	}
+	return true;
+}
+
+bool DocumentStore::WriteIndex(std::unique_lock<std::mutex> &lock, const std::vector<IndexEntry> &entries, const uint64_t generation,
+	const uint64_t covered_log_size)
+{
+	const std::string index_path = directory + "/documents.index";
+	const std::string temporary_path = index_path + ".tmp";
+	FILE *file = fopen(temporary_path.c_str(), "wb");
+
+	IndexHeader header;
+	memcpy(header.magic, index_magic, sizeof(index_magic));
+	header.generation = generation;
+	header.log_size = covered_log_size;
+	header.num_entries = entries.size();
+	bool written = file != nullptr && fwrite(&header, sizeof(IndexHeader), 1, file) == 1;
+	if(written && !entries.empty())
+	{
+		written = fwrite(entries.data(), sizeof(IndexEntry), entries.size(), file) == entries.size();
+	}
+	if(!lock.owns_lock())
+	{
+		lock.lock();
+	}
+	if(file == nullptr)
+	{
+		return false;
+	}
+	if(fclose(file) != 0 || !written || !open)
+	{
+		remove(temporary_path.c_str());
+		return false;
+	}
+
+	// Files can't be replaced while they are mapped on Windows
+	index.Close();
+	if(!RenameFile(temporary_path, index_path))
+	{
+		remove(temporary_path.c_str());
+		index_valid = index_valid && index.Open(index_path);
+		return false;
+	}
+
+	index_valid = index.Open(index_path);
+	indexed_log_size = covered_log_size;
+	return index_valid;
+}
+
+bool DocumentStore::OpenLog()
+{
+	const std::string log_path = directory + "/documents.log";
+	log_reader = fopen(log_path.c_str(), "rb");
+	log_writer = fopen(log_path.c_str(), "ab");
+	if(log_reader == nullptr || log_writer == nullptr)
+	{
+		CloseLog();
+		return false;
+	}
+	return true;
+}
+
+void DocumentStore::CloseLog()
+{
+	if(log_reader != nullptr)
+	{
+		fclose(log_reader);
+		log_reader = nullptr;
+	}
+	if(log_writer != nullptr)
+	{
+		fclose(log_writer);
+		log_writer = nullptr;
+	}
+	flush_requested = false;
+}
+
+const DocumentStore::IndexEntry *DocumentStore::GetIndexEntries() const
+{
+	if(!index_valid)
+	{
+		return nullptr;
+	}
+	return (const IndexEntry*)(index.GetData() + sizeof(IndexHeader));
+}
+
+uint64_t DocumentStore::GetNumIndexEntries() const
+{
+	if(!index_valid)
+	{
+		return 0;
+	}
+	return (index.GetSize() - sizeof(IndexHeader)) / sizeof(IndexEntry);
+}
+
+uint64_t DocumentStore::HashName(const std::string &name)
+{
+	// 64-bit FNV-1a
+	uint64_t hash = 14695981039346656037ull;
+	for(const char c : name)
+	{
+		hash ^= (uint8_t)c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+} // namespace firestore
+} // namespace firebase
@@ -0,0 +1,212 @@
+#ifndef FIRESTORE_SRC_FIREBASE_FIRESTORE_DOCUMENT_STORE_H
+#define FIRESTORE_SRC_FIREBASE_FIRESTORE_DOCUMENT_STORE_H
+
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "document_cache.h"
+#include "mapped_file.h"
+
+namespace firebase {
+namespace firestore {
+
+/**
+ * A persistent store of documents, keyed by their full path
+ * (projects/{project_id}/databases/{database_id}/documents/{document_path}).
+ *
+ * The store lives in two files inside a directory:
+ *  - documents.log:   every MaybeDocument ever put in the store, appended one after the other
+ *  - documents.index: the location in the log of the latest record of every document,
+ *                     sorted by a hash of the document name
+ *
+ * Opening the store maps the index into memory and only reads the records
+ * appended to the log after the index was written, so a store of any size
+ * opens in a few milliseconds. A lookup is a binary search in the index
+ * followed by a single read from the log.
+ *
+ * Checkpoint() writes a new index, and rewrites the log without its stale
+ * records once those take up more space than the live ones. The store
+ * checkpoints on its own as the log grows, from a background thread, and
+ * when it is closed. The files are written without holding the lock of the
+ * store, so reads and writes carry on while a checkpoint is in progress.
+ *
+ * Every record carries a checksum, and a log left half-written by a crash
+ * is cut back to its last complete record. Writers only buffer their records;
+ * the background thread flushes them to the OS, so a crash may lose the
+ * latest writes. Records are not synced to the disk.
+ *
+ * The files use the byte order of the machine. The store is thread-safe,
+ * but a directory must only be opened by a single store at a time.
+ */
+class DocumentStore
+{
+public:
+	DocumentStore();
+	~DocumentStore();
+
+	DocumentStore(const DocumentStore&) = delete;
+	DocumentStore &operator=(const DocumentStore&) = delete;
+
+	/**
+	 * Opens the store in 'directory', creating its files if needed.
+	 * The directory itself must exist.
+	 *
+	 * \param directory  Directory holding the files of the store
+	 * \returns          True if the store was opened
+	 */
+	bool Open(const std::string &directory);
+
+	/**
+	 * Checkpoints and closes the store
+	 */
+	void Close();
+
+	bool IsOpen() const;
+
+	/**
+	 * Looks up the latest record of a document.
+	 *
+	 * \param name           Full path of the document
+	 * \param document_out   Receives the record
+	 * \returns              True if the store has a record for the document
+	 */
+	bool Get(const std::string &name, MaybeDocument *document_out) const;
+
+	/**
+	 * Appends a record for a document to the log. A stored record is only
+	 * replaced by one that is at least as recent (see DocumentCache::IsOlder).
+	 *
+	 * \returns True if the record was written or is older than the stored one
+	 */
+	bool Put(const std::string &name, const MaybeDocument &document);
+
+	/**
+	 * Stores an existing document under its name
+	 */
+	bool PutDocument(const google::firestore::v1::Document &document);
+
+	/**
+	 * Stores that the document at 'name' did not exist at 'read_time'
+	 */
+	bool PutNoDocument(const std::string &name, const google::protobuf::Timestamp &read_time);
+
+	/**
+	 * Forgets the document at 'name'. Nothing is written unless the store holds the document.
+	 */
+	bool Remove(const std::string &name);
+
+	/**
+	 * Calls 'function' with the latest record of every document whose name
+	 * starts with 'name_prefix'. This reads every record in the store;
+	 * the store is locked meanwhile.
+	 */
+	void ForEach(const std::string &name_prefix, const std::function<void(const std::string &name, const MaybeDocument &document)> &function) const;
+
+	/**
+	 * Writes a new index covering the whole log, compacting the log first
+	 * if most of it is stale records.
+	 *
+	 * \returns True if the index was written
+	 */
+	bool Checkpoint();
+
+private:
+	// Location of a record in the log, header included
+	struct Location
+	{
+		uint64_t offset;
+		uint32_t size;
+		bool removed; // The record forgets the document
+	};
+
+	struct LogHeader
+	{
+		char magic[8];
+		uint64_t generation; // Changes every time the log is rewritten
+	};
+
+	// Followed by the document name and the serialized MaybeDocument
+	struct RecordHeader
+	{
+		uint32_t checksum; // Of everything after this field
+		uint32_t name_size;
+		uint32_t document_size; // 0 for records that forget the document
+	};
+
+	struct IndexHeader
+	{
+		char magic[8];
+		uint64_t generation; // Of the log the index belongs to
+		uint64_t log_size;   // Length of the log covered by the index
+		uint64_t num_entries;
+	};
+
+	struct IndexEntry
+	{
+		uint64_t hash; // Of the document name
+		uint64_t offset;
+		uint32_t size;
+		uint32_t reserved;
+	};
+
+	bool GetLocked(const std::string &name, MaybeDocument *document_out) const;
+	bool Append(const std::string &name, const std::string &serialized_document);
+	bool ReadRecord(const uint64_t offset, const uint32_t size, std::string *record_out) const;
+	bool ReadRecordName(const uint64_t offset, const uint32_t size, std::string *name_out) const;
+	bool ReplayLog(uint64_t offset, const uint64_t end);
+	bool FlushLog() const;
+	void FailLog();
+	void RunCheckpoints();
+
+	// The checkpoint mutex must be held. The lock of the store is released while
+	// the files are written, and held again once these return. WriteLog closes 'reader'.
+	bool CheckpointLocked(std::unique_lock<std::mutex> &lock, const bool compact);
+	bool WriteLog(std::unique_lock<std::mutex> &lock, FILE *reader, std::vector<IndexEntry> *entries, const uint64_t covered_log_size,
+		const uint64_t generation, uint64_t *copied_log_size_out);
+	bool WriteIndex(std::unique_lock<std::mutex> &lock, const std::vector<IndexEntry> &entries, const uint64_t generation,
+		const uint64_t covered_log_size);
+
+	bool OpenLog();
+	void CloseLog();
+
+	const IndexEntry *GetIndexEntries() const;
+	uint64_t GetNumIndexEntries() const;
+
+	static uint64_t HashName(const std::string &name);
+	static bool ReadRecord(FILE *reader, const uint64_t offset, const uint32_t size, std::string *record_out);
+
+	std::mutex checkpoint_mutex; // Held for the whole checkpoint, so that only one runs at a time
+	std::thread checkpoint_thread;
+
+	mutable std::mutex mutex; // Guards everything below
+	std::string directory;
+	bool open;
+
+	FILE *log_writer; // Appends to the log
+	mutable FILE *log_reader;
+	mutable bool flush_requested; // Records were appended that are not flushed to the log yet
+	uint64_t log_generation;
+	uint64_t log_size;
+
+	MappedFile index;
+	bool index_valid; // The mapped index belongs to the log
+	uint64_t indexed_log_size; // Length of the log covered by the index
+
+	// Latest records appended to the log since the index was written
+	std::unordered_map<std::string, Location> appended_records;
+
+	std::condition_variable checkpoint_condition;
+	bool checkpoint_requested;
+	bool stopping; // Whether the checkpoint thread should return
+};
+
+} // namespace firestore
+} // namespace firebase
+
+#endif // FIRESTORE_SRC_FIREBASE_FIRESTORE_DOCUMENT_STORE_H
@@ -1,12 +1,33 @@
 #include "firestore.h"
 
+#include <cstring>
+
+#include <google/protobuf/util/time_util.h>
+
+#include "local_query.h"
+#include "mapped_file.h"
+
 namespace firebase {
 namespace firestore {
 
-Firestore::Firestore(const std::string &project_id, const std::string &database_id) :
+Firestore::Firestore(const std::string &project_id, const std::string &database_id, const FirestoreSettings &settings) :
 	project_id(project_id),
 	database_id(database_id),
-	database_base_path("projects/" + project_id + "/databases/" + database_id)
+	database_base_path("projects/" + project_id + "/databases/" + database_id),
+	channel_selection(settings.channel_selection),
+	max_documents_per_batch_get(settings.max_documents_per_batch_get > 0 ? settings.max_documents_per_batch_get : 1),
+	next_channel(0),
+	missing_document_ttl(settings.missing_document_ttl),
+	cancelling_calls(false),
+	next_completion_queue(0),
+	next_listen_id(1), // Target id 0 is reserved for server-assigned ids
+	listen_resume_alarm(nullptr),
+	listen_resume_attempts(0),
+	max_listen_resume_delay(settings.max_listen_resume_delay),
+	consistent_listen_snapshots(settings.consistent_listen_snapshots),
+	listen_executor(settings.num_listen_callback_threads > 0 ?
+		new CallbackExecutor(settings.num_listen_callback_threads, settings.max_queued_listen_callbacks, settings.listen_overflow_policy) : nullptr),
+	shutting_down(false)
 {
 	do_grpc_shutdown = false;
 	if(!grpc_is_initialized())
@@ -16,23 +37,105 @@ Firestore::Firestore(const std::string &project_id, const std::string &database_
 	}
 
 	credentials = grpc::GoogleDefaultCredentials();
-	channel = grpc::CreateChannel("firestore.googleapis.com:443", credentials);
-	stub = google::firestore::v1::Firestore::NewStub(channel);
+
+	// Create the channel pool
+	// Each channel gets its own subchannel pool, otherwise gRPC would
+	// let all the channels share a single connection to the backend
+	const uint32_t num_channels = settings.num_channels > 0 ? settings.num_channels : 1;
+	for(uint32_t i = 0; i < num_channels; i++)
+	{
+		grpc::ChannelArguments channel_arguments;
+		channel_arguments.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+
+		std::unique_ptr<PooledChannel> pooled_channel(new PooledChannel);
+		pooled_channel->channel = grpc::CreateCustomChannel("firestore.googleapis.com:443", credentials, channel_arguments);
+		pooled_channel->stub = google::firestore::v1::Firestore::NewStub(pooled_channel->channel);
+		pooled_channel->in_flight = 0;
+		channels.push_back(std::move(pooled_channel));
+	}
+
+	// Start the threads that drive the asynchronous calls
+	// Each poller thread services its own completion queue
+	uint32_t num_poller_threads = settings.num_poller_threads;
+	if(num_poller_threads == 0)
+	{
+		num_poller_threads = std::thread::hardware_concurrency();
+		if(num_poller_threads == 0) num_poller_threads = 1; // Not computable on this platform
+	}
+	for(uint32_t i = 0; i < num_poller_threads; i++)
+	{
+		completion_queues.emplace_back(new grpc::CompletionQueue);
+		poller_threads.emplace_back(&Firestore::PollCompletionQueue, completion_queues.back().get());
+	}
+
+	if(settings.document_cache_size > 0)
+	{
+		document_cache.reset(new DocumentCache(settings.document_cache_size));
+	}
+
+	if(!settings.document_store_path.empty())
+	{
+		document_store.reset(new DocumentStore);
+		if(!document_store->Open(settings.document_store_path))
+		{
+			std::cerr << "Firestore::Firestore(): Failed to open the document store at " << settings.document_store_path << std::endl;
+			document_store.reset();
+		}
+	}
+
+	// The listeners of the previous run are resumed from the document store
+	if(document_store)
+	{
+		listen_targets_path = settings.document_store_path + "/listen_targets";
+		LoadListenTargets();
+	}
 }
 
 Firestore::~Firestore()
 {
-	// Clean up listener threads
-	for(auto itr : listener_threads)
+	// Save the listeners for the next run, and stop broken listen streams from being resumed
+	{
+		std::lock_guard<std::mutex> lock(listen_stream_mutex);
+		shutting_down = true;
+		if(listen_resume_alarm != nullptr)
+		{
+			listen_resume_alarm->alarm.Cancel();
+		}
+		SaveListenTargets();
+	}
+
+	// Cancel every call in flight, including the listen streams,
+	// so that the pollers get to drain their queues right away
+	CancelCalls();
+	{
+		// The streams are destroyed without holding the lock, as their destructors wait
+		// for the pollers, which may need the lock to look up watched documents
+		std::shared_ptr<ListenStream> stream;
+		std::list<std::shared_ptr<ListenStream>> retired_streams;
+		{
+			std::lock_guard<std::mutex> lock(listen_stream_mutex);
+			stream.swap(listen_stream);
+			retired_streams.swap(retired_listen_streams);
+		}
+	}
+
+	// Drain the completion queues and stop the poller threads
+	for(auto &cq : completion_queues)
+	{
+		cq->Shutdown();
+	}
+	for(std::thread &t : poller_threads)
 	{
-		itr.second->StopListening();
-		auto &t = itr.second->thread;
 		if(t.joinable())
 		{
 			t.join();
 		}
 	}
-	listener_threads.clear();
+	poller_threads.clear();
+	completion_queues.clear();
+
+	// The pollers no longer queue listener callbacks; drop the ones left
+	listen_executor.reset();
 
 	if(do_grpc_shutdown)
 	{
@@ -40,7 +143,19 @@ Firestore::~Firestore()
 	}
 }
 
-bool Firestore::GetDocument(const std::string &document_path, Document *document_out)
+// Single documents are read with BatchGetDocuments, as unlike GetDocument it tells
+// the server time at which a missing document was read. A missing document is
+// reported with NOT_FOUND, the way GetDocument reports it.
+static grpc::Status GetReadStatus(const grpc::Status &status, const bool found, const std::string &name)
+{
+	if(status.ok() && !found)
+	{
+		return grpc::Status(grpc::StatusCode::NOT_FOUND, "Document \"" + name + "\" not found");
+	}
+	return status;
+}
+
+bool Firestore::GetDocument(const std::string &document_path, Document *document_out, const ReadMode read_mode)
 {
 	// Make sure we were provided a document object to write to
 	if(document_out == nullptr)
@@ -49,431 +164,2642 @@ bool Firestore::GetDocument(const std::string &document_path, Document *document
 		return false;
 	}
 
-	// Create a document request
-	// We will the request document with path:
+	// We will request the document with path:
 	// projects/{project_id}/databases/{database_id}/documents/{document_path}
-	google::firestore::v1::GetDocumentRequest request;
-	request.set_name(GetFullDocumentPath(document_path));
+	const std::string name = GetFullDocumentPath(document_path);
+
+	// A document watched by a listener is kept up to date by the listen stream
+	bool exists;
+	if(GetWatchedDocument(name, document_out, &exists))
+	{
+		return exists;
+	}
+
+	if(GetSnapshotDocument(name, document_out))
+	{
+		return true;
+	}
+
+	if(read_mode != READ_SERVER_FIRST)
+	{
+		if(GetCachedDocument(name, document_out, &exists))
+		{
+			return exists;
+		}
+		if(read_mode == READ_CACHE_ONLY)
+		{
+			verbose << "Firestore::GetDocument(): Document with path \"" << document_path << "\" is not in the cache" << std::endl;
+			return false;
+		}
+	}
+	else if(IsKnownMissing(name))
+	{
+		verbose << "Firestore::GetDocument(): Document with path \"" << document_path << "\" is known to be missing" << std::endl;
+		return false;
+	}
+
+	// Concurrent reads of the same document share a single RPC
+	std::promise<bool> shared_result;
+	std::shared_ptr<PendingRead> pending_read;
+	const PendingReadRole role = JoinPendingRead(name, true, [&](const grpc::Status &s, const Document *document)
+	{
+		if(s.ok())
+		{
+			*document_out = *document;
+		}
+		shared_result.set_value(ResolveRead(name, s, read_mode, document_out));
+	}, &pending_read);
+	if(role == PENDING_READ_JOINED)
+	{
+		return shared_result.get_future().get();
+	}
+
+	MessageArena arena;
+	google::firestore::v1::BatchGetDocumentsRequest *request = arena.Create<google::firestore::v1::BatchGetDocumentsRequest>();
+	request->set_database(database_base_path);
+	request->add_documents(name);
+	google::firestore::v1::BatchGetDocumentsResponse *response = arena.Create<google::firestore::v1::BatchGetDocumentsResponse>();
 
 	grpc::ClientContext client_context;
-	grpc::Status s = stub->GetDocument(&client_context, request, document_out);
+	const ChannelLease channel(SelectChannel());
+	std::unique_ptr<grpc::ClientReader<google::firestore::v1::BatchGetDocumentsResponse>> reader =
+		channel.Stub()->BatchGetDocuments(&client_context, *request);
+	bool found = false;
+	google::protobuf::Timestamp read_time;
+	while(reader->Read(response))
+	{
+		if(response->has_found())
+		{
+			document_out->Swap(response->mutable_found());
+			found = true;
+		}
+		else if(response->has_missing())
+		{
+			read_time = response->read_time();
+		}
+	}
+	grpc::Status s = GetReadStatus(reader->Finish(), found, name);
+	if(s.ok())
+	{
+		CacheDocument(*document_out);
+	}
+	else if(s.error_code() == grpc::StatusCode::NOT_FOUND)
+	{
+		CacheMissingDocument(name, read_time);
+	}
+	if(role == PENDING_READ_LEADER)
+	{
+		CompletePendingRead(name, pending_read, s, s.ok() ? document_out : nullptr);
+	}
+
 	if(!s.ok())
 	{
 		std::cout << "Firestore::GetDocument(): Received ok=false" << std::endl;
 		std::cout << "Message:" << std::endl;
 		std::cout << s.error_message() << std::endl;
 		std::cout << s.error_details() << std::endl;
-		return false;
 	}
-	return true;
+	return ResolveRead(name, s, read_mode, document_out);
 }
 
 bool Firestore::UpdateDocument(const std::string &document_path, const Document &new_document, Document *document_out)
 {
+	// The request, its copy of the document and the temp document live for this call only
+	MessageArena arena;
+
 	// If no output document, use a temp document
-	Document temp;
 	if(document_out == nullptr)
 	{
-		document_out = &temp;
+		document_out = arena.Create<Document>();
 	}
 
-	// Make copy of new document
-	Document *allocated_document = new Document(new_document);
-	allocated_document->set_name(GetFullDocumentPath(document_path));
-
 	// Create an update document request
 	// We will the request to update document with path:
 	// projects/{project_id}/databases/{database_id}/documents/{document_path}
-	google::firestore::v1::UpdateDocumentRequest request;
-	request.set_allocated_document(allocated_document); // UpdateDocumentRequest will handle deallocation
+	google::firestore::v1::UpdateDocumentRequest *request = arena.Create<google::firestore::v1::UpdateDocumentRequest>();
+	Document *document = request->mutable_document();
+	*document = new_document;
+	document->set_name(GetFullDocumentPath(document_path));
 
 	grpc::ClientContext client_context;
-	grpc::Status s = stub->UpdateDocument(&client_context, request, document_out);
+	const ChannelLease channel(SelectChannel());
+	grpc::Status s = channel.Stub()->UpdateDocument(&client_context, *request, document_out);
 	if(!s.ok())
 	{
 		std::cout << "Firestore::UpdateDocument(): Received ok=false" << std::endl;
 		std::cout << "Message:" << std::endl;
 		std::cout << s.error_message() << std::endl;
 		std::cout << s.error_details() << std::endl;
+		InvalidateCachedDocument(document->name()); // The write may still have been applied
 		return false;
 	}
+	ForgetPendingRead(document->name());
+	CacheDocument(*document_out);
 	return true;
 }
 
-int32_t Firestore::Listen(const std::string &document_path, const ListenCallback &callback)
+void Firestore::GetDocumentAsync(const std::string &document_path, const DocumentCallback &callback, const ReadMode read_mode)
 {
-	verbose << "Firestore::Listen(): Listening for changes in document with path \"" << document_path << "\"" << std::endl;
 	if(!callback)
 	{
-		std::cerr << "Firestore::Listen(): No callback function provided to listen call; skipping." << std::endl;
-		return -1;
+		std::cerr << "Firestore::GetDocumentAsync(): No callback function provided; skipping." << std::endl;
+		return;
 	}
 
-	// Create a listener thread
-	std::shared_ptr<ListenerThread> listener_thread(new ListenerThread(*this, document_path, callback));
-	listener_thread->StartListening();
-
-	// Map listener thread id to listener thread
-	const int32_t listener_thead_id = (int32_t)listener_thread->GetTag();
-	listener_threads[listener_thead_id] = listener_thread;
-	return listener_thead_id;
-}
-
-bool Firestore::Unlisten(const int32_t listen_id)
-{
-	auto itr = listener_threads.find(listen_id);
-	if(itr != listener_threads.end())
+	// A document watched by a listener is kept up to date by the listen stream
+	const std::string name = GetFullDocumentPath(document_path);
 	{
-		verbose << "Firestore::Listen(): Unlistening for changes in document with path \"" << itr->second->GetDocumentPath() << "\"" << std::endl;
-		itr->second->StopListening();
-		// TODO: Consider removing inactive ListenerThreads (however, this solution has issues if unlisten called from a listen thread)
-		//listener_threads.erase(itr);
-		return true;
+		Document document;
+		bool exists;
+		if(GetWatchedDocument(name, &document, &exists))
+		{
+			callback(exists, exists ? &document : nullptr);
+			return;
+		}
+		if(GetSnapshotDocument(name, &document))
+		{
+			callback(true, &document);
+			return;
+		}
 	}
-	else
+
+	if(read_mode != READ_SERVER_FIRST)
 	{
-		std::cout << "Firestore::Unlisten(): Could not find listener thread with id=" << listen_id << std::endl;
-		return false;
+		Document document;
+		bool exists;
+		if(GetCachedDocument(name, &document, &exists))
+		{
+			callback(exists, exists ? &document : nullptr);
+			return;
+		}
+		if(read_mode == READ_CACHE_ONLY)
+		{
+			verbose << "Firestore::GetDocumentAsync(): Document with path \"" << document_path << "\" is not in the cache" << std::endl;
+			callback(false, nullptr);
+			return;
+		}
 	}
-}
-
-std::shared_ptr<Transaction> Firestore::BeginTransaction()
-{
-	google::firestore::v1::BeginTransactionRequest request;
-	google::firestore::v1::BeginTransactionResponse response;
-
-	// Setup request
-	request.set_database(database_base_path);
-	
-	grpc::ClientContext client_context;
-	grpc::Status s = stub->BeginTransaction(&client_context, request, &response);
-	if(!s.ok())
+	else if(IsKnownMissing(name))
 	{
-		std::cout << "Firestore::BeginTransaction(): Received ok=false" << std::endl;
-		std::cout << "Message:" << std::endl;
-		std::cout << s.error_message() << std::endl;
-		std::cout << s.error_details() << std::endl;
-		return nullptr;
+		verbose << "Firestore::GetDocumentAsync(): Document with path \"" << document_path << "\" is known to be missing" << std::endl;
+		callback(false, nullptr);
+		return;
 	}
-	verbose << "Firestore::BeginTransaction(): Started a transaction" << std::endl;
-	return std::shared_ptr<Transaction>(new Transaction(response.transaction(), this));
-}
-
-bool Firestore::CommitTransaction(std::shared_ptr<Transaction> transaction)
-{
-	google::firestore::v1::CommitResponse response;
 
-	// Setup commit request
-	transaction->request.set_database(database_base_path);
-
-	grpc::ClientContext client_context;
-	grpc::Status s = stub->Commit(&client_context, transaction->request, &response);
-	if(!s.ok())
+	// Concurrent reads of the same document share a single RPC
+	std::shared_ptr<PendingRead> pending_read;
+	const PendingReadRole role = JoinPendingRead(name, false, [this, callback, name, read_mode](const grpc::Status &s, const Document *document)
 	{
-		std::cout << "Firestore::BeginTransaction(): Received ok=false" << std::endl;
-		std::cout << "Message:" << std::endl;
-		std::cout << s.error_message() << std::endl;
-		std::cout << s.error_details() << std::endl;
-		return false;
+		if(s.ok())
+		{
+			callback(true, document);
+			return;
+		}
+		Document cached_document;
+		const bool exists = ResolveRead(name, s, read_mode, &cached_document);
+		callback(exists, exists ? &cached_document : nullptr);
+	}, &pending_read);
+	if(role == PENDING_READ_JOINED)
+	{
+		return;
 	}
-	verbose << "Firestore::CommitTransaction(): Transaction successfully committed" << std::endl;
-	return true;
-}
 
-std::string Firestore::GetFullDocumentPath(const std::string &document_path) const
-{
-	return database_base_path + "/documents/" + document_path;
-}
+	// The responses are parsed into an arena that is reset between them, so the result is moved out
+	struct ReadResult
+	{
+		Document document;
+		bool found = false;
+		google::protobuf::Timestamp read_time;
+	};
+	std::shared_ptr<ReadResult> result(new ReadResult);
+	AsyncReaderCall<google::firestore::v1::BatchGetDocumentsResponse> *call = new AsyncReaderCall<google::firestore::v1::BatchGetDocumentsResponse>(*this,
+		[result](google::firestore::v1::BatchGetDocumentsResponse *response)
+		{
+			if(response->has_found())
+			{
+				result->document.Swap(response->mutable_found());
+				result->found = true;
+			}
+			else if(response->has_missing())
+			{
+				result->read_time = response->read_time();
+			}
+		},
+		[this, callback, name, read_mode, pending_read, result](const grpc::Status &status)
+		{
+			const grpc::Status s = GetReadStatus(status, result->found, name);
+			Document *document = &result->document;
+			if(s.ok())
+			{
+				CacheDocument(*document);
+			}
+			else if(s.error_code() == grpc::StatusCode::NOT_FOUND)
+			{
+				CacheMissingDocument(name, result->read_time);
+			}
+			CompletePendingRead(name, pending_read, s, s.ok() ? document : nullptr);
 
-int32_t Firestore::ListenerThread::current_listener_thread_tag = 0;
+			if(!s.ok())
+			{
+				std::cout << "Firestore::GetDocumentAsync(): Received ok=false" << std::endl;
+				std::cout << "Message:" << std::endl;
+				std::cout << s.error_message() << std::endl;
+				std::cout << s.error_details() << std::endl;
+			}
+			const bool exists = ResolveRead(name, s, read_mode, document);
+			callback(exists, exists ? document : nullptr);
+		}
+	);
 
-Firestore::ListenerThread::ListenerThread(const Firestore &firestore,
-									  const std::string &document_path,
-									  const ListenCallback &callback) :
-	firestore(firestore),
-	tag((void*)++current_listener_thread_tag), // Get a unique tag for this bi-directional stream
-	document_path(document_path),
-	callback(callback),
-	listening(false)
-{
+	google::firestore::v1::BatchGetDocumentsRequest request;
+	request.set_database(database_base_path);
+	request.add_documents(name);
+	call->Start(call->Stub()->PrepareAsyncBatchGetDocuments(&call->client_context, request, GetCompletionQueue())); // Deleted by the poller thread
 }
 
-void Firestore::ListenerThread::StartListening()
+std::future<bool> Firestore::GetDocumentAsync(const std::string &document_path, Document *document_out, const ReadMode read_mode)
 {
-	listening = true;
-	thread = std::thread(&Firestore::ListenerThread::ListenInternal, this);
-}
+	std::shared_ptr<std::promise<bool>> promise(new std::promise<bool>);
+	if(document_out == nullptr)
+	{
+		std::cerr << "Firestore::GetDocumentAsync(): No output document provided (document_out=nullptr)" << std::endl;
+		promise->set_value(false);
+		return promise->get_future();
+	}
 
-void Firestore::ListenerThread::StopListening()
-{
-	listening = false;
+	std::future<bool> future = promise->get_future();
+	GetDocumentAsync(document_path, [promise, document_out](bool success, const Document *document)
+	{
+		if(success)
+		{
+			*document_out = *document;
+		}
+		promise->set_value(success);
+	}, read_mode);
+	return future;
 }
 
-std::string Firestore::ListenerThread::GetDocumentPath() const
+void Firestore::UpdateDocumentAsync(const std::string &document_path, const Document &new_document, const DocumentCallback &callback)
 {
-	return document_path;
-}
+	const std::string name = GetFullDocumentPath(document_path);
+	AsyncUnaryCall<Document> *call = new AsyncUnaryCall<Document>(*this,
+		[this, callback, name](const grpc::Status &s, Document *document)
+		{
+			if(!s.ok())
+			{
+				std::cout << "Firestore::UpdateDocumentAsync(): Received ok=false" << std::endl;
+				std::cout << "Message:" << std::endl;
+				std::cout << s.error_message() << std::endl;
+				std::cout << s.error_details() << std::endl;
+				InvalidateCachedDocument(name); // The write may still have been applied
+				if(callback) callback(false, nullptr);
+				return;
+			}
+			ForgetPendingRead(name);
+			CacheDocument(*document);
+			if(callback) callback(true, document);
+		}
+	);
 
-bool Firestore::ListenerThread::IsListening() const
-{
-	return listening;
+	google::firestore::v1::UpdateDocumentRequest *request = call->arena.Create<google::firestore::v1::UpdateDocumentRequest>();
+	Document *document = request->mutable_document();
+	*document = new_document;
+	document->set_name(name);
+	call->Start(call->Stub()->PrepareAsyncUpdateDocument(&call->client_context, *request, GetCompletionQueue())); // Deleted by the poller thread
 }
 
-const void *const Firestore::ListenerThread::GetTag() const
+std::future<bool> Firestore::UpdateDocumentAsync(const std::string &document_path, const Document &new_document, Document *document_out)
 {
-	return tag;
+	std::shared_ptr<std::promise<bool>> promise(new std::promise<bool>);
+	std::future<bool> future = promise->get_future();
+	UpdateDocumentAsync(document_path, new_document, [promise, document_out](bool success, const Document *document)
+	{
+		if(success && document_out != nullptr)
+		{
+			*document_out = *document;
+		}
+		promise->set_value(success);
+	});
+	return future;
 }
 
-void Firestore::ListenerThread::ListenInternal() const
+bool Firestore::GetDocuments(const std::vector<std::string> &document_paths, const BatchGetCallback &callback)
 {
-	std::shared_ptr<google::firestore::v1::ListenResponse> reply(new google::firestore::v1::ListenResponse);
-
-	// To initiate a listen request, we have to specify a
-	// set of target document(s) to listen to
-	google::firestore::v1::Target::DocumentsTarget *documents_target = new google::firestore::v1::Target::DocumentsTarget;
-
-	// We will listen to the document with path:
-	// projects/{project_id}/databases/{database_id}/documents/{document_path}
-	documents_target->add_documents(firestore.GetFullDocumentPath(document_path));
-
-	// Create a target and attach the document target
-	google::firestore::v1::Target *target = new google::firestore::v1::Target;
-	target->set_allocated_documents(documents_target); // Target will handle deallocation
-	target->set_once(false);                           // Keep listening after the initial document is received
-
-	// Setup listen request
-	google::firestore::v1::ListenRequest request;
-	request.set_database(firestore.database_base_path);
-	request.set_allocated_add_target(target); // ListenRequest will handle deallocation
-
-	// Create a grpc client context
-	grpc::ClientContext client_context;
-
-	// Need to include google-cloud-resource-prefix in the header,
-	// otherwise it won't connect
-	client_context.AddMetadata("google-cloud-resource-prefix", firestore.database_base_path);
-
-	// Initiate firestore listen call
-	grpc::CompletionQueue cq; // Async queue
-	std::unique_ptr<grpc::ClientAsyncReaderWriter<google::firestore::v1::ListenRequest, google::firestore::v1::ListenResponse>> rpc(
-		firestore.stub->AsyncListen(&client_context, &cq, tag)
-	);
-
-	// Verify that stream initialization was successful
-	void *recv_tag; bool ok;
-	if(!cq.Next(&recv_tag, &ok))
+	if(!callback)
 	{
-		std::cout << "Firestore::Listen(): Queue was shut down. Timeout? (Last call: StartCall)" << std::endl;
-		return;
+		std::cerr << "Firestore::GetDocuments(): No callback function provided; skipping." << std::endl;
+		return false;
 	}
-	if(!ok || recv_tag != tag)
+
+	// Paths known to hold no document are answered right away
+	std::vector<std::string> unknown_document_paths;
+	const std::vector<std::string> *requested_paths = &document_paths;
+	if(missing_document_ttl.count() > 0)
 	{
-		std::cout <<
-			"Firestore::Listen(): Failed to initialize stream. " <<
-			"cq.Next returned tag=" << recv_tag << " " <<
-			"(expected tag=" << tag << ") " <<
-			"and ok=" << ok << std::endl;
-		return;
+		for(const std::string &document_path : document_paths)
+		{
+			if(IsKnownMissing(GetFullDocumentPath(document_path)))
+			{
+				callback(document_path, nullptr);
+			}
+			else
+			{
+				unknown_document_paths.push_back(document_path);
+			}
+		}
+		requested_paths = &unknown_document_paths;
 	}
 
-	// Write the listen request
-	// This will make the server listen for changes
-	// in the documents that were added to the target
-	rpc->Write(request, tag);
-	if(!cq.Next(&recv_tag, &ok))
+	// State shared by the batches in flight
+	struct BatchGetState
 	{
-		std::cout << "Firestore::Listen(): Queue was shut down. Timeout? (Last call: Write)" << std::endl;
-		return;
-	}
-	if(!ok || recv_tag != tag)
+		std::mutex mutex;
+		std::condition_variable done;
+		size_t remaining_batches;
+		bool success;
+	};
+	std::shared_ptr<BatchGetState> state(new BatchGetState);
+	state->remaining_batches = (requested_paths->size() + max_documents_per_batch_get - 1) / max_documents_per_batch_get;
+	state->success = true;
+	if(state->remaining_batches == 0)
 	{
-		std::cout <<
-			"Firestore::Listen(): Failed to write to stream. " <<
-			"cq.Next returned tag=" << recv_tag << " " <<
-			"(expected tag=" << tag << ") " <<
-			"and ok=" << ok << std::endl;
-		return;
+		return true;
 	}
 
-	// Listening loop
-	std::list<uint32_t> active_target_ids;
-	do
+	// The responses name the documents by their full path:
+	// projects/{project_id}/databases/{database_id}/documents/{document_path}
+	const std::string documents_path = GetFullDocumentPath("");
+
+	// Split the documents over several concurrent BatchGetDocuments streams
+	for(size_t first = 0; first < requested_paths->size(); first += max_documents_per_batch_get)
 	{
-		// Get server response
-		rpc->Read(reply.get(), tag);
-		if(!cq.Next(&recv_tag, &ok)) // May block until next message is received
-		{
-			std::cout << "Firestore::Listen(): Queue was shut down. Timeout? (Last call: Read)" << std::endl;
-			return;
-		}
-		if(!ok || recv_tag != tag)
+		const size_t last = std::min(first + max_documents_per_batch_get, requested_paths->size());
+
+		google::firestore::v1::BatchGetDocumentsRequest request;
+		request.set_database(database_base_path);
+		for(size_t i = first; i < last; i++)
 		{
-			std::cout <<
-				"Firestore::Listen(): Failed to initialize stream. " <<
-				"cq.Next returned tag=" << recv_tag << " " <<
-				"(expected tag=" << tag << ") " <<
-				"and ok=" << ok << std::endl;
-			return;
+			request.add_documents(GetFullDocumentPath((*requested_paths)[i]));
 		}
 
-		// Process response
-		const google::firestore::v1::ListenResponse::ResponseTypeCase response_type_case = reply->response_type_case();
-		switch(response_type_case)
-		{
-			// ResponseTypeCase::kTargetChange:
-			// This response is received whenever a change
-			// occured in a server-side target
-			case google::firestore::v1::ListenResponse::kTargetChange:
+		AsyncReaderCall<google::firestore::v1::BatchGetDocumentsResponse> *call = new AsyncReaderCall<google::firestore::v1::BatchGetDocumentsResponse>(*this,
+			[this, state, callback, documents_path](google::firestore::v1::BatchGetDocumentsResponse *response)
 			{
-				const google::firestore::v1::TargetChange &change = reply->target_change();
+				switch(response->result_case())
+				{
+					case google::firestore::v1::BatchGetDocumentsResponse::kFound:
+					{
+						CacheDocument(response->found());
+						std::lock_guard<std::mutex> lock(state->mutex); // Never invoke the callback concurrently
+						callback(response->found().name().substr(documents_path.size()), &response->found());
+					}
+					break;
+
+					case google::firestore::v1::BatchGetDocumentsResponse::kMissing:
+					{
+						CacheMissingDocument(response->missing(), response->read_time());
+						std::lock_guard<std::mutex> lock(state->mutex);
+						callback(response->missing().substr(documents_path.size()), nullptr);
+					}
+					break;
 
-				// Check for error in target change
-				const google::rpc::Status &cause = change.cause();
-				int32_t code = cause.code();
-				if(code != 0)
+					default:
+						break;
+				}
+			},
+			[state](const grpc::Status &s)
+			{
+				if(!s.ok())
 				{
-					std::cout << "Firestore::Listen(): Received a non-zero rpc status code (code=" << code << ") " <<
-						"with a ResponseTypeCase::kTargetChange response" << std::endl;
+					std::cout << "Firestore::GetDocuments(): Received ok=false" << std::endl;
 					std::cout << "Message:" << std::endl;
-					std::cout << cause.message() << std::endl;
-					return;
+					std::cout << s.error_message() << std::endl;
+					std::cout << s.error_details() << std::endl;
 				}
 
-				// Process target change reply
-				const google::firestore::v1::TargetChange::TargetChangeType target_change_type = change.target_change_type();
-				switch(target_change_type)
+				std::lock_guard<std::mutex> lock(state->mutex);
+				state->success = state->success && s.ok();
+				if(--state->remaining_batches == 0)
 				{
-					// TargetChangeType::NO_CHANGE:
-					// This response is received periodically from the server
-					// There are no associated target ids sent
-					case google::firestore::v1::TargetChange::NO_CHANGE:
-						verbose << "Firestore::Listen(): Received a target change response of type NO_CHANGE" << std::endl;
-						break;
-
-					// TargetChangeType::ADD:
-					// This response is received once the server has added target(s)
-					// Note:
-					// - "For target_change_type=ADD, the order of the target IDs matches the order of the requests to add the targets.
-					//    This allows clients to unambiguously associate server-assigned target IDs with added targets."
-					// - Target IDs are unique for each ListenRequest.
-					// TODO: Should add checks to remember all currently valid targets
-					case google::firestore::v1::TargetChange::ADD:
-						verbose << "Firestore::Listen(): Received a target change response of type ADD" << std::endl;
-						for(int32_t id : change.target_ids())
-						{
-							active_target_ids.push_back(id);
-							verbose << "Firestore::Listen(): Target with id=" << id << " added server-side" << std::endl;
-						}
-						break;
+					state->done.notify_all();
+				}
+			}
+		);
+		call->Start(call->Stub()->PrepareAsyncBatchGetDocuments(&call->client_context, request, GetCompletionQueue())); // Deleted by the poller thread
+	}
 
-					// TargetChangeType::REMOVE:
-					// This response is received once the server has removed target(s)
-					case google::firestore::v1::TargetChange::REMOVE:
-						verbose << "Firestore::Listen(): Received a target change response of type REMOVE" << std::endl;
-						for(int32_t id : change.target_ids())
-						{
-							active_target_ids.remove(id);
-							verbose << "Firestore::Listen(): Target with id=" << id << " removed server-side" << std::endl;
-						}
-						break;
+	// Wait for all the batches to finish
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->done.wait(lock, [state]() { return state->remaining_batches == 0; });
+	return state->success;
+}
 
-					// TargetChangeType::REMOVE:
-					// This response is received once the server has removed target(s)
-					case google::firestore::v1::TargetChange::CURRENT:
-						verbose << "Firestore::Listen(): Received a target change response of type CURRENT" << std::endl;
-						for(int32_t id : change.target_ids())
-						{
-							verbose << "Firestore::Listen(): Target with id=" << id << " is now current" << std::endl;
-						}
-						break;
+bool Firestore::GetDocuments(const std::vector<std::string> &document_paths, std::vector<Document> *documents_out)
+{
+	// Make sure we were provided a vector to write to
+	if(documents_out == nullptr)
+	{
+		std::cerr << "Firestore::GetDocuments(): No output vector provided (documents_out=nullptr)" << std::endl;
+		return false;
+	}
+
+	// The documents arrive in no particular order, so remember
+	// where each of them goes in the output vector
+	std::multimap<std::string, size_t> indices;
+	for(size_t i = 0; i < document_paths.size(); i++)
+	{
+		indices.insert(std::make_pair(document_paths[i], i));
+	}
+
+	documents_out->assign(document_paths.size(), Document());
+	return GetDocuments(document_paths, [&](const std::string &document_path, const Document *document)
+	{
+		if(document == nullptr)
+		{
+			return; // Leave missing documents empty
+		}
+		auto range = indices.equal_range(document_path);
+		for(auto itr = range.first; itr != range.second; itr++)
+		{
+			(*documents_out)[itr->second] = *document;
+		}
+	});
+}
+
+bool Firestore::RunQuery(const std::string &parent_path, const StructuredQuery &query, const QueryCallback &callback, const ReadMode read_mode)
+{
+	if(!callback)
+	{
+		std::cerr << "Firestore::RunQuery(): No callback function provided; skipping." << std::endl;
+		return false;
+	}
+
+	std::vector<Document> results;
+	if(read_mode != READ_SERVER_FIRST)
+	{
+		if(!RunCachedQuery(parent_path, query, &results))
+		{
+			return false;
+		}
+		if(!results.empty() || read_mode == READ_CACHE_ONLY)
+		{
+			for(const Document &document : results)
+			{
+				callback(&document);
+			}
+			return true;
+		}
+	}
+
+	// Documents with only some of their fields must stay out of the cache
+	const bool cache_results = !query.has_select() || query.select().fields_size() == 0;
+
+	// Each response is handed over before the next one is read,
+	// so memory use does not depend on the size of the result set
+	QueryIterator itr(*this, parent_path, query);
+	bool received_documents = false;
+	while(itr.Next())
+	{
+		received_documents = true;
+		if(cache_results)
+		{
+			CacheDocument(itr.GetDocument());
+		}
+		callback(&itr.GetDocument());
+	}
+
+	// Fall back on the cache when the server could not answer
+	const grpc::StatusCode code = itr.GetStatus().error_code();
+	if(read_mode == READ_SERVER_FIRST && !received_documents &&
+		(code == grpc::StatusCode::UNAVAILABLE || code == grpc::StatusCode::DEADLINE_EXCEEDED) &&
+		RunCachedQuery(parent_path, query, &results))
+	{
+		verbose << "Firestore::RunQuery(): Serving " << results.size() << " documents from the cache" << std::endl;
+		for(const Document &document : results)
+		{
+			callback(&document);
+		}
+		return true;
+	}
+	return itr.Succeeded();
+}
+
+static bool HasInequality(const google::firestore::v1::StructuredQuery::Filter &filter)
+{
+	switch(filter.filter_type_case())
+	{
+		case google::firestore::v1::StructuredQuery::Filter::kCompositeFilter:
+			for(const google::firestore::v1::StructuredQuery::Filter &child : filter.composite_filter().filters())
+			{
+				if(HasInequality(child))
+				{
+					return true;
+				}
+			}
+			return false;
+		case google::firestore::v1::StructuredQuery::Filter::kFieldFilter:
+			switch(filter.field_filter().op())
+			{
+				case google::firestore::v1::StructuredQuery::FieldFilter::LESS_THAN:
+				case google::firestore::v1::StructuredQuery::FieldFilter::LESS_THAN_OR_EQUAL:
+				case google::firestore::v1::StructuredQuery::FieldFilter::GREATER_THAN:
+				case google::firestore::v1::StructuredQuery::FieldFilter::GREATER_THAN_OR_EQUAL:
+					return true;
+				default:
+					return false;
+			}
+		default:
+			return false;
+	}
+}
+
+bool Firestore::Prefetch(const std::string &collection_path, const PrefetchOptions &options, size_t *num_documents_out)
+{
+	if(!document_cache && !document_store)
+	{
+		std::cerr << "Firestore::Prefetch(): The document cache is disabled; skipping." << std::endl;
+		return false;
+	}
+
+	const size_t separator = collection_path.rfind('/');
+	const std::string parent_path = separator == std::string::npos ? "" : collection_path.substr(0, separator);
+	StructuredQuery query;
+	query.add_from()->set_collection_id(separator == std::string::npos ? collection_path : collection_path.substr(separator + 1));
+	if(options.filter.filter_type_case() != google::firestore::v1::StructuredQuery::Filter::FILTER_TYPE_NOT_SET)
+	{
+		*query.mutable_where() = options.filter;
+	}
+
+	// Split the document ids into ranges by their first character
+	static const std::string id_characters = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+	uint32_t num_partitions = std::max(std::min(options.num_partitions, (uint32_t)id_characters.size()), 1u);
+	if(HasInequality(options.filter))
+	{
+		num_partitions = 1;
+	}
+
+	// State shared by the queries in flight
+	struct PrefetchState
+	{
+		std::mutex mutex;
+		std::condition_variable done;
+		uint32_t remaining_queries;
+		size_t num_documents;
+		bool success;
+	};
+	std::shared_ptr<PrefetchState> state(new PrefetchState);
+	state->remaining_queries = num_partitions;
+	state->num_documents = 0;
+	state->success = true;
+
+	const std::string collection_name = GetFullDocumentPath(collection_path);
+	for(uint32_t i = 0; i < num_partitions; i++)
+	{
+		google::firestore::v1::RunQueryRequest request;
+		request.set_parent(GetFullParentPath(parent_path));
+		StructuredQuery *partition_query = request.mutable_structured_query();
+		*partition_query = query;
+		if(num_partitions > 1)
+		{
+			// Documents with ids in [start, end), by name
+			google::firestore::v1::StructuredQuery::Order *order = partition_query->add_order_by();
+			order->mutable_field()->set_field_path("__name__");
+			order->set_direction(google::firestore::v1::StructuredQuery::ASCENDING);
+			if(i > 0)
+			{
+				partition_query->mutable_start_at()->add_values()->set_reference_value(collection_name + "/" + id_characters[i * id_characters.size() / num_partitions]);
+				partition_query->mutable_start_at()->set_before(true);
+			}
+			if(i + 1 < num_partitions)
+			{
+				partition_query->mutable_end_at()->add_values()->set_reference_value(collection_name + "/" + id_characters[(i + 1) * id_characters.size() / num_partitions]);
+				partition_query->mutable_end_at()->set_before(true);
+			}
+		}
+
+		AsyncReaderCall<google::firestore::v1::RunQueryResponse> *call = new AsyncReaderCall<google::firestore::v1::RunQueryResponse>(*this,
+			[this, state](google::firestore::v1::RunQueryResponse *response)
+			{
+				if(response->has_document())
+				{
+					CacheDocument(response->document());
+					std::lock_guard<std::mutex> lock(state->mutex);
+					state->num_documents++;
+				}
+			},
+			[state](const grpc::Status &s)
+			{
+				if(!s.ok())
+				{
+					std::cout << "Firestore::Prefetch(): Received ok=false" << std::endl;
+					std::cout << "Message:" << std::endl;
+					std::cout << s.error_message() << std::endl;
+					std::cout << s.error_details() << std::endl;
+				}
+
+				std::lock_guard<std::mutex> lock(state->mutex);
+				state->success = state->success && s.ok();
+				if(--state->remaining_queries == 0)
+				{
+					state->done.notify_all();
+				}
+			}
+		);
+		call->Start(call->Stub()->PrepareAsyncRunQuery(&call->client_context, request, GetCompletionQueue())); // Deleted by the poller thread
+	}
+
+	// Wait for all the queries to finish
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->done.wait(lock, [state]() { return state->remaining_queries == 0; });
+	verbose << "Firestore::Prefetch(): Cached " << state->num_documents << " documents of collection \"" << collection_path << "\"" << std::endl;
+	if(num_documents_out != nullptr)
+	{
+		*num_documents_out = state->num_documents;
+	}
+	return state->success;
+}
+
+bool Firestore::ExportSnapshot(const std::string &collection_path, const std::string &file_path)
+{
+	const size_t separator = collection_path.rfind('/');
+	const std::string parent_path = separator == std::string::npos ? "" : collection_path.substr(0, separator);
+	StructuredQuery query;
+	query.add_from()->set_collection_id(separator == std::string::npos ? collection_path : collection_path.substr(separator + 1));
+
+	// The documents are handed to the writer one document at a time, so that only their index stays in memory
+	SnapshotWriter writer;
+	if(!writer.Open(file_path))
+	{
+		std::cerr << "Firestore::ExportSnapshot(): Failed to write " << file_path << std::endl;
+		return false;
+	}
+
+	// Only a complete result set from the server will do, so the cache is left out
+	QueryIterator itr(*this, parent_path, query);
+	while(itr.Next())
+	{
+		if(!writer.Add(itr.GetDocument()))
+		{
+			std::cerr << "Firestore::ExportSnapshot(): Failed to write " << file_path << std::endl;
+			return false;
+		}
+	}
+	if(!itr.Succeeded())
+	{
+		return false;
+	}
+
+	const size_t num_documents = writer.GetNumDocuments();
+	if(!writer.Finish())
+	{
+		std::cerr << "Firestore::ExportSnapshot(): Failed to write " << file_path << std::endl;
+		return false;
+	}
+	verbose << "Firestore::ExportSnapshot(): Wrote " << num_documents << " documents to " << file_path << std::endl;
+	return true;
+}
+
+bool Firestore::MountSnapshot(const std::string &file_path)
+{
+	std::unique_ptr<SnapshotFile> snapshot(new SnapshotFile);
+	if(!snapshot->Open(file_path))
+	{
+		std::cerr << "Firestore::MountSnapshot(): " << file_path << " is not a snapshot file; skipping." << std::endl;
+		return false;
+	}
+	verbose << "Firestore::MountSnapshot(): Serving " << snapshot->GetNumDocuments() << " documents from " << file_path << std::endl;
+
+	std::lock_guard<std::mutex> lock(snapshot_mutex);
+	snapshots.push_back(std::move(snapshot));
+	return true;
+}
+
+int32_t Firestore::Listen(const std::string &document_path, const ListenCallback &callback)
+{
+	verbose << "Firestore::Listen(): Listening for changes in document with path \"" << document_path << "\"" << std::endl;
+	if(!callback)
+	{
+		std::cerr << "Firestore::Listen(): No callback function provided to listen call; skipping." << std::endl;
+		return -1;
+	}
+	return AddDocumentListener(document_path, [callback](const DocumentHandle &document) { callback(document.get()); });
+}
+
+int32_t Firestore::ListenShared(const std::string &document_path, const SharedListenCallback &callback)
+{
+	verbose << "Firestore::ListenShared(): Listening for changes in document with path \"" << document_path << "\"" << std::endl;
+	if(!callback)
+	{
+		std::cerr << "Firestore::ListenShared(): No callback function provided to listen call; skipping." << std::endl;
+		return -1;
+	}
+	return AddDocumentListener(document_path, callback);
+}
+
+int32_t Firestore::AddDocumentListener(const std::string &document_path, const SharedListenCallback &callback)
+{
+	std::lock_guard<std::mutex> lock(listen_stream_mutex);
+	OpenListenStream();
+
+	// The target id doubles as the listener id
+	const int32_t listen_id = next_listen_id++;
+
+	// Resume from where a listener of the previous run left off,
+	// provided the document it had received is still cached
+	auto saved_target_itr = saved_listen_targets.find(GetFullDocumentPath(document_path));
+	if(saved_target_itr != saved_listen_targets.end())
+	{
+		const ::firestore::client::Target target = saved_target_itr->second;
+		saved_listen_targets.erase(saved_target_itr);
+
+		Document document;
+		bool exists;
+		if(GetCachedDocument(target.documents().documents(0), &document, &exists))
+		{
+			verbose << "Firestore::Listen(): Resuming listener of document with path \"" << document_path << "\"" << std::endl;
+			listen_stream->AddTarget(listen_id, document_path, callback, &target, exists ? &document : nullptr);
+			return listen_id;
+		}
+	}
+	listen_stream->AddTarget(listen_id, document_path, callback);
+	return listen_id;
+}
+
+int32_t Firestore::ListenQuery(const std::string &parent_path, const StructuredQuery &query, const QueryListenCallback &callback)
+{
+	verbose << "Firestore::ListenQuery(): Listening for changes in query with parent path \"" << parent_path << "\"" << std::endl;
+	if(!callback)
+	{
+		std::cerr << "Firestore::ListenQuery(): No callback function provided to listen call; skipping." << std::endl;
+		return -1;
+	}
+
+	std::lock_guard<std::mutex> lock(listen_stream_mutex);
+	OpenListenStream();
+
+	const int32_t listen_id = next_listen_id++;
+	listen_stream->AddQueryTarget(listen_id, GetFullParentPath(parent_path), query, callback);
+	return listen_id;
+}
+
+bool Firestore::Unlisten(const int32_t listen_id)
+{
+	// Don't hold the lock while removing the target, as that may
+	// have to wait for a callback that calls Listen or Unlisten itself
+	// A broken stream being resumed moves its listeners to a new stream,
+	// so look a second time if the listener moved while we were looking
+	for(int attempt = 0; attempt < 2; attempt++)
+	{
+		std::list<std::shared_ptr<ListenStream>> streams;
+		{
+			std::lock_guard<std::mutex> lock(listen_stream_mutex);
+			streams = retired_listen_streams;
+			if(listen_stream)
+			{
+				streams.push_front(listen_stream);
+			}
+		}
+
+		for(const std::shared_ptr<ListenStream> &stream : streams)
+		{
+			if(stream->RemoveTarget(listen_id))
+			{
+				// Cancel the stream once the last listener is gone,
+				// rather than keeping an idle stream open
+				std::lock_guard<std::mutex> lock(listen_stream_mutex);
+				if(stream == listen_stream && stream->IsEmpty())
+				{
+					stream->Stop();
+					retired_listen_streams.push_back(listen_stream);
+					listen_stream.reset();
+				}
+				return true;
+			}
+		}
+	}
+
+	std::cout << "Firestore::Unlisten(): Could not find listener with id=" << listen_id << std::endl;
+	return false;
+}
+
+std::shared_ptr<Transaction> Firestore::BeginTransaction()
+{
+	google::firestore::v1::BeginTransactionRequest request;
+	google::firestore::v1::BeginTransactionResponse response;
+
+	// Setup request
+	request.set_database(database_base_path);
+	
+	grpc::ClientContext client_context;
+	const ChannelLease channel(SelectChannel());
+	grpc::Status s = channel.Stub()->BeginTransaction(&client_context, request, &response);
+	if(!s.ok())
+	{
+		std::cout << "Firestore::BeginTransaction(): Received ok=false" << std::endl;
+		std::cout << "Message:" << std::endl;
+		std::cout << s.error_message() << std::endl;
+		std::cout << s.error_details() << std::endl;
+		return nullptr;
+	}
+	verbose << "Firestore::BeginTransaction(): Started a transaction" << std::endl;
+	return std::shared_ptr<Transaction>(new Transaction(response.transaction(), this));
+}
+
+bool Firestore::CommitTransaction(std::shared_ptr<Transaction> transaction)
+{
+	google::firestore::v1::CommitResponse response;
+
+	// Setup commit request
+	transaction->request.set_database(database_base_path);
+
+	grpc::ClientContext client_context;
+	const ChannelLease channel(SelectChannel());
+	grpc::Status s = channel.Stub()->Commit(&client_context, transaction->request, &response);
+
+	// The server applies transforms to the written documents, so drop them from the cache
+	// rather than caching the documents as they were sent
+	for(const google::firestore::v1::Write &write : transaction->request.writes())
+	{
+		InvalidateCachedDocument(GetWriteDocumentName(write));
+	}
+
+	if(!s.ok())
+	{
+		std::cout << "Firestore::BeginTransaction(): Received ok=false" << std::endl;
+		std::cout << "Message:" << std::endl;
+		std::cout << s.error_message() << std::endl;
+		std::cout << s.error_details() << std::endl;
+		return false;
+	}
+	verbose << "Firestore::CommitTransaction(): Transaction successfully committed" << std::endl;
+	return true;
+}
+
+std::string Firestore::GetFullDocumentPath(const std::string &document_path) const
+{
+	return database_base_path + "/documents/" + document_path;
+}
+
+void Firestore::CommitAsync(const google::firestore::v1::CommitRequest &request, const AsyncUnaryCall<google::firestore::v1::CommitResponse>::FinishCallback &on_finish,
+	grpc::ClientContext **context_out)
+{
+	// The written documents are dropped from the cache once the outcome of the commit is known
+	std::vector<std::string> names;
+	if(document_cache || document_store)
+	{
+		for(const google::firestore::v1::Write &write : request.writes())
+		{
+			names.push_back(GetWriteDocumentName(write));
+		}
+	}
+
+	AsyncUnaryCall<google::firestore::v1::CommitResponse> *call = new AsyncUnaryCall<google::firestore::v1::CommitResponse>(*this,
+		[this, names, on_finish](const grpc::Status &status, google::firestore::v1::CommitResponse *response)
+		{
+			for(const std::string &name : names)
+			{
+				InvalidateCachedDocument(name);
+			}
+			on_finish(status, response);
+		}
+	);
+	if(context_out != nullptr)
+	{
+		*context_out = &call->client_context;
+	}
+	call->Start(call->Stub()->PrepareAsyncCommit(&call->client_context, request, GetCompletionQueue())); // Deleted by the poller thread
+}
+
+bool Firestore::GetCachedDocument(const std::string &name, Document *document_out, bool *exists_out) const
+{
+	MaybeDocument cached_document;
+	if(!document_cache || !document_cache->Get(name, &cached_document))
+	{
+		// Fall back on the store, and keep what it has in memory for the next read
+		if(!document_store || !document_store->Get(name, &cached_document))
+		{
+			return false;
+		}
+		if(document_cache)
+		{
+			document_cache->Put(name, cached_document);
+		}
+	}
+
+	switch(cached_document.document_type_case())
+	{
+		case MaybeDocument::kDocument:
+			document_out->Swap(cached_document.mutable_document());
+			*exists_out = true;
+			return true;
+
+		case MaybeDocument::kNoDocument:
+		{
+			// The read time is the server's, so clock skew shifts the expiry a little
+			if(missing_document_ttl.count() > 0)
+			{
+				const int64_t read_time = google::protobuf::util::TimeUtil::TimestampToMilliseconds(cached_document.no_document().read_time());
+				const int64_t now = google::protobuf::util::TimeUtil::TimestampToMilliseconds(google::protobuf::util::TimeUtil::GetCurrentTime());
+				if(now - read_time >= missing_document_ttl.count())
+				{
+					return false;
+				}
+			}
+			*exists_out = false;
+			return true;
+		}
+
+		default:
+			// The contents of the document are unknown
+			return false;
+	}
+}
+
+Firestore::PendingReadRole Firestore::JoinPendingRead(const std::string &name, const bool blocking, const PendingReadCallback &callback,
+	std::shared_ptr<PendingRead> *pending_read_out)
+{
+	std::lock_guard<std::mutex> lock(pending_reads_mutex);
+	auto itr = pending_reads.find(name);
+	if(itr == pending_reads.end())
+	{
+		std::shared_ptr<PendingRead> &pending_read = pending_reads[name];
+		pending_read.reset(new PendingRead());
+		pending_read->blocking = blocking;
+		*pending_read_out = pending_read;
+		return PENDING_READ_LEADER;
+	}
+	if(blocking && !itr->second->blocking)
+	{
+		return PENDING_READ_ALONE;
+	}
+	(blocking ? itr->second->blocking_callbacks : itr->second->async_callbacks).push_back(callback);
+	return PENDING_READ_JOINED;
+}
+
+void Firestore::CompletePendingRead(const std::string &name, const std::shared_ptr<PendingRead> &pending_read,
+	const grpc::Status &status, const Document *document)
+{
+	std::vector<PendingReadCallback> blocking_callbacks;
+	std::vector<PendingReadCallback> async_callbacks;
+	{
+		// The read may have been detached by a write already
+		std::lock_guard<std::mutex> lock(pending_reads_mutex);
+		auto itr = pending_reads.find(name);
+		if(itr != pending_reads.end() && itr->second == pending_read)
+		{
+			pending_reads.erase(itr);
+		}
+		blocking_callbacks.swap(pending_read->blocking_callbacks);
+		async_callbacks.swap(pending_read->async_callbacks);
+	}
+
+	if(!blocking_callbacks.empty() || !async_callbacks.empty())
+	{
+		verbose << "Firestore::GetDocument(): Sharing the read of document \"" << name << "\" with " <<
+			blocking_callbacks.size() + async_callbacks.size() << " other callers" << std::endl;
+	}
+	for(const PendingReadCallback &callback : blocking_callbacks)
+	{
+		callback(status, document);
+	}
+	if(async_callbacks.empty())
+	{
+		return;
+	}
+
+	// A GetDocument leader runs on its caller's thread, which must not run
+	// the callbacks of other callers; hand them over to a poller thread
+	if(pending_read->blocking)
+	{
+		std::shared_ptr<const Document> document_copy(document != nullptr ? new Document(*document) : nullptr);
+		RunOnPoller([async_callbacks, status, document_copy]()
+		{
+			for(const PendingReadCallback &callback : async_callbacks)
+			{
+				callback(status, document_copy.get());
+			}
+		});
+		return;
+	}
+	for(const PendingReadCallback &callback : async_callbacks)
+	{
+		callback(status, document);
+	}
+}
+
+void Firestore::ForgetPendingRead(const std::string &name) const
+{
+	// The callers that joined the read still get its outcome
+	std::lock_guard<std::mutex> lock(pending_reads_mutex);
+	pending_reads.erase(name);
+}
+
+void Firestore::RunOnPoller(const std::function<void()> &task) const
+{
+	PollerTask *poller_task = new PollerTask(task); // Deleted by the poller thread
+	poller_task->alarm.Set(GetCompletionQueue(), std::chrono::system_clock::now(), poller_task);
+}
+
+bool Firestore::ResolveRead(const std::string &name, const grpc::Status &status, const ReadMode read_mode, Document *document_out) const
+{
+	if(status.ok())
+	{
+		return true;
+	}
+
+	// Fall back on the cache when the server could not answer
+	bool exists;
+	if(read_mode == READ_SERVER_FIRST && status.error_code() != grpc::StatusCode::NOT_FOUND &&
+		GetCachedDocument(name, document_out, &exists))
+	{
+		verbose << "Firestore::GetDocument(): Serving document \"" << name << "\" from the cache" << std::endl;
+		return exists;
+	}
+	return false;
+}
+
+bool Firestore::IsKnownMissing(const std::string &name) const
+{
+	Document document;
+	bool exists;
+	return missing_document_ttl.count() > 0 && GetCachedDocument(name, &document, &exists) && !exists;
+}
+
+bool Firestore::GetSnapshotDocument(const std::string &name, Document *document_out) const
+{
+	// Snapshots stay mapped until the Firestore object is destroyed,
+	// so the document can be parsed outside of the lock
+	const char *data = nullptr;
+	size_t size = 0;
+	{
+		std::lock_guard<std::mutex> lock(snapshot_mutex);
+		for(const std::unique_ptr<SnapshotFile> &snapshot : snapshots)
+		{
+			if(snapshot->Find(name, &data, &size))
+			{
+				break;
+			}
+		}
+	}
+	return data != nullptr && document_out->ParseFromArray(data, (int)size);
+}
+
+bool Firestore::RunCachedQuery(const std::string &parent_path, const StructuredQuery &query, std::vector<Document> *results_out) const
+{
+	const std::string parent_name = GetFullParentPath(parent_path);
+	LocalQuery local_query(parent_name, query);
+	if(!local_query.IsValid())
+	{
+		return false;
+	}
+
+	// The store holds every document in the memory cache, and more
+	std::vector<Document> documents;
+	auto collect_document = [&documents](const std::string&, const MaybeDocument &document)
+	{
+		if(document.has_document())
+		{
+			documents.push_back(document.document());
+		}
+	};
+	if(document_store)
+	{
+		document_store->ForEach(parent_name + "/", collect_document);
+	}
+	else if(document_cache)
+	{
+		document_cache->ForEach(parent_name + "/", collect_document);
+	}
+	return local_query.Run(documents, results_out);
+}
+
+void Firestore::CacheDocument(const Document &document) const
+{
+	StoreCachedDocument(document);
+
+	// Keep the copy held by the listen stream at least as recent
+	std::shared_ptr<ListenStream> stream;
+	{
+		std::lock_guard<std::mutex> lock(listen_stream_mutex);
+		stream = listen_stream;
+	}
+	if(stream)
+	{
+		stream->ApplyDocument(document);
+	}
+}
+
+void Firestore::StoreCachedDocument(const Document &document) const
+{
+	if(document_cache)
+	{
+		document_cache->PutDocument(document);
+	}
+	if(document_store)
+	{
+		document_store->PutDocument(document);
+	}
+}
+
+bool Firestore::GetWatchedDocument(const std::string &name, Document *document_out, bool *exists_out) const
+{
+	std::shared_ptr<ListenStream> stream;
+	{
+		std::lock_guard<std::mutex> lock(listen_stream_mutex);
+		stream = listen_stream;
+	}
+	return stream && stream->GetWatchedDocument(name, document_out, exists_out);
+}
+
+void Firestore::ReplaceListenStream()
+{
+	std::shared_ptr<ListenStream> stream(new ListenStream(*this));
+	if(listen_stream)
+	{
+		stream->AdoptListeners(*listen_stream);
+		retired_listen_streams.push_back(listen_stream);
+	}
+	listen_stream = stream;
+	listen_stream->Start();
+}
+
+void Firestore::OpenListenStream()
+{
+	// Free the streams the pollers are done with
+	retired_listen_streams.remove_if([](const std::shared_ptr<ListenStream> &stream) { return stream->IsFinished(); });
+
+	// All listeners share one stream; (re)open it if it is not running
+	if(!listen_stream || !listen_stream->IsActive())
+	{
+		ReplaceListenStream();
+	}
+}
+
+void Firestore::OnListenStreamFinished(const ListenStream *stream)
+{
+	std::lock_guard<std::mutex> lock(listen_stream_mutex);
+	if(shutting_down || listen_stream.get() != stream || listen_resume_alarm != nullptr || listen_stream->IsEmpty())
+	{
+		return; // The stream was stopped on purpose, or is already being resumed
+	}
+
+	// Resume right away if the stream had reached the server,
+	// otherwise back off until the server can be reached again
+	if(listen_stream->IsConnected())
+	{
+		listen_resume_attempts = 0;
+	}
+	std::chrono::milliseconds delay(0);
+	if(listen_resume_attempts > 0)
+	{
+		delay = std::min(max_listen_resume_delay, std::chrono::milliseconds(250LL << std::min(listen_resume_attempts - 1, 16u)));
+	}
+	listen_resume_attempts++;
+	verbose << "Firestore::Listen(): Stream broke; resuming in " << delay.count() << " ms" << std::endl;
+
+	listen_resume_alarm = new ListenResumeAlarm(*this); // Deleted by the poller thread
+	listen_resume_alarm->alarm.Set(GetCompletionQueue(), std::chrono::system_clock::now() + delay, listen_resume_alarm);
+}
+
+void Firestore::ResumeListenStream(const bool ok)
+{
+	std::lock_guard<std::mutex> lock(listen_stream_mutex);
+	listen_resume_alarm = nullptr;
+	if(!ok || shutting_down)
+	{
+		return; // Cancelled
+	}
+
+	// Listen may have reopened the stream in the meantime
+	if(listen_stream && !listen_stream->IsActive())
+	{
+		ReplaceListenStream();
+	}
+}
+
+void Firestore::SaveListenTargets()
+{
+	if(listen_targets_path.empty())
+	{
+		return;
+	}
+
+	// Every target is preceded by its size
+	std::string contents;
+	if(listen_stream)
+	{
+		for(const ::firestore::client::Target &target : listen_stream->GetResumableTargets())
+		{
+			const std::string serialized_target = target.SerializeAsString();
+			const uint32_t size = (uint32_t)serialized_target.size();
+			contents.append((const char*)&size, sizeof(uint32_t));
+			contents.append(serialized_target);
+		}
+	}
+
+	const std::string temporary_path = listen_targets_path + ".tmp";
+	FILE *file = fopen(temporary_path.c_str(), "wb");
+	if(file == nullptr)
+	{
+		std::cerr << "Firestore::SaveListenTargets(): Failed to create " << temporary_path << std::endl;
+		return;
+	}
+	const bool written = fwrite(contents.data(), 1, contents.size(), file) == contents.size();
+	if(fclose(file) != 0 || !written || !RenameFile(temporary_path, listen_targets_path))
+	{
+		std::cerr << "Firestore::SaveListenTargets(): Failed to write " << listen_targets_path << std::endl;
+		remove(temporary_path.c_str());
+	}
+}
+
+void Firestore::LoadListenTargets()
+{
+	FILE *file = fopen(listen_targets_path.c_str(), "rb");
+	if(file == nullptr)
+	{
+		return; // Nothing saved
+	}
+	std::string contents;
+	char buffer[4096];
+	size_t num_read;
+	while((num_read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+	{
+		contents.append(buffer, num_read);
+	}
+	fclose(file);
+
+	size_t offset = 0;
+	while(offset + sizeof(uint32_t) <= contents.size())
+	{
+		uint32_t size;
+		memcpy(&size, contents.data() + offset, sizeof(uint32_t));
+		offset += sizeof(uint32_t);
+
+		::firestore::client::Target target;
+		if(offset + size > contents.size() || !target.ParseFromArray(contents.data() + offset, size))
+		{
+			break;
+		}
+		offset += size;
+		if(target.documents().documents_size() == 1)
+		{
+			saved_listen_targets[target.documents().documents(0)] = target;
+		}
+	}
+}
+
+void Firestore::CacheMissingDocument(const std::string &name, const google::protobuf::Timestamp &read_time) const
+{
+	if(document_cache)
+	{
+		document_cache->PutNoDocument(name, read_time);
+	}
+	if(document_store)
+	{
+		document_store->PutNoDocument(name, read_time);
+	}
+}
+
+void Firestore::InvalidateCachedDocument(const std::string &name) const
+{
+	ForgetPendingRead(name);
+	if(document_cache)
+	{
+		document_cache->Remove(name);
+	}
+	if(document_store)
+	{
+		document_store->Remove(name);
+	}
+}
+
+std::string Firestore::GetWriteDocumentName(const google::firestore::v1::Write &write)
+{
+	switch(write.operation_case())
+	{
+		case google::firestore::v1::Write::kUpdate:    return write.update().name();
+		case google::firestore::v1::Write::kDelete:    return write.delete_();
+		case google::firestore::v1::Write::kTransform: return write.transform().document();
+		default:                                       return std::string();
+	}
+}
+
+std::string Firestore::GetFullParentPath(const std::string &parent_path) const
+{
+	if(parent_path.empty())
+	{
+		return database_base_path + "/documents";
+	}
+	return GetFullDocumentPath(parent_path);
+}
+
+std::vector<int32_t> Firestore::GetChannelInFlightCounts() const
+{
+	std::vector<int32_t> counts;
+	for(const auto &pooled_channel : channels)
+	{
+		counts.push_back(pooled_channel->in_flight);
+	}
+	return counts;
+}
+
+Firestore::PooledChannel *Firestore::SelectChannel() const
+{
+	const uint32_t first = next_channel++ % channels.size();
+	if(channel_selection == FirestoreSettings::LEAST_IN_FLIGHT)
+	{
+		// Start the scan at the round-robin position,
+		// so that ties are spread over the channels
+		PooledChannel *least_loaded = channels[first].get();
+		for(size_t i = 1; i < channels.size(); i++)
+		{
+			PooledChannel *candidate = channels[(first + i) % channels.size()].get();
+			if(candidate->in_flight < least_loaded->in_flight)
+			{
+				least_loaded = candidate;
+			}
+		}
+		return least_loaded;
+	}
+	return channels[first].get();
+}
+
+void Firestore::RegisterCall(grpc::ClientContext *client_context) const
+{
+	std::lock_guard<std::mutex> lock(active_calls_mutex);
+	active_calls.insert(client_context);
+	if(cancelling_calls)
+	{
+		client_context->TryCancel(); // Started during shutdown
+	}
+}
+
+void Firestore::UnregisterCall(grpc::ClientContext *client_context) const
+{
+	std::lock_guard<std::mutex> lock(active_calls_mutex);
+	active_calls.erase(client_context);
+}
+
+void Firestore::CancelCalls()
+{
+	std::lock_guard<std::mutex> lock(active_calls_mutex);
+	cancelling_calls = true;
+	for(grpc::ClientContext *client_context : active_calls)
+	{
+		client_context->TryCancel();
+	}
+}
+
+grpc::CompletionQueue *Firestore::GetCompletionQueue() const
+{
+	// Spread the calls evenly over the poller threads
+	return completion_queues[next_completion_queue++ % completion_queues.size()].get();
+}
+
+void Firestore::PollCompletionQueue(grpc::CompletionQueue *cq)
+{
+	void *tag; bool ok;
+	while(cq->Next(&tag, &ok)) // Blocks until the next operation completes; returns false once the queue is shut down and drained
+	{
+		AsyncCall *call = static_cast<AsyncCall*>(tag);
+		if(!call->Proceed(ok))
+		{
+			delete call;
+		}
+	}
+}
+
+Firestore::ListenStream::ListenStream(Firestore &firestore) :
+	firestore(firestore),
+	channel(firestore.SelectChannel()),
+	start_tag(this, OPERATION_START),
+	read_tag(this, OPERATION_READ),
+	write_tag(this, OPERATION_WRITE),
+	finish_tag(this, OPERATION_FINISH),
+	stream_ready(false),
+	write_in_flight(false),
+	finished(false),
+	notifying_target_id(0),
+	listening(false),
+	connected(false)
+{
+	// Need to include google-cloud-resource-prefix in the header,
+	// otherwise it won't connect
+	client_context.AddMetadata("google-cloud-resource-prefix", firestore.database_base_path);
+	PrepareReply();
+}
+
+Firestore::ListenStream::~ListenStream()
+{
+	Stop();
+
+	// The tags are members of this object, so wait until
+	// the poller threads are done with the stream
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		finished_condition.wait(lock, [this]() { return finished && !write_in_flight; });
+	}
+	firestore.UnregisterCall(&client_context);
+}
+
+void Firestore::ListenStream::Start()
+{
+	// Initiate firestore listen call
+	// The stream is driven by the poller threads from here on
+	listening = true;
+	firestore.RegisterCall(&client_context);
+	rpc = channel.Stub()->PrepareAsyncListen(&client_context, firestore.GetCompletionQueue());
+	rpc->StartCall(&start_tag);
+}
+
+void Firestore::ListenStream::Stop()
+{
+	// The stream is shared by every listener, so it will never end on its own;
+	// cancel it to make the pending read return
+	if(listening.exchange(false))
+	{
+		client_context.TryCancel();
+	}
+}
+
+bool Firestore::ListenStream::IsActive() const
+{
+	return listening;
+}
+
+bool Firestore::ListenStream::IsFinished()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return finished && !write_in_flight;
+}
+
+bool Firestore::ListenStream::IsEmpty()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return listeners.empty();
+}
+
+bool Firestore::ListenStream::IsConnected() const
+{
+	return connected;
+}
+
+void Firestore::ListenStream::AddTarget(const int32_t target_id, const std::string &document_path, const SharedListenCallback &callback,
+	const ::firestore::client::Target *resume_target, const Document *document)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	const std::string document_name = firestore.GetFullDocumentPath(document_path);
+	Listener &listener = listeners[target_id];
+	listener = Listener();
+	listener.document_path = document_path;
+	listener.document_name = document_name;
+	listener.callback = callback;
+	listener.active = std::make_shared<std::atomic<bool>>(true);
+	if(resume_target != nullptr)
+	{
+		listener.target = *resume_target;
+	}
+	listener.target.set_target_id(target_id);
+
+	// We will listen to the document with path:
+	// projects/{project_id}/databases/{database_id}/documents/{document_path}
+	listener.target.mutable_documents()->clear_documents();
+	listener.target.mutable_documents()->add_documents(document_name);
+
+	WatchedDocument &watched_document = watched_documents[document_name];
+	if(watched_document.target_ids.empty())
+	{
+		watched_document.exists = document != nullptr;
+		if(document != nullptr)
+		{
+			watched_document.document = *document;
+		}
+	}
+	watched_document.target_ids.insert(target_id);
+
+	QueueAddTarget(listener.target);
+}
+
+void Firestore::ListenStream::AddQueryTarget(const int32_t target_id, const std::string &parent_name, const StructuredQuery &query,
+	const QueryListenCallback &callback)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	Listener &listener = listeners[target_id];
+	listener = Listener();
+	listener.query_callback = callback;
+	listener.active = std::make_shared<std::atomic<bool>>(true);
+	listener.delivery = std::make_shared<QueryDelivery>();
+	listener.target.set_target_id(target_id);
+
+	// The server runs the query, and sends the documents entering
+	// and leaving its result set from then on
+	google::firestore::v1::Target::QueryTarget *query_target = listener.target.mutable_query();
+	query_target->set_parent(parent_name);
+	*query_target->mutable_structured_query() = query;
+
+	QueueAddTarget(listener.target);
+}
+
+void Firestore::ListenStream::AdoptListeners(ListenStream &stream)
+{
+	std::map<int32_t, Listener> adopted_listeners;
+	std::map<std::string, WatchedDocument> adopted_documents;
+	{
+		std::lock_guard<std::mutex> lock(stream.mutex);
+		adopted_listeners.swap(stream.listeners);
+		adopted_documents.swap(stream.watched_documents);
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	watched_documents.swap(adopted_documents);
+	for(auto &entry : adopted_listeners)
+	{
+		// The copies of the documents are stale until the server has caught up
+		Listener &listener = entry.second;
+		listener.current = false;
+		listener.pending_responses = 0;
+		QueueAddTarget(listener.target);
+		listeners[entry.first] = std::move(listener);
+	}
+}
+
+std::vector<::firestore::client::Target> Firestore::ListenStream::GetResumableTargets()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	std::vector<::firestore::client::Target> targets;
+	for(const auto &entry : listeners)
+	{
+		// The result set of a query is not saved, so query targets are only resumed within a run
+		if(!entry.second.target.resume_token().empty() && !entry.second.target.has_query())
+		{
+			targets.push_back(entry.second.target);
+		}
+	}
+	return targets;
+}
+
+void Firestore::ListenStream::QueueAddTarget(const ::firestore::client::Target &target)
+{
+	// To listen to a document, we have to add a target
+	// for it with our own target id
+	google::firestore::v1::ListenRequest request;
+	request.set_database(firestore.database_base_path);
+	google::firestore::v1::Target *add_target = request.mutable_add_target();
+	add_target->set_target_id(target.target_id());
+	add_target->set_once(false); // Keep listening after the initial document is received
+	if(target.has_query())
+	{
+		*add_target->mutable_query() = target.query();
+	}
+	else
+	{
+		*add_target->mutable_documents() = target.documents();
+	}
+
+	// With a resume token, the server only sends the changes made since
+	if(!target.resume_token().empty())
+	{
+		add_target->set_resume_token(target.resume_token());
+	}
+	QueueRequest(request);
+}
+
+void Firestore::ListenStream::RecordResumeToken(const google::firestore::v1::TargetChange &change)
+{
+	if(change.resume_token().empty())
+	{
+		return;
+	}
+
+	// A target can only be resumed from a snapshot that includes its initial state
+	auto record = [&change](Listener &listener)
+	{
+		if(listener.current)
+		{
+			listener.target.set_resume_token(change.resume_token());
+			if(change.has_read_time())
+			{
+				*listener.target.mutable_snapshot_version() = change.read_time();
+			}
+		}
+	};
+
+	// A change without target ids applies to every target
+	std::lock_guard<std::mutex> lock(mutex);
+	if(change.target_ids_size() == 0)
+	{
+		for(auto &entry : listeners)
+		{
+			record(entry.second);
+		}
+	}
+	for(int32_t id : change.target_ids())
+	{
+		auto itr = listeners.find(id);
+		if(itr != listeners.end())
+		{
+			record(itr->second);
+		}
+	}
+}
+
+bool Firestore::ListenStream::RemoveTarget(const int32_t target_id)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	auto itr = listeners.find(target_id);
+	if(itr == listeners.end())
+	{
+		return false;
+	}
+	if(itr->second.target.has_query())
+	{
+		verbose << "Firestore::Unlisten(): Unlistening for changes in query with id=" << target_id << std::endl;
+	}
+	else
+	{
+		verbose << "Firestore::Unlisten(): Unlistening for changes in document with path \"" << itr->second.document_path << "\"" << std::endl;
+	}
+	EraseListener(target_id);
+
+	google::firestore::v1::ListenRequest request;
+	request.set_database(firestore.database_base_path);
+	request.set_remove_target(target_id);
+	QueueRequest(request);
+
+	// Wait for the callback to return if it is running on another thread,
+	// so that it is never invoked after Unlisten has returned
+	finished_condition.wait(lock, [this, target_id]()
+	{
+		return notifying_target_id != target_id || notifying_thread_id == std::this_thread::get_id();
+	});
+	lock.unlock();
+	if(firestore.listen_executor)
+	{
+		firestore.listen_executor->Cancel(target_id);
+	}
+	return true;
+}
+
+bool Firestore::ListenStream::EraseListener(const int32_t target_id)
+{
+	auto itr = listeners.find(target_id);
+	if(itr == listeners.end())
+	{
+		return false;
+	}
+
+	// The callbacks still queued for the listener are skipped
+	*itr->second.active = false;
+
+	UnwatchDocument(itr->second.document_name, target_id);
+	listeners.erase(itr);
+	return true;
+}
+
+void Firestore::ListenStream::UnwatchDocument(const std::string &name, const int32_t target_id)
+{
+	// Forget the document once no target watches it
+	auto itr = watched_documents.find(name);
+	if(itr != watched_documents.end())
+	{
+		itr->second.target_ids.erase(target_id);
+		if(itr->second.target_ids.empty())
+		{
+			watched_documents.erase(itr);
+		}
+	}
+}
+
+bool Firestore::ListenStream::GetWatchedDocument(const std::string &name, Document *document_out, bool *exists_out)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if(finished || !listening)
+	{
+		return false; // The copies are no longer kept up to date
+	}
+
+	auto itr = watched_documents.find(name);
+	if(itr == watched_documents.end())
+	{
+		return false;
+	}
+
+	// The copy is only up to date once one of its targets is current
+	const WatchedDocument &watched_document = itr->second;
+	for(int32_t id : watched_document.target_ids)
+	{
+		auto listener_itr = listeners.find(id);
+		if(listener_itr != listeners.end() && listener_itr->second.current)
+		{
+			if(watched_document.exists)
+			{
+				*document_out = watched_document.document;
+			}
+			*exists_out = watched_document.exists;
+			return true;
+		}
+	}
+	return false;
+}
+
+void Firestore::ListenStream::ApplyDocument(const Document &document)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	auto itr = watched_documents.find(document.name());
+	if(itr == watched_documents.end())
+	{
+		return;
+	}
+
+	// Never go back to an older version; the stream may be ahead of the read
+	WatchedDocument &watched_document = itr->second;
+	if(watched_document.exists && document.update_time() < watched_document.document.update_time())
+	{
+		return;
+	}
+	watched_document.exists = true;
+	watched_document.document = document;
+}
+
+void Firestore::ListenStream::UpdateWatchedDocument(const std::string &name, const Document *document)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto itr = watched_documents.find(name);
+		if(itr != watched_documents.end())
+		{
+			itr->second.exists = document != nullptr;
+			if(document != nullptr)
+			{
+				itr->second.document = *document;
+			}
+			else
+			{
+				itr->second.document.Clear();
+			}
+		}
+	}
+
+	// Share the change with the document cache
+	if(document != nullptr)
+	{
+		firestore.StoreCachedDocument(*document);
+	}
+	else
+	{
+		firestore.InvalidateCachedDocument(name);
+	}
+}
+
+void Firestore::ListenStream::QueueRequest(const google::firestore::v1::ListenRequest &request)
+{
+	// Only one write may be outstanding on a stream at a time,
+	// so requests are queued up and written one by one
+	pending_requests.push_back(request);
+	WriteNextRequest();
+}
+
+void Firestore::ListenStream::PrepareReply()
+{
+	// Once the listeners are done with the response, the next one can reuse
+	// its memory; otherwise the documents they kept hold on to it
+	if(reply && reply.use_count() == 1)
+	{
+		reply->arena.Reset();
+	}
+	else
+	{
+		reply = std::make_shared<SharedResponse>();
+	}
+	reply->response = reply->arena.Create<google::firestore::v1::ListenResponse>();
+}
+
+void Firestore::ListenStream::WriteNextRequest()
+{
+	if(!stream_ready || write_in_flight || pending_requests.empty())
+	{
+		return;
+	}
+	write_in_flight = true;
+	rpc->Write(pending_requests.front(), &write_tag);
+}
+
+void Firestore::ListenStream::Notify(const int32_t target_id, const DocumentHandle &document)
+{
+	SharedListenCallback callback;
+	std::shared_ptr<std::atomic<bool>> active;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto itr = listeners.find(target_id);
+		if(itr == listeners.end())
+		{
+			return; // Listener was removed
+		}
+		itr->second.notified = true;
+		callback = itr->second.callback;
+		active = itr->second.active;
+		if(!firestore.listen_executor)
+		{
+			BeginCallback(target_id);
+		}
+	}
+
+	// Hand the callback over to the executor, so that a slow callback does not hold up the stream.
+	// Only the latest version of a document matters, so the callback may be superseded by the next one.
+	assert(callback);
+	if(firestore.listen_executor)
+	{
+		firestore.listen_executor->Post(target_id, [callback, document, active]()
+		{
+			if(*active)
+			{
+				callback(document);
+			}
+		}, true);
+		return;
+	}
+
+	// Invoke the callback without holding the lock, so that
+	// it may call Listen or Unlisten itself
+	callback(document);
+	EndCallback();
+}
+
+void Firestore::ListenStream::HandleDocumentChange(const int32_t target_id, const std::string &name, const DocumentHandle &document)
+{
+	bool is_query;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto itr = listeners.find(target_id);
+		if(itr == listeners.end())
+		{
+			return; // Listener was removed
+		}
+		Listener &listener = itr->second;
+		if(listener.pending_responses > 0)
+		{
+			return; // The target is being resynced; the change comes from the stream being torn down
+		}
+		is_query = listener.target.has_query();
+
+		// Only the latest version matters until the change is delivered
+		if(is_query || firestore.consistent_listen_snapshots)
+		{
+			listener.pending_changes[name] = document;
+		}
+	}
+
+	if(firestore.consistent_listen_snapshots)
+	{
+		return; // Delivered with the next global snapshot
+	}
+	if(is_query)
+	{
+		NotifyQuery(target_id);
+	}
+	else
+	{
+		Notify(target_id, document);
+	}
+}
+
+void Firestore::ListenStream::CheckExistenceFilter(const int32_t target_id, const int32_t count)
+{
+	std::string document_name;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto itr = listeners.find(target_id);
+		if(itr == listeners.end() || itr->second.pending_responses > 0)
+		{
+			return;
+		}
+		Listener &listener = itr->second;
 
-					// TargetChangeType::RESET:
-					// This response is received once the server has reset target(s)
-					case google::firestore::v1::TargetChange::RESET:
-						verbose << "Firestore::Listen(): Received a target change response of type RESET" << std::endl;
-						for(int32_t id : change.target_ids())
-						{
-							verbose << "Firestore::Listen(): Target with id=" << id << " reset" << std::endl;
-						}
-						break;
+		if(listener.target.has_query())
+		{
+			// Count the documents of the result set once the pending changes are applied
+			int64_t local_count = 0;
+			if(!listener.reset)
+			{
+				local_count = listener.results.size();
+			}
+			for(const auto &pending_change : listener.pending_changes)
+			{
+				const bool in_results = !listener.reset && listener.results.count(pending_change.first) > 0;
+				if(pending_change.second && !in_results)
+				{
+					local_count++;
+				}
+				else if(!pending_change.second && in_results)
+				{
+					local_count--;
+				}
+			}
+			if(local_count != count)
+			{
+				verbose << "Firestore::Listen(): Target with id=" << target_id << " has " << local_count <<
+					" documents, but the server counts " << count << "; resyncing the target" << std::endl;
+				QueueResyncTarget(listener);
+			}
+			return;
+		}
 
-					default:
-						std::cerr << "Firestore::Listen(): Received an nvalid TargetChangeType of value=" << target_change_type << std::endl;
-						return;
+		// A document target matches one document at most
+		auto watched_itr = watched_documents.find(listener.document_name);
+		const bool exists = watched_itr != watched_documents.end() && watched_itr->second.exists;
+		if(exists == (count > 0))
+		{
+			return;
+		}
+		if(!exists)
+		{
+			verbose << "Firestore::Listen(): Target with id=" << target_id << " missed its document; resyncing the target" << std::endl;
+			QueueResyncTarget(listener);
+			return;
+		}
+		document_name = listener.document_name;
+
+		// The server no longer has the document; we missed its deletion
+		if(firestore.consistent_listen_snapshots)
+		{
+			listener.pending_changes[document_name] = nullptr; // Delivered with the next global snapshot
+		}
+	}
+
+	verbose << "Firestore::Listen(): Target with id=" << target_id << " missed the deletion of its document" << std::endl;
+	UpdateWatchedDocument(document_name, nullptr);
+	if(!firestore.consistent_listen_snapshots)
+	{
+		Notify(target_id, nullptr);
+	}
+}
+
+void Firestore::ListenStream::AcknowledgeTarget(const int32_t target_id)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	auto itr = listeners.find(target_id);
+	if(itr != listeners.end() && itr->second.pending_responses > 0)
+	{
+		itr->second.pending_responses--;
+	}
+}
+
+void Firestore::ListenStream::QueueResyncTarget(Listener &listener)
+{
+	// Have the server send the target from scratch; the documents
+	// it does not send again are dropped once the target is current
+	listener.current = false;
+	listener.reset = true;
+	listener.pending_changes.clear();
+	listener.target.clear_resume_token();
+	listener.target.clear_snapshot_version();
+
+	// Until the server has removed the old target and added the new one,
+	// the responses for the target id still belong to the old target
+	listener.pending_responses = 2;
+
+	google::firestore::v1::ListenRequest request;
+	request.set_database(firestore.database_base_path);
+	request.set_remove_target(listener.target.target_id());
+	QueueRequest(request);
+	QueueAddTarget(listener.target);
+}
+
+void Firestore::ListenStream::DeliverSnapshot()
+{
+	// Every listener with something to deliver gets one callback for the snapshot
+	std::vector<int32_t> target_ids;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for(const auto &entry : listeners)
+		{
+			const Listener &listener = entry.second;
+			if(listener.current && (!listener.notified || !listener.pending_changes.empty()))
+			{
+				target_ids.push_back(entry.first);
+			}
+		}
+	}
+	for(int32_t id : target_ids)
+	{
+		NotifyPending(id);
+	}
+}
+
+void Firestore::ListenStream::NotifyPending(const int32_t target_id)
+{
+	bool is_query;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto itr = listeners.find(target_id);
+		if(itr == listeners.end())
+		{
+			return; // Listener was removed
+		}
+		is_query = itr->second.target.has_query();
+	}
+	if(is_query)
+	{
+		NotifyQuery(target_id);
+	}
+	else
+	{
+		NotifyDocument(target_id);
+	}
+}
+
+void Firestore::ListenStream::NotifyDocument(const int32_t target_id)
+{
+	DocumentHandle document;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto itr = listeners.find(target_id);
+		if(itr == listeners.end() || !itr->second.current)
+		{
+			return; // Listener was removed, or the document is not up to date yet
+		}
+
+		Listener &listener = itr->second;
+		if(!listener.pending_changes.empty())
+		{
+			// The latest version of the one document of the target
+			document = listener.pending_changes.begin()->second;
+			listener.pending_changes.clear();
+		}
+		else if(listener.notified)
+		{
+			return;
+		}
+		else
+		{
+			// If no document was sent before the target became current,
+			// the requested document does not exist, or is unchanged
+			// since the snapshot the target was resumed from
+			auto watched_itr = watched_documents.find(listener.document_name);
+			if(!listener.target.resume_token().empty() &&
+				watched_itr != watched_documents.end() && watched_itr->second.exists)
+			{
+				document = std::make_shared<Document>(watched_itr->second.document);
+			}
+		}
+	}
+	Notify(target_id, document);
+}
+
+void Firestore::ListenStream::NotifyQuery(const int32_t target_id)
+{
+	QueryListenCallback callback;
+	std::shared_ptr<std::atomic<bool>> active;
+	std::shared_ptr<QueryDelivery> delivery;
+	std::vector<QueryChange> changes;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto itr = listeners.find(target_id);
+		if(itr == listeners.end() || !itr->second.current)
+		{
+			return; // Listener was removed, or the result set is not consistent yet
+		}
+
+		// Apply the pending changes to the result set, turning them into deltas
+		Listener &listener = itr->second;
+		for(auto &pending_change : listener.pending_changes)
+		{
+			auto result_itr = listener.results.find(pending_change.first);
+			if(pending_change.second)
+			{
+				// The result set keeps a copy rather than the whole response the document came in,
+				// as it holds on to the document for as long as the document matches the query
+				if(result_itr == listener.results.end())
+				{
+					DocumentHandle document = std::make_shared<Document>(*pending_change.second);
+					changes.push_back({ QUERY_DOCUMENT_ADDED, document.get(), document });
+					listener.results.emplace(pending_change.first, document);
+				}
+				else if(result_itr->second->update_time() != pending_change.second->update_time())
+				{
+					DocumentHandle document = std::make_shared<Document>(*pending_change.second);
+					changes.push_back({ QUERY_DOCUMENT_MODIFIED, document.get(), document });
+					result_itr->second = document;
 				}
 			}
-			break;
+			else if(result_itr != listener.results.end())
+			{
+				changes.push_back({ QUERY_DOCUMENT_REMOVED, result_itr->second.get(), result_itr->second });
+				listener.results.erase(result_itr);
+			}
+		}
+		listener.pending_changes.clear();
+
+		// The initial result set is delivered even if it is empty
+		if(changes.empty() && listener.notified)
+		{
+			return;
+		}
+		listener.notified = true;
+		callback = listener.query_callback;
+		active = listener.active;
+		delivery = listener.delivery;
+		if(!firestore.listen_executor)
+		{
+			BeginCallback(target_id);
+		}
+	}
 
-			// ResponseTypeCase::kDocumentChange:
-			// This response is received whenever a document change
-			// occured in any listened documents on the server-side
-			case google::firestore::v1::ListenResponse::kDocumentChange:
+	// The changes to the result set are never dropped, as each one builds on the previous ones.
+	// Instead, they are merged with the changes still waiting for the callback thread,
+	// which then delivers them all at once.
+	assert(callback);
+	if(firestore.listen_executor)
+	{
+		{
+			std::lock_guard<std::mutex> lock(delivery->mutex);
+			for(const QueryChange &change : changes)
+			{
+				MergeQueryChange(&delivery->changes, change);
+			}
+			if(delivery->queued)
+			{
+				return;
+			}
+			delivery->queued = true;
+		}
+		firestore.listen_executor->Post(target_id, [callback, delivery, active]()
+		{
+			std::vector<QueryChange> delivered_changes;
 			{
-				verbose << "Firestore::Listen(): Received document change response" << std::endl;
-				const google::firestore::v1::DocumentChange &change = reply->document_change();
-				for(int32_t id : change.target_ids()) // List of all target ids that map to this document
+				std::lock_guard<std::mutex> lock(delivery->mutex);
+				for(auto &change : delivery->changes)
+				{
+					delivered_changes.push_back(std::move(change.second));
+				}
+				delivery->changes.clear();
+				delivery->queued = false;
+
+				// The merged changes may cancel each other out
+				if(delivered_changes.empty() && delivery->delivered)
 				{
-					verbose << "Firestore::Listen(): Document target with id=" << id << " changed" << std::endl;
+					return;
 				}
+				delivery->delivered = true;
+			}
+			if(*active)
+			{
+				callback(delivered_changes);
+			}
+		}, false);
+		return;
+	}
+	callback(changes);
+	EndCallback();
+}
+
+void Firestore::ListenStream::MergeQueryChange(std::map<std::string, QueryChange> *changes, const QueryChange &change)
+{
+	const std::string &name = change.document->name();
+	auto itr = changes->find(name);
+	if(itr == changes->end())
+	{
+		changes->emplace(name, change);
+		return;
+	}
+
+	// The callback has not seen the earlier change, so the two become one
+	QueryChange &earlier_change = itr->second;
+	if(earlier_change.type == QUERY_DOCUMENT_ADDED && change.type == QUERY_DOCUMENT_REMOVED)
+	{
+		changes->erase(itr); // Never seen by the callback
+	}
+	else if(earlier_change.type == QUERY_DOCUMENT_ADDED)
+	{
+		earlier_change = { QUERY_DOCUMENT_ADDED, change.document, change.handle };
+	}
+	else if(earlier_change.type == QUERY_DOCUMENT_REMOVED && change.type == QUERY_DOCUMENT_ADDED)
+	{
+		earlier_change = { QUERY_DOCUMENT_MODIFIED, change.document, change.handle };
+	}
+	else
+	{
+		earlier_change = change;
+	}
+}
+
+void Firestore::ListenStream::BeginCallback(const int32_t target_id)
+{
+	notifying_target_id = target_id;
+	notifying_thread_id = std::this_thread::get_id();
+}
+
+void Firestore::ListenStream::EndCallback()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	notifying_target_id = 0;
+	notifying_thread_id = std::thread::id();
+	finished_condition.notify_all();
+}
+
+void Firestore::ListenStream::Proceed(const Operation operation, bool ok)
+{
+	switch(operation)
+	{
+		case OPERATION_START:
+			if(!ok)
+			{
+				std::cout << "Firestore::Listen(): Failed to initialize stream." << std::endl;
+				listening = false;
+				rpc->Finish(&status, &finish_tag);
+				break;
+			}
+
+			// Write the add target requests that were queued up
+			// while the stream was being set up
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stream_ready = true;
+				WriteNextRequest();
+			}
+			rpc->Read(reply->response, &read_tag);
+			break;
+
+		case OPERATION_WRITE:
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			write_in_flight = false;
+			if(!ok)
+			{
+				// The stream is broken; the pending read will fail as well
+				verbose << "Firestore::Listen(): Failed to write to stream." << std::endl;
+			}
+			else
+			{
+				pending_requests.pop_front();
+				WriteNextRequest();
+			}
+			finished_condition.notify_all();
+		}
+		break;
+
+		// Only one read is outstanding at a time, so the responses
+		// are processed in order even though any poller thread may
+		// pick them up
+		case OPERATION_READ:
+			if(ok)
+			{
+				connected = true;
+			}
+			if(!ok || !ProcessResponse(std::shared_ptr<const google::firestore::v1::ListenResponse>(reply, reply->response)))
+			{
+				// The stream was closed (or cancelled);
+				// retrieve the final status
+				listening = false;
+				rpc->Finish(&status, &finish_tag);
+				break;
+			}
+
+			PrepareReply();
+			rpc->Read(reply->response, &read_tag);
+			break;
+
+		case OPERATION_FINISH:
+			if(!status.ok() && status.error_code() != grpc::StatusCode::CANCELLED)
+			{
+				std::cout << "Firestore::Listen(): Received ok=false on finish" << std::endl;
+				std::cout << "Message:" << std::endl;
+				std::cout << status.error_message() << std::endl;
+				std::cout << status.error_details() << std::endl;
+			}
 
-				assert(callback);
-				callback(&change.document());
+			// Resume the listeners on a new stream, unless the stream was stopped.
+			// This has to happen before the stream is marked as finished,
+			// as the stream may be destroyed as soon as it is.
+			firestore.OnListenStreamFinished(this);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				finished = true;
+				stream_ready = false; // No more writes may be started
+				finished_condition.notify_all();
 			}
 			break;
+	}
+}
+
+bool Firestore::ListenStream::ProcessResponse(const std::shared_ptr<const google::firestore::v1::ListenResponse> &shared_response)
+{
+	const google::firestore::v1::ListenResponse &response = *shared_response;
+	const google::firestore::v1::ListenResponse::ResponseTypeCase response_type_case = response.response_type_case();
+	switch(response_type_case)
+	{
+		// ResponseTypeCase::kTargetChange:
+		// This response is received whenever a change
+		// occured in a server-side target
+		case google::firestore::v1::ListenResponse::kTargetChange:
+		{
+			const google::firestore::v1::TargetChange &change = response.target_change();
 
-			// ResponseTypeCase::kDocumentDelete:
-			// This response is received whenever a target document
-			// was deleted on the server-side
-			case google::firestore::v1::ListenResponse::kDocumentDelete:
+			// Check for error in target change
+			const google::rpc::Status &cause = change.cause();
+			int32_t code = cause.code();
+			if(code != 0)
 			{
-				verbose << "Firestore::Listen(): Received document deleted response" << std::endl;
-				const google::firestore::v1::DocumentDelete &change = reply->document_delete();
-				for(int32_t id : change.removed_target_ids()) // List of all target ids that map to this document
+				std::cout << "Firestore::Listen(): Received a non-zero rpc status code (code=" << code << ") " <<
+					"with a ResponseTypeCase::kTargetChange response" << std::endl;
+				std::cout << "Message:" << std::endl;
+				std::cout << cause.message() << std::endl;
+
+				// An error without target ids applies to the whole stream
+				if(change.target_ids_size() == 0)
 				{
-					verbose << "Firestore::Listen(): Document target with id=" << id << " was removed or does not exists" << std::endl;
+					return false;
 				}
-				verbose << "Firestore::Listen(): Document \"" << change.document() << "\"" << std::endl;
 
-				assert(callback);
-				callback(nullptr);
+				// Otherwise only the listeners of the failed targets are dropped
+				std::lock_guard<std::mutex> lock(mutex);
+				for(int32_t id : change.target_ids())
+				{
+					EraseListener(id);
+				}
+				return true;
+			}
+
+			// Process target change reply
+			const google::firestore::v1::TargetChange::TargetChangeType target_change_type = change.target_change_type();
+			switch(target_change_type)
+			{
+				// TargetChangeType::NO_CHANGE:
+				// This response is received periodically from the server
+				// There are no associated target ids sent
+				case google::firestore::v1::TargetChange::NO_CHANGE:
+					verbose << "Firestore::Listen(): Received a target change response of type NO_CHANGE" << std::endl;
+
+					// Without target ids and with a read time, the changes received so far
+					// are a consistent snapshot of every target as of that time
+					if(firestore.consistent_listen_snapshots && change.target_ids_size() == 0 && change.has_read_time())
+					{
+						DeliverSnapshot();
+					}
+					break;
+
+				// TargetChangeType::ADD:
+				// This response is received once the server has added target(s)
+				case google::firestore::v1::TargetChange::ADD:
+					verbose << "Firestore::Listen(): Received a target change response of type ADD" << std::endl;
+					for(int32_t id : change.target_ids())
+					{
+						verbose << "Firestore::Listen(): Target with id=" << id << " added server-side" << std::endl;
+						AcknowledgeTarget(id);
+					}
+					break;
+
+				// TargetChangeType::REMOVE:
+				// This response is received once the server has removed target(s)
+				case google::firestore::v1::TargetChange::REMOVE:
+					verbose << "Firestore::Listen(): Received a target change response of type REMOVE" << std::endl;
+					for(int32_t id : change.target_ids())
+					{
+						verbose << "Firestore::Listen(): Target with id=" << id << " removed server-side" << std::endl;
+						AcknowledgeTarget(id);
+					}
+					break;
+
+				// TargetChangeType::CURRENT:
+				// This response is received once the server has sent
+				// the initial state of the target(s)
+				case google::firestore::v1::TargetChange::CURRENT:
+					verbose << "Firestore::Listen(): Received a target change response of type CURRENT" << std::endl;
+					for(int32_t id : change.target_ids())
+					{
+						verbose << "Firestore::Listen(): Target with id=" << id << " is now current" << std::endl;
+
+						bool now_current = false;
+						{
+							std::lock_guard<std::mutex> lock(mutex);
+							auto itr = listeners.find(id);
+							if(itr != listeners.end() && itr->second.pending_responses == 0) // Otherwise sent for the target that is being resynced
+							{
+								// After a reset, the documents the server did not send again have left the result set
+								Listener &listener = itr->second;
+								listener.current = true;
+								if(listener.reset && listener.target.has_query())
+								{
+									for(const auto &result : listener.results)
+									{
+										listener.pending_changes.emplace(result.first, nullptr);
+									}
+								}
+								listener.reset = false;
+								now_current = true;
+							}
+						}
+
+						// With consistent snapshots, the changes wait for the next global snapshot instead
+						if(now_current && !firestore.consistent_listen_snapshots)
+						{
+							NotifyPending(id);
+						}
+					}
+					break;
+
+				// TargetChangeType::RESET:
+				// This response is received once the server has reset target(s)
+				case google::firestore::v1::TargetChange::RESET:
+					verbose << "Firestore::Listen(): Received a target change response of type RESET" << std::endl;
+					for(int32_t id : change.target_ids())
+					{
+						verbose << "Firestore::Listen(): Target with id=" << id << " reset" << std::endl;
+
+						// The server will resend the document before the target is current again
+						std::lock_guard<std::mutex> lock(mutex);
+						auto itr = listeners.find(id);
+						if(itr != listeners.end() && itr->second.pending_responses == 0)
+						{
+							itr->second.current = false;
+							if(itr->second.target.has_query())
+							{
+								itr->second.reset = true;
+								itr->second.pending_changes.clear();
+							}
+						}
+					}
+					break;
+
+				default:
+					std::cerr << "Firestore::Listen(): Received an nvalid TargetChangeType of value=" << target_change_type << std::endl;
+					return false;
 			}
-			break;
 
-			// ResponseTypeCase::kDocumentRemove:
-			// This response is received whenever a target document
-			// was removed on the server-side
-			// (unclear how it is different from kDocumentDelete)
-			case google::firestore::v1::ListenResponse::kDocumentRemove:
+			// Remember where the targets are at, to resume from there should the stream break
+			RecordResumeToken(change);
+		}
+		break;
+
+		// ResponseTypeCase::kDocumentChange:
+		// This response is received whenever a document change
+		// occured in any listened documents on the server-side
+		case google::firestore::v1::ListenResponse::kDocumentChange:
+		{
+			verbose << "Firestore::Listen(): Received document change response" << std::endl;
+			const google::firestore::v1::DocumentChange &change = response.document_change();
 			{
-				verbose << "Firestore::Listen(): Received document deleted response" << std::endl;
-				const google::firestore::v1::DocumentRemove &change = reply->document_remove();
-				for(int32_t id : change.removed_target_ids()) // List of all target ids that map to this document
+				// A document target that lost sight of the document watches it again
+				std::lock_guard<std::mutex> lock(mutex);
+				for(int32_t id : change.target_ids())
 				{
-					verbose << "Firestore::Listen(): Document target with id=" << id << " was removed or does not exists" << std::endl;
+					auto itr = listeners.find(id);
+					if(itr != listeners.end() && itr->second.document_name == change.document().name())
+					{
+						WatchedDocument &watched_document = watched_documents[itr->second.document_name];
+						if(watched_document.target_ids.empty())
+						{
+							watched_document.exists = true;
+							watched_document.document = change.document();
+						}
+						watched_document.target_ids.insert(id);
+					}
 				}
-				verbose << "Firestore::Listen(): Document \"" << change.document() << "\"" << std::endl;
+			}
+			UpdateWatchedDocument(change.document().name(), &change.document());
+
+			// The listeners get the document in place; the handle keeps the response alive
+			const DocumentHandle document(shared_response, &change.document());
+			for(int32_t id : change.target_ids()) // List of all target ids that map to this document
+			{
+				verbose << "Firestore::Listen(): Document target with id=" << id << " changed" << std::endl;
+				HandleDocumentChange(id, change.document().name(), document);
+			}
+			for(int32_t id : change.removed_target_ids()) // Targets this document no longer matches
+			{
+				HandleDocumentChange(id, change.document().name(), nullptr);
+			}
+		}
+		break;
 
-				assert(callback);
-				callback(nullptr);
+		// ResponseTypeCase::kDocumentDelete:
+		// This response is received whenever a target document
+		// was deleted on the server-side
+		case google::firestore::v1::ListenResponse::kDocumentDelete:
+		{
+			verbose << "Firestore::Listen(): Received document deleted response" << std::endl;
+			const google::firestore::v1::DocumentDelete &change = response.document_delete();
+			verbose << "Firestore::Listen(): Document \"" << change.document() << "\"" << std::endl;
+			UpdateWatchedDocument(change.document(), nullptr);
+			for(int32_t id : change.removed_target_ids()) // List of all target ids that map to this document
+			{
+				verbose << "Firestore::Listen(): Document target with id=" << id << " was removed or does not exists" << std::endl;
+				HandleDocumentChange(id, change.document(), nullptr);
+			}
+		}
+		break;
+
+		// ResponseTypeCase::kDocumentRemove:
+		// This response is received whenever a document
+		// is no longer relevant to a target on the server-side
+		case google::firestore::v1::ListenResponse::kDocumentRemove:
+		{
+			verbose << "Firestore::Listen(): Received document removed response" << std::endl;
+			const google::firestore::v1::DocumentRemove &change = response.document_remove();
+			verbose << "Firestore::Listen(): Document \"" << change.document() << "\"" << std::endl;
+			{
+				// The document is out of view of these targets, not deleted, so its
+				// copy is kept for the other targets and the cache is left alone
+				std::lock_guard<std::mutex> lock(mutex);
+				for(int32_t id : change.removed_target_ids())
+				{
+					UnwatchDocument(change.document(), id);
+				}
+			}
+			for(int32_t id : change.removed_target_ids()) // List of all target ids that map to this document
+			{
+				verbose << "Firestore::Listen(): Document target with id=" << id << " no longer matches the document" << std::endl;
+				HandleDocumentChange(id, change.document(), nullptr);
 			}
+		}
+		break;
+
+		// ResponseTypeCase::kFilter:
+		// This response is received with the number of documents
+		// matching a target, to check the client is not missing changes
+		case google::firestore::v1::ListenResponse::kFilter:
+		{
+			const google::firestore::v1::ExistenceFilter &filter = response.filter();
+			verbose << "Firestore::Listen(): Received existence filter for target with id=" << filter.target_id() <<
+				" (count=" << filter.count() << ")" << std::endl;
+			CheckExistenceFilter(filter.target_id(), filter.count());
+		}
+		break;
+
+		default:
+			std::cerr << "Firestore::Listen(): ResponseTypeCase " << response_type_case << " not implemented." << std::endl;
 			break;
+	}
+	return true;
+}
 
-			case google::firestore::v1::ListenResponse::kFilter:
-			default:
-				std::cerr << "Firestore::Listen(): ResponseTypeCase " << response_type_case << " not implemented." << std::endl;
-				break;
+QueryIterator::QueryIterator(const Firestore &firestore, const std::string &parent_path, const StructuredQuery &query) :
+	channel(firestore.SelectChannel()),
+	response(arena.Create<google::firestore::v1::RunQueryResponse>()),
+	finished(false)
+{
+	google::firestore::v1::RunQueryRequest request;
+	request.set_parent(firestore.GetFullParentPath(parent_path));
+	*request.mutable_structured_query() = query;
+	reader = channel.Stub()->RunQuery(&client_context, request);
+}
+
+QueryIterator::~QueryIterator()
+{
+	if(!finished)
+	{
+		// Stop the server from sending the rest of the result set
+		client_context.TryCancel();
+		reader->Finish();
+	}
+}
+
+bool QueryIterator::Next()
+{
+	if(finished)
+	{
+		return false;
+	}
+
+	// Skip the responses that only report progress
+	// The previous document is released first, so the next one can reuse its memory
+	arena.Reset();
+	response = arena.Create<google::firestore::v1::RunQueryResponse>();
+	while(reader->Read(response))
+	{
+		if(response->has_document())
+		{
+			return true;
 		}
-	} while(listening);
+		arena.Reset();
+		response = arena.Create<google::firestore::v1::RunQueryResponse>();
+	}
 
-	grpc::Status s;
-	rpc->Finish(&s, tag);
-	if(!s.ok())
+	finished = true;
+	status = reader->Finish();
+	if(!status.ok())
 	{
-		std::cout << "Firestore::Listen(): Received ok=false on finish" << std::endl;
+		std::cout << "Firestore::RunQuery(): Received ok=false" << std::endl;
 		std::cout << "Message:" << std::endl;
-		std::cout << s.error_message() << std::endl;
-		std::cout << s.error_details() << std::endl;
+		std::cout << status.error_message() << std::endl;
+		std::cout << status.error_details() << std::endl;
 	}
+	return false;
+}
+
+const Document &QueryIterator::GetDocument() const
+{
+	return response->document();
+}
+
+bool QueryIterator::Succeeded() const
+{
+	return finished && status.ok();
+}
+
+const grpc::Status &QueryIterator::GetStatus() const
+{
+	return status;
 }
 
 Transaction::Transaction(const std::string& transaction_id, Firestore* firestore) :
@@ -500,7 +2826,8 @@ bool Transaction::GetDocument(const std::string& document_path, Document* docume
 	request.set_transaction(transaction_id);
 
 	grpc::ClientContext client_context;
-	grpc::Status s = firestore->stub->GetDocument(&client_context, request, document_out);
+	const Firestore::ChannelLease channel(firestore->SelectChannel());
+	grpc::Status s = channel.Stub()->GetDocument(&client_context, request, document_out);
 	if(!s.ok())
 	{
 		std::cout << "Firestore::GetDocument(): Received ok=false" << std::endl;
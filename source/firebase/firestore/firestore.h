@@ -1,8 +1,27 @@
 #ifndef FIRESTORE_SRC_FIREBASE_FIRESTORE_FIRESTORE_H
 #define FIRESTORE_SRC_FIREBASE_FIRESTORE_FIRESTORE_H
 
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+
 #include <grpcpp/grpcpp.h>
+#include <grpcpp/alarm.h>
 #include "google/firestore/v1/firestore.grpc.pb.h"
+#include "firestore/local/target.pb.h"
+#include "callback_executor.h"
+#include "document_cache.h"
+#include "document_store.h"
+#include "message_arena.h"
+#include "snapshot_file.h"
 
 #ifdef FIRESTORE_VERBOSE
 #include <iostream>
@@ -25,10 +44,185 @@ namespace firestore {
 
 typedef google::protobuf::Map<std::string, google::firestore::v1::Value> DocumentFields;
 typedef std::function<void(const google::firestore::v1::Document*)> ListenCallback;
+typedef std::function<void(bool success, const google::firestore::v1::Document*)> DocumentCallback;
+typedef std::function<void(const std::string &document_path, const google::firestore::v1::Document*)> BatchGetCallback;
+typedef std::function<void(const google::firestore::v1::Document*)> QueryCallback;
 typedef google::firestore::v1::Document Document;
 typedef google::firestore::v1::Value Value;
+typedef google::firestore::v1::StructuredQuery StructuredQuery;
+
+/**
+ * A reference-counted, immutable document received by a listener.
+ * It may share the memory of the response the document came in, so keeping it
+ * costs no copy; that response is then kept until the last handle is released.
+ */
+typedef std::shared_ptr<const Document> DocumentHandle;
+typedef std::function<void(const DocumentHandle &document)> SharedListenCallback;
 
 class Transaction;
+class BulkWriter;
+class WriteStream;
+class QueryIterator;
+class MutationQueue;
+
+/**
+ * Where a read is served from when the document cache is enabled
+ * (see FirestoreSettings::document_cache_size and FirestoreSettings::document_store_path)
+ */
+enum ReadMode
+{
+	READ_SERVER_FIRST, // Read from the server; fall back on the cache if the server can't be reached
+	READ_CACHE_FIRST,  // Read from the cache; go to the server on a cache miss
+	READ_CACHE_ONLY    // Read from the cache only; never go to the server
+};
+
+/**
+ * How a document entered, changed in or left the result set of a query listener
+ */
+enum QueryChangeType
+{
+	QUERY_DOCUMENT_ADDED,    // The document now matches the query
+	QUERY_DOCUMENT_MODIFIED, // The document still matches the query, but was updated
+	QUERY_DOCUMENT_REMOVED   // The document was deleted, or no longer matches the query
+};
+
+/**
+ * A change to the result set of a query listener (see Firestore::ListenQuery)
+ */
+struct QueryChange
+{
+	QueryChangeType type;
+	const Document *document; // The new version of the document; the last known version when removed
+	DocumentHandle handle;    // The same document, to keep past the callback without copying it
+};
+
+typedef std::function<void(const std::vector<QueryChange> &changes)> QueryListenCallback;
+
+/**
+ * Tuning parameters for a Firestore instance
+ */
+struct FirestoreSettings
+{
+	/**
+	 * Number of threads polling the completion queues that drive
+	 * the asynchronous calls. Set to 0 to use one thread per hardware core.
+	 */
+	uint32_t num_poller_threads = 0;
+
+	/**
+	 * Number of channels (HTTP/2 connections) to the Firestore backend.
+	 * Every channel has its own stub, and calls are spread over the channels.
+	 */
+	uint32_t num_channels = 1;
+
+	/**
+	 * How to pick a channel for a new call
+	 */
+	enum ChannelSelection
+	{
+		ROUND_ROBIN,      // Cycle through the channels
+		LEAST_IN_FLIGHT   // Pick the channel with the fewest calls in flight
+	};
+	ChannelSelection channel_selection = ROUND_ROBIN;
+
+	/**
+	 * Maximum number of documents requested by a single BatchGetDocuments stream.
+	 * Larger requests made with Firestore::GetDocuments are split over several
+	 * concurrent streams.
+	 */
+	uint32_t max_documents_per_batch_get = 100;
+
+	/**
+	 * Byte budget of the in-memory document cache. Documents read or written
+	 * through the Firestore object are kept in the cache, as well as the paths
+	 * found to hold no document, until the least recently used ones are evicted.
+	 * Set to 0 to disable the cache.
+	 */
+	size_t document_cache_size = 0;
+
+	/**
+	 * Directory of the on-disk document store. The store keeps the same
+	 * documents as the in-memory cache, but without a byte budget and across
+	 * restarts, so a new Firestore object can serve cached reads right away.
+	 * The directory must exist, and must not be shared by two Firestore objects.
+	 * Leave empty to disable the store.
+	 */
+	std::string document_store_path;
+
+	/**
+	 * How long a path found to hold no document is assumed to stay empty.
+	 * Until then, reads of the path are answered from the cache without going
+	 * to the server, whatever the read mode, unless a write or a listener shows
+	 * that the document exists. Once it has passed, even READ_CACHE_FIRST reads
+	 * go back to the server. Needs the document cache or store; set to 0 to
+	 * only serve missing documents to READ_CACHE_FIRST and READ_CACHE_ONLY reads,
+	 * for as long as they stay cached.
+	 */
+	std::chrono::milliseconds missing_document_ttl = std::chrono::milliseconds(0);
+
+	/**
+	 * Longest time to wait before reopening a Listen stream that broke.
+	 * The wait starts at zero and doubles with every attempt that fails to reach the server.
+	 */
+	std::chrono::milliseconds max_listen_resume_delay = std::chrono::seconds(30);
+
+	/**
+	 * Deliver the changes seen by the listeners as consistent snapshots.
+	 * The changes are held back until the server marks a point in time at which
+	 * every target is in sync, then each listener with changes gets a single
+	 * callback: the latest version of its document, or every change to its
+	 * query result set. Bursts of writes then cause fewer callbacks, and never
+	 * show a state that did not exist on the server. Otherwise the listeners
+	 * are notified of every change as soon as it is received.
+	 */
+	bool consistent_listen_snapshots = false;
+
+	/**
+	 * Number of threads running the listener callbacks. The callbacks are handed
+	 * over through a bounded queue, so a slow callback does not hold up the listen
+	 * stream. Callbacks of the same listener still run one at a time, in order.
+	 * Set to 0 to run the callbacks on the poller threads, as they are received.
+	 */
+	uint32_t num_listen_callback_threads = 0;
+
+	/**
+	 * Maximum number of listener callbacks waiting for a callback thread
+	 */
+	size_t max_queued_listen_callbacks = 1024;
+
+	/**
+	 * What to do when a listener callback is queued while the queue is full.
+	 * Document listeners only ever miss versions that are superseded with
+	 * OVERFLOW_COALESCE_LATEST, and may miss any with OVERFLOW_DROP_OLDEST.
+	 * The changes to query result sets are never dropped, as the result sets
+	 * built from them would drift. Instead, the changes that are still queued
+	 * are merged with the new ones, so every query listener has one callback
+	 * queued at most, which delivers the latest result set. Unless the policy is
+	 * OVERFLOW_BLOCK, a full queue only holds up the stream if more query listeners
+	 * share a callback thread than its queue has room for.
+	 */
+	CallbackExecutor::OverflowPolicy listen_overflow_policy = CallbackExecutor::OVERFLOW_BLOCK;
+};
+
+/**
+ * Options for Firestore::Prefetch
+ */
+struct PrefetchOptions
+{
+	/**
+	 * Only prefetch the documents that pass this filter (optional)
+	 */
+	google::firestore::v1::StructuredQuery::Filter filter;
+
+	/**
+	 * Number of queries run in parallel, each over a range of document ids.
+	 * The ranges split the alphanumeric characters that automatic ids are made of,
+	 * so they hold about as many documents each for collections using those.
+	 * A filter with an inequality orders the results by its field, and is always
+	 * run as a single query.
+	 */
+	uint32_t num_partitions = 8;
+};
 
 /**
  * This file features a lightweight class that may be used to 
@@ -51,24 +245,33 @@ class Transaction;
 class FIRESTORE_EXPORT Firestore
 {
 	friend class Transaction;
+	friend class BulkWriter;
+	friend class WriteStream;
+	friend class QueryIterator;
+	friend class MutationQueue;
 public:
 	/**
 	 * Initializes a channel to communicate with a Firestore database
 	 *
 	 * \param project_id   Project ID of the Firestore database, find it on https://console.cloud.google.com
 	 * \param database_id  Should be set to "(default)", see https://stackoverflow.com/questions/48584648/how-to-find-the-database-id-of-a-cloud-firestore-project
+	 * \param settings     Tuning parameters (optional)
 	 */
-	Firestore(const std::string &project_id, const std::string &database_id);
+	Firestore(const std::string &project_id, const std::string &database_id, const FirestoreSettings &settings=FirestoreSettings());
 	~Firestore();
 
 	/**
 	 * Retrieves the document at path 'document_path' from the current Firestore database.
 	 *
+	 * Note: A document that is being watched with Listen is served from the copy
+	 *       the listen stream keeps up to date, without a round trip to the server.
+	 *
 	 * \param document_path The path of the document to update or insert
 	 * \param document_out  Output document object
+	 * \param read_mode     Whether to read from the document cache, if enabled (optional)
 	 * \returns             True on successful document retrieval
 	 */
-	bool GetDocument(const std::string &document_path, Document *document_out);
+	bool GetDocument(const std::string &document_path, Document *document_out, const ReadMode read_mode=READ_SERVER_FIRST);
 
 	/**
 	 * Updates or inserts a new document at path 'document_path' in the current Firestore database.
@@ -80,6 +283,136 @@ public:
 	 */
 	bool UpdateDocument(const std::string &document_path, const Document &new_document, Document *document_out=nullptr);
 
+	/**
+	 * Asynchronously retrieves the document at path 'document_path' from the current Firestore database.
+	 * The call returns immediately; the callback is invoked from one of the poller threads
+	 * once the server has responded.
+	 *
+	 * Note: When the request fails, the callback function will be called with
+	 *       success=false and document=nullptr.
+	 *
+	 * Note: When the document is served from the cache, the callback function
+	 *       is called before GetDocumentAsync returns.
+	 *
+	 * \param document_path The path of the document to retrieve
+	 * \param callback      Function to call with the retrieved document
+	 * \param read_mode     Whether to read from the document cache, if enabled (optional)
+	 */
+	void GetDocumentAsync(const std::string &document_path, const DocumentCallback &callback, const ReadMode read_mode=READ_SERVER_FIRST);
+
+	/**
+	 * Asynchronously retrieves the document at path 'document_path' from the current Firestore database.
+	 *
+	 * \param document_path The path of the document to retrieve
+	 * \param document_out  Output document object; must stay valid until the future is ready
+	 * \param read_mode     Whether to read from the document cache, if enabled (optional)
+	 * \returns             A future that becomes true on successful document retrieval
+	 */
+	std::future<bool> GetDocumentAsync(const std::string &document_path, Document *document_out, const ReadMode read_mode=READ_SERVER_FIRST);
+
+	/**
+	 * Asynchronously updates or inserts a new document at path 'document_path' in the current Firestore database.
+	 * The call returns immediately; the callback is invoked from one of the poller threads
+	 * once the server has responded.
+	 *
+	 * \param document_path The path of the document to update or insert
+	 * \param new_document  Document to update or insert
+	 * \param callback      Function to call with the updated document, as received from the database (optional)
+	 */
+	void UpdateDocumentAsync(const std::string &document_path, const Document &new_document, const DocumentCallback &callback=nullptr);
+
+	/**
+	 * Asynchronously updates or inserts a new document at path 'document_path' in the current Firestore database.
+	 *
+	 * \param document_path The path of the document to update or insert
+	 * \param new_document  Document to update or insert
+	 * \param document_out  Updated document object, as received from the database;
+	 *                      must stay valid until the future is ready (may be nullptr)
+	 * \returns             A future that becomes true on successful document update
+	 */
+	std::future<bool> UpdateDocumentAsync(const std::string &document_path, const Document &new_document, Document *document_out);
+
+	/**
+	 * Retrieves several documents from the current Firestore database in as few round trips as possible.
+	 * The callback is invoked for every document as soon as it arrives, in no particular order,
+	 * and never concurrently. The call blocks until every document has been received.
+	 *
+	 * Note: When a document does not exist, the callback function will be called with document=nullptr.
+	 *
+	 * \param document_paths The paths of the documents to retrieve
+	 * \param callback       Function to call with every retrieved document
+	 * \returns              True if every document was retrieved (found or missing)
+	 */
+	bool GetDocuments(const std::vector<std::string> &document_paths, const BatchGetCallback &callback);
+
+	/**
+	 * Retrieves several documents from the current Firestore database in as few round trips as possible.
+	 *
+	 * \param document_paths The paths of the documents to retrieve
+	 * \param documents_out  Output document objects, in the same order as 'document_paths'.
+	 *                       Documents that do not exist are left empty (with no name).
+	 * \returns              True if every document was retrieved (found or missing)
+	 */
+	bool GetDocuments(const std::vector<std::string> &document_paths, std::vector<Document> *documents_out);
+
+	/**
+	 * Runs a query in the current Firestore database.
+	 * Every document in the result set is handed to the callback as soon as it
+	 * arrives, on the calling thread, so the result set is never held in memory at once.
+	 * The call blocks until the last document has been received.
+	 *
+	 * Note: With the document cache enabled, the query can run over the cached
+	 *       documents instead (see LocalQuery). The documents in the result set
+	 *       of a query that runs on the server are added to the cache, unless the
+	 *       query selects only some of their fields.
+	 *
+	 * \param parent_path The path of the document that holds the queried collections
+	 *                    (empty for the root collections)
+	 * \param query       The query to run
+	 * \param callback    Function to call with every document in the result set
+	 * \param read_mode   Whether to run the query on the server or over the cache;
+	 *                    with READ_CACHE_FIRST, an empty result set in the cache goes to the server
+	 * \returns           True if the query ran to completion
+	 */
+	bool RunQuery(const std::string &parent_path, const StructuredQuery &query, const QueryCallback &callback, const ReadMode read_mode=READ_SERVER_FIRST);
+
+	/**
+	 * Loads the documents in the collection at 'collection_path' into the document cache
+	 * (and store), so that the first reads of them are served without a round trip.
+	 * The documents are streamed by several queries in parallel, and the call blocks
+	 * until all of them have been cached; call it before the application starts serving.
+	 *
+	 * \param collection_path    The path of the collection to prefetch
+	 * \param options            Filter and parallelism of the prefetch (optional)
+	 * \param num_documents_out  Receives the number of documents cached (optional)
+	 * \returns                  True if every query ran to completion
+	 */
+	bool Prefetch(const std::string &collection_path, const PrefetchOptions &options=PrefetchOptions(), size_t *num_documents_out=nullptr);
+
+	/**
+	 * Writes every document in the collection at 'collection_path' to a snapshot file
+	 * (see SnapshotFile), to be mounted with MountSnapshot. The documents are written
+	 * to disk one at a time as the query yields them, so only their index (24 bytes
+	 * per document) is held in memory, and the disk needs room for two copies of the
+	 * collection.
+	 *
+	 * \param collection_path The path of the collection to export
+	 * \param file_path       Path of the snapshot file to write
+	 * \returns               True if the whole collection was written
+	 */
+	bool ExportSnapshot(const std::string &collection_path, const std::string &file_path);
+
+	/**
+	 * Serves the documents in the snapshot file at 'file_path' from memory from now on.
+	 * GetDocument and GetDocumentAsync return the copy in the snapshot for every document
+	 * it holds, whatever the read mode, without going to the server. Snapshots are
+	 * read-only: writes to their documents are not reflected in them.
+	 *
+	 * \param file_path Path of a snapshot file written by ExportSnapshot
+	 * \returns         True if the snapshot was mounted
+	 */
+	bool MountSnapshot(const std::string &file_path);
+
 	/**
 	 * Start listening to changes in document at path 'document_path' in the current Firestore database.
 	 * Whenever a change is detected, the callback function provided will be called with
@@ -91,18 +424,74 @@ public:
 	 * Note: When a document is removed, or the requested document does not exists,
 	 *       the callback function will be called with document=nullptr.
 	 *
-	 * \param document_path The path of the document to update or insert
-	 * \param new_document  Document to update or insert
-	 * \returns             The ID for the newly created listener thread.
+	 * Note: All listeners share a single Listen stream; the callback is invoked
+	 *       from one of the poller threads, or from one of the listener callback
+	 *       threads (see FirestoreSettings::num_listen_callback_threads). Should the stream break, it is reopened
+	 *       and resumed from the last snapshot received, so that the server only
+	 *       sends the changes that were missed.
+	 *
+	 * Note: With a document store (see FirestoreSettings::document_store_path),
+	 *       the listeners left when the Firestore object is destroyed are saved,
+	 *       so that listening to the same documents again after a restart resumes
+	 *       from where they left off as well.
+	 *
+	 * \param document_path The path of the document to listen to
+	 * \param callback      Function to call with the updated document
+	 * \returns             The ID for the newly created listener.
 	 *                      This value will be negative on error.
 	 */
 	int32_t Listen(const std::string &document_path, const ListenCallback &callback);
 
+	/**
+	 * Start listening to changes in document at path 'document_path' in the current Firestore database,
+	 * the same way as Listen, but the callback receives a handle to the document rather than a pointer
+	 * that is only valid during the callback. The handle can be kept for as long as needed without
+	 * copying the document.
+	 *
+	 * Note: A handle keeps the whole response the document came in (at least 4KB);
+	 *       to keep a large number of documents for long, copy them instead.
+	 *
+	 * \param document_path The path of the document to listen to
+	 * \param callback      Function to call with the updated document; nullptr when it does not exist
+	 * \returns             The ID for the newly created listener; stop it with Unlisten.
+	 *                      This value will be negative on error.
+	 */
+	int32_t ListenShared(const std::string &document_path, const SharedListenCallback &callback);
+
+	/**
+	 * Start listening to the result set of a query in the current Firestore database.
+	 *
+	 * The result set is kept locally, and the callback function is invoked with what
+	 * changed in it: first with every matching document as added, once the server has
+	 * sent the initial result set, then with the documents that were added, modified or
+	 * removed since. Only the changed documents are sent over the stream.
+	 *
+	 * Example:
+	 *     firestore.ListenQuery("", query, [](const std::vector<QueryChange> &changes)
+	 *     {
+	 *         for(const QueryChange &change : changes) { ... }
+	 *     });
+	 *
+	 * Note: Query listeners share the Listen stream with the document listeners, and
+	 *       are resumed the same way should the stream break. They are not saved
+	 *       across restarts.
+	 *
+	 * \param parent_path The parent document of the collections to query; "" for the root
+	 * \param query       The query whose result set to listen to
+	 * \param callback    Function to call with the changes to the result set
+	 * \returns           The ID for the newly created listener; stop it with Unlisten.
+	 *                    This value will be negative on error.
+	 */
+	int32_t ListenQuery(const std::string &parent_path, const StructuredQuery &query, const QueryListenCallback &callback);
+
 	/**
 	 * Stop listening to changes in document at path 'document_path' in the current Firestore database.
-	 * Call this function with the ID of the listener thread; returned by Listen.
+	 * Call this function with the ID of the listener; returned by Listen.
 	 *
-	 * \param listen_id The ID of the listener thread; returned by Listen
+	 * The callback will not be invoked after Unlisten returns. If the callback is running
+	 * on another thread, Unlisten waits for it to return first.
+	 *
+	 * \param listen_id The ID of the listener; returned by Listen
 	 */
 	bool Unlisten(const int32_t listen_id);
 
@@ -137,46 +526,723 @@ public:
 	 */
 	std::string GetFullDocumentPath(const std::string &document_path) const;
 
+	/**
+	 * Returns the full path of a query parent:
+	 * projects/{project_id}/databases/{database_id}/documents[/{parent_path}]
+	 */
+	std::string GetFullParentPath(const std::string &parent_path) const;
+
+	/**
+	 * Returns the number of calls currently in flight on each channel
+	 * (see FirestoreSettings::num_channels). An open Listen stream
+	 * counts as one call on the channel it was started on.
+	 */
+	std::vector<int32_t> GetChannelInFlightCounts() const;
+
 private:
 	const std::string project_id;
 	const std::string database_id;
 	const std::string database_base_path;
 	bool do_grpc_shutdown;
 
-	std::unique_ptr<google::firestore::v1::Firestore::Stub> stub;
 	std::shared_ptr<grpc::ChannelCredentials> credentials;
-	std::shared_ptr<grpc::Channel> channel;
 
-	class ListenerThread
+	/**
+	 * A channel to the backend and the stub that issues calls on it
+	 */
+	struct PooledChannel
+	{
+		std::shared_ptr<grpc::Channel> channel;
+		std::unique_ptr<google::firestore::v1::Firestore::Stub> stub;
+		std::atomic<int32_t> in_flight;
+	};
+
+	/**
+	 * Counts a call as in flight on a pooled channel for as long as the lease lives
+	 */
+	class ChannelLease
 	{
-		friend class Firestore;
 	public:
-		ListenerThread(const Firestore &firestore,
-					   const std::string &document_path,
-					   const ListenCallback &callback);
+		ChannelLease(PooledChannel *channel) :
+			channel(channel)
+		{
+			channel->in_flight++;
+		}
+
+		~ChannelLease()
+		{
+			channel->in_flight--;
+		}
 
-		void StartListening();
-		void StopListening();
-		bool IsListening() const;
-		const void *const GetTag() const;
-		std::string GetDocumentPath() const;
+		google::firestore::v1::Firestore::Stub *Stub() const
+		{
+			return channel->stub.get();
+		}
 
 	private:
-		void ListenInternal() const;
+		ChannelLease(const ChannelLease&) = delete;
+		ChannelLease &operator=(const ChannelLease&) = delete;
 
-		static int32_t current_listener_thread_tag;
-		void *const tag;
+		PooledChannel *const channel;
+	};
+
+	PooledChannel *SelectChannel() const;
+
+	const FirestoreSettings::ChannelSelection channel_selection;
+	const uint32_t max_documents_per_batch_get;
+	std::vector<std::unique_ptr<PooledChannel>> channels;
+	mutable std::atomic<uint32_t> next_channel;
+
+	/**
+	 * Looks up a document in the cache.
+	 *
+	 * \param name          Full path of the document
+	 * \param document_out  Receives the document, if it exists
+	 * \param exists_out    Receives whether the document exists
+	 * \returns             True if the cache knows about the document; missing documents
+	 *                      are forgotten once missing_document_ttl (if set) has passed
+	 */
+	bool GetCachedDocument(const std::string &name, Document *document_out, bool *exists_out) const;
+
+	/**
+	 * Returns true if the cache knows the document to be missing,
+	 * and missing_document_ttl has not passed since
+	 */
+	bool IsKnownMissing(const std::string &name) const;
+
+	/**
+	 * Concurrent GetDocument and GetDocumentAsync calls for the same document share
+	 * a single RPC in flight. The first caller issues it and becomes the leader;
+	 * the callers that come along before it completes wait for its outcome.
+	 * A GetDocument call only waits for another GetDocument call, as a poller
+	 * thread blocked on an asynchronous read could end up waiting for itself.
+	 * A write to the document detaches its pending read, so that the reads
+	 * that come along after the write never get the version from before it.
+	 */
+	typedef std::function<void(const grpc::Status &status, const Document *document)> PendingReadCallback;
+	enum PendingReadRole
+	{
+		PENDING_READ_LEADER, // Issues the RPC, then calls CompletePendingRead
+		PENDING_READ_JOINED, // The callback is called with the outcome of the leader's RPC
+		PENDING_READ_ALONE   // Issues its own RPC
+	};
+	struct PendingRead
+	{
+		bool blocking; // Issued by GetDocument
+		std::vector<PendingReadCallback> blocking_callbacks; // Of the GetDocument calls
+		std::vector<PendingReadCallback> async_callbacks;    // Of the GetDocumentAsync calls; always run on a poller thread
+	};
+	PendingReadRole JoinPendingRead(const std::string &name, const bool blocking, const PendingReadCallback &callback,
+		std::shared_ptr<PendingRead> *pending_read_out);
+	void CompletePendingRead(const std::string &name, const std::shared_ptr<PendingRead> &pending_read,
+		const grpc::Status &status, const Document *document);
+	void ForgetPendingRead(const std::string &name) const;
+
+	/**
+	 * Settles a read that went to the server, falling back on the cache
+	 * if the server could not answer and the read mode allows it.
+	 *
+	 * \param name          Full path of the document
+	 * \param status        Status of the read; NOT_FOUND if the document is missing
+	 * \param read_mode     Read mode of the caller
+	 * \param document_out  Holds the document the server returned, if any;
+	 *                      receives the cached document otherwise
+	 * \returns             Whether the document exists
+	 */
+	bool ResolveRead(const std::string &name, const grpc::Status &status, const ReadMode read_mode, Document *document_out) const;
+
+	mutable std::mutex pending_reads_mutex; // Guards pending_reads
+	mutable std::unordered_map<std::string, std::shared_ptr<PendingRead>> pending_reads; // By full document path
+
+	/**
+	 * Looks up a document in the mounted snapshots
+	 */
+	bool GetSnapshotDocument(const std::string &name, Document *document_out) const;
+
+	/**
+	 * Runs a query over the documents in the cache.
+	 *
+	 * \returns False if the query is malformed
+	 */
+	bool RunCachedQuery(const std::string &parent_path, const StructuredQuery &query, std::vector<Document> *results_out) const;
+
+	/**
+	 * Stores the outcome of a read or write in the cache (if enabled)
+	 */
+	void CacheDocument(const Document &document) const;
+	void StoreCachedDocument(const Document &document) const; // Leaves the listen stream alone
+	void CacheMissingDocument(const std::string &name, const google::protobuf::Timestamp &read_time) const;
+
+	/**
+	 * Drops a document from the cache, for writes whose outcome is not known.
+	 * Also detaches the pending read of the document (see JoinPendingRead).
+	 */
+	void InvalidateCachedDocument(const std::string &name) const;
+
+	/**
+	 * Returns the full path of the document a write applies to,
+	 * or an empty string if the write has no operation
+	 */
+	static std::string GetWriteDocumentName(const google::firestore::v1::Write &write);
+
+	std::unique_ptr<DocumentCache> document_cache; // nullptr when disabled
+	std::unique_ptr<DocumentStore> document_store; // nullptr when disabled
+	const std::chrono::milliseconds missing_document_ttl;
+
+	mutable std::mutex snapshot_mutex; // Guards snapshots
+	std::vector<std::unique_ptr<SnapshotFile>> snapshots;
+
+	/**
+	 * An operation placed on one of the completion queues.
+	 * The poller thread that dequeues the operation calls Proceed,
+	 * after which the operation is deleted unless Proceed returns true.
+	 */
+	class AsyncCall
+	{
+	public:
+		virtual ~AsyncCall() {}
+		virtual bool Proceed(bool ok) = 0;
+	};
+
+	/**
+	 * A task run by one of the poller threads, as soon as one is free
+	 */
+	class PollerTask : public AsyncCall
+	{
+	public:
+		PollerTask(const std::function<void()> &task) :
+			task(task)
+		{
+		}
+
+		bool Proceed(bool) override
+		{
+			task(); // Even if cancelled, as whoever is waiting on the task has to hear back
+			return false;
+		}
+
+		grpc::Alarm alarm;
+
+	private:
+		const std::function<void()> task;
+	};
+	void RunOnPoller(const std::function<void()> &task) const;
+
+	/**
+	 * A unary RPC in flight; the response and status
+	 * are handed to 'on_finish' once the call completes.
+	 */
+	template<typename Response>
+	class AsyncUnaryCall : public AsyncCall
+	{
+	public:
+		typedef std::function<void(const grpc::Status &status, Response *response)> FinishCallback;
+
+		AsyncUnaryCall(const Firestore &firestore, const FinishCallback &on_finish) :
+			firestore(firestore),
+			lease(firestore.SelectChannel()),
+			on_finish(on_finish),
+			response(arena.Create<Response>())
+		{
+			firestore.RegisterCall(&client_context);
+		}
+
+		~AsyncUnaryCall()
+		{
+			firestore.UnregisterCall(&client_context);
+		}
+
+		google::firestore::v1::Firestore::Stub *Stub() const
+		{
+			return lease.Stub();
+		}
+
+		void Start(std::unique_ptr<grpc::ClientAsyncResponseReader<Response>> response_reader)
+		{
+			reader = std::move(response_reader);
+			reader->StartCall();
+			reader->Finish(response, &status, this);
+		}
+
+		bool Proceed(bool) override
+		{
+			on_finish(status, response);
+			return false;
+		}
+
+		grpc::ClientContext client_context;
+		MessageArena arena; // Holds the request and the response for the lifetime of the call
+
+	private:
+		const Firestore &firestore;
+		const ChannelLease lease;
+		std::unique_ptr<grpc::ClientAsyncResponseReader<Response>> reader;
+		const FinishCallback on_finish;
+		Response *response;
+		grpc::Status status;
+	};
+
+	/**
+	 * Starts a commit; 'on_finish' is called from a poller thread once it completes.
+	 * 'context_out' receives the context of the call, to cancel it with; it stays
+	 * valid until 'on_finish' returns (optional).
+	 */
+	void CommitAsync(const google::firestore::v1::CommitRequest &request, const AsyncUnaryCall<google::firestore::v1::CommitResponse>::FinishCallback &on_finish,
+		grpc::ClientContext **context_out=nullptr);
+
+	/**
+	 * A server-streaming RPC in flight; every response is handed to 'on_read'
+	 * as it arrives, and the final status to 'on_finish'.
+	 */
+	template<typename Response>
+	class AsyncReaderCall : public AsyncCall
+	{
+	public:
+		typedef std::function<void(Response *response)> ReadCallback;
+		typedef std::function<void(const grpc::Status &status)> FinishCallback;
+
+		AsyncReaderCall(const Firestore &firestore, const ReadCallback &on_read, const FinishCallback &on_finish) :
+			firestore(firestore),
+			lease(firestore.SelectChannel()),
+			on_read(on_read),
+			on_finish(on_finish),
+			response(arena.Create<Response>()),
+			state(STARTING)
+		{
+			firestore.RegisterCall(&client_context);
+		}
+
+		~AsyncReaderCall()
+		{
+			firestore.UnregisterCall(&client_context);
+		}
+
+		google::firestore::v1::Firestore::Stub *Stub() const
+		{
+			return lease.Stub();
+		}
+
+		void Start(std::unique_ptr<grpc::ClientAsyncReader<Response>> response_reader)
+		{
+			reader = std::move(response_reader);
+			reader->StartCall(this);
+		}
+
+		bool Proceed(bool ok) override
+		{
+			switch(state)
+			{
+				case STARTING:
+				case READING:
+					if(ok)
+					{
+						if(state == READING)
+						{
+							// Every response gets a fresh arena
+							on_read(response);
+							arena.Reset();
+							response = arena.Create<Response>();
+						}
+						state = READING;
+						reader->Read(response, this);
+					}
+					else
+					{
+						// No more responses; retrieve the final status
+						state = FINISHING;
+						reader->Finish(&status, this);
+					}
+					return true;
+
+				case FINISHING:
+					on_finish(status);
+					break;
+			}
+			return false;
+		}
+
+		grpc::ClientContext client_context;
+
+	private:
+		enum State
+		{
+			STARTING,
+			READING,
+			FINISHING
+		};
 
 		const Firestore &firestore;
-		const std::string document_path;
-		const ListenCallback callback;
+		const ChannelLease lease;
+		std::unique_ptr<grpc::ClientAsyncReader<Response>> reader;
+		const ReadCallback on_read;
+		const FinishCallback on_finish;
+		MessageArena arena;
+		Response *response;
+		grpc::Status status;
+		State state;
+	};
+
+	/**
+	 * Keeps track of the contexts of the asynchronous calls in flight,
+	 * so that they can all be cancelled when the Firestore object is destroyed
+	 */
+	void RegisterCall(grpc::ClientContext *client_context) const;
+	void UnregisterCall(grpc::ClientContext *client_context) const;
+	void CancelCalls();
+
+	mutable std::mutex active_calls_mutex;
+	mutable std::set<grpc::ClientContext*> active_calls;
+	bool cancelling_calls;
+
+	grpc::CompletionQueue *GetCompletionQueue() const;
+	static void PollCompletionQueue(grpc::CompletionQueue *cq);
+
+	std::vector<std::unique_ptr<grpc::CompletionQueue>> completion_queues;
+	std::vector<std::thread> poller_threads;
+	mutable std::atomic<uint32_t> next_completion_queue;
+
+	/**
+	 * A bi-directional Listen stream shared by all listeners.
+	 * Every Listen call adds a target with a client-assigned target id
+	 * to the stream, and the responses from the server are routed
+	 * to the listeners by the target ids they carry.
+	 */
+	class ListenStream
+	{
+	public:
+		ListenStream(Firestore &firestore);
+		~ListenStream();
 
-		std::thread thread;
+		void Start();
+		void Stop();
+		bool IsActive() const;
+		bool IsFinished();
+		bool IsEmpty();
+
+		/**
+		 * Adds a listener for a document.
+		 *
+		 * \param target_id      Id of the listener
+		 * \param document_path  The path of the document to listen to
+		 * \param callback       Function to call with the updated document
+		 * \param resume_target  Target saved by an earlier listener of the document, to resume from (optional)
+		 * \param document       The document as of the resume target; passed to the callback once
+		 *                       the target is current, unless the server sends a newer version
+		 */
+		void AddTarget(const int32_t target_id, const std::string &document_path, const SharedListenCallback &callback,
+			const ::firestore::client::Target *resume_target=nullptr, const Document *document=nullptr);
+		bool RemoveTarget(const int32_t target_id);
+
+		/**
+		 * Adds a listener for the result set of a query.
+		 *
+		 * \param target_id   Id of the listener
+		 * \param parent_name Full path of the parent document of the collections to query
+		 * \param query       The query to listen to
+		 * \param callback    Function to call with the changes to the result set
+		 */
+		void AddQueryTarget(const int32_t target_id, const std::string &parent_name, const StructuredQuery &query,
+			const QueryListenCallback &callback);
+
+		/**
+		 * Moves the listeners of a stream that broke over to this one,
+		 * resuming every target from the last snapshot it received
+		 */
+		void AdoptListeners(ListenStream &stream);
+
+		/**
+		 * Returns the targets of the listeners that can be resumed
+		 */
+		std::vector<::firestore::client::Target> GetResumableTargets();
+
+		/**
+		 * Returns true once the server has sent a response on the stream
+		 */
+		bool IsConnected() const;
+
+		/**
+		 * Looks up a document watched by a target that is in sync with the server.
+		 *
+		 * \param name          Full path of the document
+		 * \param document_out  Receives the document, if it exists
+		 * \param exists_out    Receives whether the document exists
+		 * \returns             True if the stream has an up-to-date copy of the document
+		 */
+		bool GetWatchedDocument(const std::string &name, Document *document_out, bool *exists_out);
+
+		/**
+		 * Updates the copy of a watched document with a newer version read or written outside of the stream
+		 */
+		void ApplyDocument(const Document &document);
+
+	private:
+		// Changes to a query result set handed over to the callback executor, but not delivered yet.
+		// Later changes are merged into them, so a query listener has one callback queued at most.
+		struct QueryDelivery
+		{
+			std::mutex mutex; // Guards everything below
+			std::map<std::string, QueryChange> changes; // By full path
+			bool queued = false; // Whether a callback is queued to deliver the changes
+			bool delivered = false; // Whether the initial result set was delivered
+		};
+
+		struct Listener
+		{
+			std::string document_path;
+			std::string document_name; // Full path
+			SharedListenCallback callback;
+			bool notified = false; // Whether the callback was invoked since the target was added
+			bool current = false;  // Whether the server has sent every change to the document so far
+			::firestore::client::Target target; // Where to resume from
+
+			// Query listeners only
+			QueryListenCallback query_callback;
+			std::map<std::string, DocumentHandle> results; // The result set as last delivered, by full path; copies of the documents
+			std::map<std::string, DocumentHandle> pending_changes; // Not delivered yet; nullptr if removed
+			bool reset = false; // Whether the server is resending the result set from scratch
+
+			std::shared_ptr<QueryDelivery> delivery; // Changes on their way to the listener callback thread
+
+			int pending_responses = 0; // Target changes still to come for a resync; until then responses for the target are stale
+
+			std::shared_ptr<std::atomic<bool>> active; // Cleared once the listener is removed, for the callbacks still queued
+		};
+
+		// The latest version of a watched document
+		struct WatchedDocument
+		{
+			std::set<int32_t> target_ids; // The targets watching the document
+			bool exists = false;
+			Document document;
+		};
+
+		// A response and the arena it lives in, shared with the document handles given to the listeners
+		struct SharedResponse
+		{
+			MessageArena arena;
+			google::firestore::v1::ListenResponse *response;
+		};
+
+		// Tags of the operations on the stream
+		enum Operation
+		{
+			OPERATION_START = 1,
+			OPERATION_READ,
+			OPERATION_WRITE,
+			OPERATION_FINISH
+		};
+
+		// Forwards the completion of an operation to the stream.
+		// The tags are owned by the stream, so the poller threads never delete them.
+		class OperationTag : public AsyncCall
+		{
+		public:
+			OperationTag(ListenStream *stream, const Operation operation) :
+				stream(stream),
+				operation(operation)
+			{
+			}
+
+			bool Proceed(bool ok) override
+			{
+				stream->Proceed(operation, ok);
+				return true;
+			}
+
+		private:
+			ListenStream *const stream;
+			const Operation operation;
+		};
+
+		void Proceed(const Operation operation, bool ok);
+		bool ProcessResponse(const std::shared_ptr<const google::firestore::v1::ListenResponse> &shared_response);
+		void Notify(const int32_t target_id, const DocumentHandle &document);
+		void NotifyQuery(const int32_t target_id);
+		static void MergeQueryChange(std::map<std::string, QueryChange> *changes, const QueryChange &change);
+		void NotifyDocument(const int32_t target_id);
+		void NotifyPending(const int32_t target_id);
+		void DeliverSnapshot();
+		void HandleDocumentChange(const int32_t target_id, const std::string &name, const DocumentHandle &document);
+		void BeginCallback(const int32_t target_id);
+		void EndCallback();
+		void CheckExistenceFilter(const int32_t target_id, const int32_t count);
+		void QueueResyncTarget(Listener &listener);
+		void AcknowledgeTarget(const int32_t target_id);
+		void UpdateWatchedDocument(const std::string &name, const Document *document);
+		void UnwatchDocument(const std::string &name, const int32_t target_id);
+		bool EraseListener(const int32_t target_id);
+		void RecordResumeToken(const google::firestore::v1::TargetChange &change);
+		void QueueAddTarget(const ::firestore::client::Target &target);
+		void QueueRequest(const google::firestore::v1::ListenRequest &request);
+		void WriteNextRequest();
+		void PrepareReply();
+
+		Firestore &firestore;
+		const ChannelLease channel;
+
+		grpc::ClientContext client_context;
+		std::unique_ptr<grpc::ClientAsyncReaderWriter<google::firestore::v1::ListenRequest, google::firestore::v1::ListenResponse>> rpc;
+		std::shared_ptr<SharedResponse> reply; // Reused for the next response, unless a listener kept a document of it
+		grpc::Status status;
+
+		OperationTag start_tag;
+		OperationTag read_tag;
+		OperationTag write_tag;
+		OperationTag finish_tag;
+
+		std::mutex mutex; // Guards everything below
+		std::condition_variable finished_condition;
+		std::map<int32_t, Listener> listeners;
+		std::map<std::string, WatchedDocument> watched_documents; // By full path
+		std::deque<google::firestore::v1::ListenRequest> pending_requests;
+		bool stream_ready;
+		bool write_in_flight;
+		bool finished;
+
+		// The listener whose callback is currently running, if any
+		int32_t notifying_target_id;
+		std::thread::id notifying_thread_id;
 
 		std::atomic<bool> listening;
+		std::atomic<bool> connected;
 	};
-	friend class ListenerThread;
-	std::map<int32_t, std::shared_ptr<ListenerThread>> listener_threads;
+
+	/**
+	 * Fires once it is time to reopen a Listen stream that broke
+	 */
+	class ListenResumeAlarm : public AsyncCall
+	{
+	public:
+		ListenResumeAlarm(Firestore &firestore) :
+			firestore(firestore)
+		{
+		}
+
+		bool Proceed(bool ok) override
+		{
+			firestore.ResumeListenStream(ok);
+			return false;
+		}
+
+		grpc::Alarm alarm;
+
+	private:
+		Firestore &firestore;
+	};
+	friend class ListenStream;
+	std::shared_ptr<ListenStream> listen_stream;
+	std::list<std::shared_ptr<ListenStream>> retired_listen_streams; // Stopped, waiting for the pollers to let go
+	int32_t next_listen_id;
+	mutable std::mutex listen_stream_mutex; // Guards the listen stream members
+
+	/**
+	 * Replaces the listen stream by a new one that takes over its listeners
+	 */
+	void ReplaceListenStream();
+
+	/**
+	 * Makes sure the listen stream is running, so that a target can be added to it.
+	 * Called with listen_stream_mutex held.
+	 */
+	void OpenListenStream();
+
+	/**
+	 * Adds a listener for a document to the listen stream, resuming it from
+	 * a listener of the previous run if possible (see Listen and ListenShared)
+	 */
+	int32_t AddDocumentListener(const std::string &document_path, const SharedListenCallback &callback);
+
+	/**
+	 * Called by a listen stream that finished; reopens the stream after
+	 * a delay if it still has listeners
+	 */
+	void OnListenStreamFinished(const ListenStream *stream);
+	void ResumeListenStream(const bool ok);
+
+	/**
+	 * Saves or loads the targets of the listeners, to resume them after a restart
+	 */
+	void SaveListenTargets();
+	void LoadListenTargets();
+
+	ListenResumeAlarm *listen_resume_alarm; // Owned by the poller threads; nullptr unless a resume is scheduled
+	uint32_t listen_resume_attempts; // Since the server was last reached
+	const std::chrono::milliseconds max_listen_resume_delay;
+	const bool consistent_listen_snapshots;
+	std::unique_ptr<CallbackExecutor> listen_executor; // Runs the listener callbacks; nullptr to run them on the pollers
+	bool shutting_down;
+	std::string listen_targets_path; // Empty without a document store
+	std::map<std::string, ::firestore::client::Target> saved_listen_targets; // By full document path
+
+	/**
+	 * Looks up a document that is kept up to date by the listen stream (see ListenStream::GetWatchedDocument)
+	 */
+	bool GetWatchedDocument(const std::string &name, Document *document_out, bool *exists_out) const;
+};
+
+/**
+ * This class runs a query and steps through its result set one document at a time.
+ * Documents are read from the network as the iterator advances, so only the current
+ * document is held in memory.
+ *
+ * Usage:
+ *   QueryIterator itr(firestore, "", query);
+ *   while(itr.Next())
+ *   {
+ *       const Document &document = itr.GetDocument();
+ *   }
+ *   bool success = itr.Succeeded();
+ *
+ * The Firestore object must outlive the QueryIterator.
+ */
+class FIRESTORE_EXPORT QueryIterator
+{
+public:
+	/**
+	 * Starts running a query in the Firestore database.
+	 *
+	 * \param firestore   The database to query
+	 * \param parent_path The path of the document that holds the queried collections
+	 *                    (empty for the root collections)
+	 * \param query       The query to run
+	 */
+	QueryIterator(const Firestore &firestore, const std::string &parent_path, const StructuredQuery &query);
+
+	/**
+	 * Cancels the query if the iterator did not reach the end of the result set
+	 */
+	~QueryIterator();
+
+	/**
+	 * Advances to the next document in the result set.
+	 *
+	 * \returns False once the end of the result set is reached, or on error
+	 */
+	bool Next();
+
+	/**
+	 * Returns the current document; only valid after Next has returned true
+	 */
+	const Document &GetDocument() const;
+
+	/**
+	 * Returns true if the query ran to completion; only valid after Next has returned false
+	 */
+	bool Succeeded() const;
+
+	/**
+	 * Returns the status the server ended the query with; only valid after Next has returned false
+	 */
+	const grpc::Status &GetStatus() const;
+
+private:
+	const Firestore::ChannelLease channel;
+	grpc::ClientContext client_context;
+	std::unique_ptr<grpc::ClientReader<google::firestore::v1::RunQueryResponse>> reader;
+	MessageArena arena; // Reset before every response
+	google::firestore::v1::RunQueryResponse *response;
+	bool finished;
+	grpc::Status status;
 };
 
 /**
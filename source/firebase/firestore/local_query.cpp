@@ -0,0 +1,674 @@
+#include "local_query.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+namespace firebase {
+namespace firestore {
+
+typedef google::firestore::v1::Value Value;
+typedef google::firestore::v1::Document Document;
+typedef google::firestore::v1::StructuredQuery StructuredQuery;
+
+template<typename T>
+static int Compare(const T &left, const T &right)
+{
+	return left < right ? -1 : (right < left ? 1 : 0);
+}
+
+static int Sign(const int value)
+{
+	return value < 0 ? -1 : (value > 0 ? 1 : 0);
+}
+
+static int TypeOrder(const Value &value)
+{
+	switch(value.value_type_case())
+	{
+		case Value::kBooleanValue: return 1;
+		case Value::kIntegerValue:
+		case Value::kDoubleValue: return 2;
+		case Value::kTimestampValue: return 3;
+		case Value::kStringValue: return 4;
+		case Value::kBytesValue: return 5;
+		case Value::kReferenceValue: return 6;
+		case Value::kGeoPointValue: return 7;
+		case Value::kArrayValue: return 8;
+		case Value::kMapValue: return 9;
+		default: return 0; // Null
+	}
+}
+
+static bool IsNaN(const Value &value)
+{
+	return value.value_type_case() == Value::kDoubleValue && std::isnan(value.double_value());
+}
+
+static int CompareDoubles(const double left, const double right)
+{
+	// NaN sorts before every other number, and together with itself
+	if(std::isnan(left))
+	{
+		return std::isnan(right) ? 0 : -1;
+	}
+	if(std::isnan(right))
+	{
+		return 1;
+	}
+	return Compare(left, right);
+}
+
+static int CompareIntegerToDouble(const int64_t left, const double right)
+{
+	if(std::isnan(right))
+	{
+		return 1;
+	}
+
+	// Converting either number to the type of the other could round it,
+	// so compare the integer parts first and then the fraction
+	if(right >= 9223372036854775808.0)
+	{
+		return -1;
+	}
+	if(right < -9223372036854775808.0)
+	{
+		return 1;
+	}
+	const int64_t integer_part = (int64_t)right;
+	if(left != integer_part)
+	{
+		return Compare(left, integer_part);
+	}
+	return Compare(0.0, right - (double)integer_part);
+}
+
+static int CompareNumbers(const Value &left, const Value &right)
+{
+	const bool left_integer = left.value_type_case() == Value::kIntegerValue;
+	const bool right_integer = right.value_type_case() == Value::kIntegerValue;
+	if(left_integer && right_integer)
+	{
+		return Compare(left.integer_value(), right.integer_value());
+	}
+	if(left_integer)
+	{
+		return CompareIntegerToDouble(left.integer_value(), right.double_value());
+	}
+	if(right_integer)
+	{
+		return -CompareIntegerToDouble(right.integer_value(), left.double_value());
+	}
+	return CompareDoubles(left.double_value(), right.double_value());
+}
+
+static int CompareReferences(const std::string &left, const std::string &right)
+{
+	size_t left_begin = 0;
+	size_t right_begin = 0;
+	while(true)
+	{
+		const size_t left_end = std::min(left.find('/', left_begin), left.size());
+		const size_t right_end = std::min(right.find('/', right_begin), right.size());
+		const int comparison = left.compare(left_begin, left_end - left_begin, right, right_begin, right_end - right_begin);
+		if(comparison != 0)
+		{
+			return Sign(comparison);
+		}
+
+		// A path sorts before the paths it is a prefix of
+		const bool left_done = left_end == left.size();
+		const bool right_done = right_end == right.size();
+		if(left_done || right_done)
+		{
+			return Compare(!left_done, !right_done);
+		}
+		left_begin = left_end + 1;
+		right_begin = right_end + 1;
+	}
+}
+
+static int CompareArrays(const google::firestore::v1::ArrayValue &left, const google::firestore::v1::ArrayValue &right)
+{
+	const int size = std::min(left.values_size(), right.values_size());
+	for(int i = 0; i < size; i++)
+	{
+		const int comparison = CompareValues(left.values(i), right.values(i));
+		if(comparison != 0)
+		{
+			return comparison;
+		}
+	}
+	return Compare(left.values_size(), right.values_size());
+}
+
+static int CompareMaps(const google::firestore::v1::MapValue &left, const google::firestore::v1::MapValue &right)
+{
+	// Protobuf maps are unordered
+	typedef const google::protobuf::MapPair<std::string, Value> *Entry;
+	auto sorted_entries = [](const google::protobuf::Map<std::string, Value> &fields)
+	{
+		std::vector<Entry> entries;
+		entries.reserve(fields.size());
+		for(const auto &entry : fields)
+		{
+			entries.push_back(&entry);
+		}
+		std::sort(entries.begin(), entries.end(), [](Entry a, Entry b) { return a->first < b->first; });
+		return entries;
+	};
+	const std::vector<Entry> left_entries = sorted_entries(left.fields());
+	const std::vector<Entry> right_entries = sorted_entries(right.fields());
+
+	const size_t size = std::min(left_entries.size(), right_entries.size());
+	for(size_t i = 0; i < size; i++)
+	{
+		int comparison = Sign(left_entries[i]->first.compare(right_entries[i]->first));
+		if(comparison == 0)
+		{
+			comparison = CompareValues(left_entries[i]->second, right_entries[i]->second);
+		}
+		if(comparison != 0)
+		{
+			return comparison;
+		}
+	}
+	return Compare(left_entries.size(), right_entries.size());
+}
+
+int CompareValues(const Value &left, const Value &right)
+{
+	const int left_type = TypeOrder(left);
+	const int right_type = TypeOrder(right);
+	if(left_type != right_type)
+	{
+		return Compare(left_type, right_type);
+	}
+
+	switch(left.value_type_case())
+	{
+		case Value::kBooleanValue:
+			return Compare(left.boolean_value(), right.boolean_value());
+		case Value::kIntegerValue:
+		case Value::kDoubleValue:
+			return CompareNumbers(left, right);
+		case Value::kTimestampValue:
+		{
+			const int comparison = Compare(left.timestamp_value().seconds(), right.timestamp_value().seconds());
+			return comparison != 0 ? comparison : Compare(left.timestamp_value().nanos(), right.timestamp_value().nanos());
+		}
+		case Value::kStringValue:
+			return Sign(left.string_value().compare(right.string_value()));
+		case Value::kBytesValue:
+			return Sign(left.bytes_value().compare(right.bytes_value()));
+		case Value::kReferenceValue:
+			return CompareReferences(left.reference_value(), right.reference_value());
+		case Value::kGeoPointValue:
+		{
+			const int comparison = CompareDoubles(left.geo_point_value().latitude(), right.geo_point_value().latitude());
+			return comparison != 0 ? comparison : CompareDoubles(left.geo_point_value().longitude(), right.geo_point_value().longitude());
+		}
+		case Value::kArrayValue:
+			return CompareArrays(left.array_value(), right.array_value());
+		case Value::kMapValue:
+			return CompareMaps(left.map_value(), right.map_value());
+		default:
+			return 0; // Both null
+	}
+}
+
+static bool ValuesEqual(const Value &left, const Value &right)
+{
+	return !IsNaN(left) && !IsNaN(right) && CompareValues(left, right) == 0;
+}
+
+static bool IsInequality(const int op)
+{
+	return op == StructuredQuery::FieldFilter::LESS_THAN ||
+		op == StructuredQuery::FieldFilter::LESS_THAN_OR_EQUAL ||
+		op == StructuredQuery::FieldFilter::GREATER_THAN ||
+		op == StructuredQuery::FieldFilter::GREATER_THAN_OR_EQUAL;
+}
+
+LocalQuery::LocalQuery(const std::string &parent_name, const StructuredQuery &query) :
+	parent_name(parent_name),
+	query(query),
+	valid(true)
+{
+	if(query.has_where())
+	{
+		valid = AddFilter(query.where());
+	}
+
+	bool ordered_by_name = false;
+	for(const StructuredQuery::Order &order : query.order_by())
+	{
+		Ordering ordering;
+		valid = ParseFieldPath(order.field().field_path(), &ordering.field) && valid;
+		ordering.descending = order.direction() == StructuredQuery::DESCENDING;
+		ordered_by_name = ordered_by_name || ordering.field.is_name;
+		orderings.push_back(std::move(ordering));
+	}
+
+	// Without an explicit ordering, the results are ordered by the field of the inequality filter
+	if(orderings.empty())
+	{
+		for(const Filter &filter : filters)
+		{
+			if(!filter.unary && IsInequality(filter.op))
+			{
+				Ordering ordering;
+				ordering.field = filter.field;
+				ordering.descending = false;
+				ordered_by_name = ordering.field.is_name;
+				orderings.push_back(std::move(ordering));
+				break;
+			}
+		}
+	}
+
+	// The document name breaks ties
+	if(!ordered_by_name)
+	{
+		Ordering ordering;
+		ordering.field.is_name = true;
+		ordering.descending = !orderings.empty() && orderings.back().descending;
+		orderings.push_back(std::move(ordering));
+	}
+
+	if(query.has_select())
+	{
+		for(const StructuredQuery::FieldReference &field : query.select().fields())
+		{
+			FieldPath path;
+			valid = ParseFieldPath(field.field_path(), &path) && valid;
+			projection.push_back(std::move(path));
+		}
+	}
+
+	if(!valid)
+	{
+		std::cerr << "LocalQuery::LocalQuery(): Query has a malformed field path" << std::endl;
+	}
+}
+
+bool LocalQuery::IsValid() const
+{
+	return valid;
+}
+
+bool LocalQuery::Matches(const Document &document) const
+{
+	if(!IsInQueriedCollection(document.name()))
+	{
+		return false;
+	}
+	for(const Filter &filter : filters)
+	{
+		if(!MatchesFilter(filter, document))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool LocalQuery::Run(const std::vector<Document> &documents, std::vector<Document> *results_out) const
+{
+	if(!valid)
+	{
+		return false;
+	}
+
+	std::vector<const Document*> matches;
+	for(const Document &document : documents)
+	{
+		if(!Matches(document) || !HasOrderingFields(document))
+		{
+			continue;
+		}
+		if(query.has_start_at() && !SortsBeforeDocument(query.start_at(), document))
+		{
+			continue;
+		}
+		if(query.has_end_at() && SortsBeforeDocument(query.end_at(), document))
+		{
+			continue;
+		}
+		matches.push_back(&document);
+	}
+	std::sort(matches.begin(), matches.end(), [this](const Document *left, const Document *right)
+	{
+		return CompareDocuments(*left, *right) < 0;
+	});
+
+	// The offset and limit apply after the cursors
+	const size_t begin = std::min((size_t)std::max(query.offset(), 0), matches.size());
+	size_t end = matches.size();
+	if(query.has_limit())
+	{
+		end = std::min(end, begin + (size_t)std::max(query.limit().value(), 0));
+	}
+
+	results_out->clear();
+	results_out->reserve(end - begin);
+	for(size_t i = begin; i < end; i++)
+	{
+		results_out->push_back(Project(*matches[i]));
+	}
+	return true;
+}
+
+bool LocalQuery::AddFilter(const StructuredQuery::Filter &filter)
+{
+	switch(filter.filter_type_case())
+	{
+		case StructuredQuery::Filter::kCompositeFilter:
+		{
+			for(const StructuredQuery::Filter &child : filter.composite_filter().filters())
+			{
+				if(!AddFilter(child))
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+		case StructuredQuery::Filter::kFieldFilter:
+		{
+			Filter field_filter;
+			field_filter.unary = false;
+			field_filter.op = filter.field_filter().op();
+			field_filter.value = filter.field_filter().value();
+			if(!ParseFieldPath(filter.field_filter().field().field_path(), &field_filter.field))
+			{
+				return false;
+			}
+			filters.push_back(std::move(field_filter));
+			return true;
+		}
+		case StructuredQuery::Filter::kUnaryFilter:
+		{
+			Filter unary_filter;
+			unary_filter.unary = true;
+			unary_filter.op = filter.unary_filter().op();
+			if(!ParseFieldPath(filter.unary_filter().field().field_path(), &unary_filter.field))
+			{
+				return false;
+			}
+			filters.push_back(std::move(unary_filter));
+			return true;
+		}
+		default:
+			return true;
+	}
+}
+
+bool LocalQuery::ParseFieldPath(const std::string &field_path, FieldPath *field_out) const
+{
+	field_out->segments.clear();
+	field_out->is_name = field_path == "__name__";
+	if(field_out->is_name)
+	{
+		return true;
+	}
+
+	// Segments are separated by dots; segments in backticks may hold any character,
+	// with backticks and backslashes escaped by a backslash
+	std::string segment;
+	bool quoted = false;
+	bool segment_quoted = false;
+	for(size_t i = 0; i < field_path.size(); i++)
+	{
+		const char c = field_path[i];
+		if(quoted)
+		{
+			if(c == '\\')
+			{
+				if(++i == field_path.size())
+				{
+					return false;
+				}
+				segment += field_path[i];
+			}
+			else if(c == '`')
+			{
+				quoted = false;
+			}
+			else
+			{
+				segment += c;
+			}
+		}
+		else if(c == '`')
+		{
+			quoted = true;
+			segment_quoted = true;
+		}
+		else if(c == '.')
+		{
+			if(segment.empty() && !segment_quoted)
+			{
+				return false;
+			}
+			field_out->segments.push_back(std::move(segment));
+			segment.clear();
+			segment_quoted = false;
+		}
+		else
+		{
+			segment += c;
+		}
+	}
+	if(quoted || (segment.empty() && !segment_quoted))
+	{
+		return false;
+	}
+	field_out->segments.push_back(std::move(segment));
+	return true;
+}
+
+bool LocalQuery::IsInQueriedCollection(const std::string &name) const
+{
+	// Document names look like <parent_name>/<collection>/<document>[/<collection>/<document>...]
+	if(name.size() <= parent_name.size() + 1 ||
+		name.compare(0, parent_name.size(), parent_name) != 0 ||
+		name[parent_name.size()] != '/')
+	{
+		return false;
+	}
+	const size_t document_separator = name.rfind('/');
+	if(document_separator <= parent_name.size())
+	{
+		return false;
+	}
+	const size_t collection_separator = name.rfind('/', document_separator - 1);
+	const std::string collection_id = name.substr(collection_separator + 1, document_separator - collection_separator - 1);
+	const bool direct_child = collection_separator == parent_name.size();
+
+	for(const StructuredQuery::CollectionSelector &selector : query.from())
+	{
+		if(selector.collection_id() == collection_id && (direct_child || selector.all_descendants()))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+bool LocalQuery::MatchesFilter(const Filter &filter, const Document &document) const
+{
+	Value name_value;
+	const Value *value = GetField(document, filter.field, &name_value);
+	if(value == nullptr)
+	{
+		return false;
+	}
+
+	if(filter.unary)
+	{
+		switch(filter.op)
+		{
+			case StructuredQuery::UnaryFilter::IS_NAN: return IsNaN(*value);
+			case StructuredQuery::UnaryFilter::IS_NULL: return value->value_type_case() == Value::kNullValue;
+			default: return false;
+		}
+	}
+
+	switch(filter.op)
+	{
+		case StructuredQuery::FieldFilter::EQUAL:
+			return ValuesEqual(*value, filter.value);
+		case StructuredQuery::FieldFilter::ARRAY_CONTAINS:
+		{
+			if(value->value_type_case() != Value::kArrayValue)
+			{
+				return false;
+			}
+			for(const Value &element : value->array_value().values())
+			{
+				if(ValuesEqual(element, filter.value))
+				{
+					return true;
+				}
+			}
+			return false;
+		}
+		default:
+			break;
+	}
+
+	// Inequalities don't match across types
+	if(!IsInequality(filter.op) || TypeOrder(*value) != TypeOrder(filter.value))
+	{
+		return false;
+	}
+	const int comparison = CompareValues(*value, filter.value);
+	switch(filter.op)
+	{
+		case StructuredQuery::FieldFilter::LESS_THAN: return comparison < 0;
+		case StructuredQuery::FieldFilter::LESS_THAN_OR_EQUAL: return comparison <= 0;
+		case StructuredQuery::FieldFilter::GREATER_THAN: return comparison > 0;
+		default: return comparison >= 0;
+	}
+}
+
+bool LocalQuery::HasOrderingFields(const Document &document) const
+{
+	Value name_value;
+	for(const Ordering &ordering : orderings)
+	{
+		if(GetField(document, ordering.field, &name_value) == nullptr)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+int LocalQuery::CompareDocuments(const Document &left, const Document &right) const
+{
+	Value left_name;
+	Value right_name;
+	for(const Ordering &ordering : orderings)
+	{
+		const int comparison = CompareValues(*GetField(left, ordering.field, &left_name), *GetField(right, ordering.field, &right_name));
+		if(comparison != 0)
+		{
+			return ordering.descending ? -comparison : comparison;
+		}
+	}
+	return 0;
+}
+
+bool LocalQuery::SortsBeforeDocument(const google::firestore::v1::Cursor &cursor, const Document &document) const
+{
+	// The cursor holds a position in the orderings, possibly a partial one
+	Value name_value;
+	int comparison = 0;
+	for(int i = 0; i < cursor.values_size() && i < (int)orderings.size(); i++)
+	{
+		const Ordering &ordering = orderings[i];
+		comparison = CompareValues(cursor.values(i), *GetField(document, ordering.field, &name_value));
+		if(ordering.descending)
+		{
+			comparison = -comparison;
+		}
+		if(comparison != 0)
+		{
+			break;
+		}
+	}
+	return cursor.before() ? comparison <= 0 : comparison < 0;
+}
+
+Document LocalQuery::Project(const Document &document) const
+{
+	if(projection.empty())
+	{
+		return document;
+	}
+
+	Document projected_document;
+	projected_document.set_name(document.name());
+	if(document.has_create_time())
+	{
+		*projected_document.mutable_create_time() = document.create_time();
+	}
+	if(document.has_update_time())
+	{
+		*projected_document.mutable_update_time() = document.update_time();
+	}
+	for(const FieldPath &field : projection)
+	{
+		Value name_value;
+		const Value *value = field.is_name ? nullptr : GetField(document, field, &name_value);
+		if(value == nullptr)
+		{
+			continue;
+		}
+
+		// Recreate the maps leading up to the field
+		google::protobuf::Map<std::string, Value> *fields = projected_document.mutable_fields();
+		for(size_t i = 0; i + 1 < field.segments.size(); i++)
+		{
+			fields = (*fields)[field.segments[i]].mutable_map_value()->mutable_fields();
+		}
+		(*fields)[field.segments.back()] = *value;
+	}
+	return projected_document;
+}
+
+const Value *LocalQuery::GetField(const Document &document, const FieldPath &field, Value *name_value)
+{
+	if(field.is_name)
+	{
+		name_value->set_reference_value(document.name());
+		return name_value;
+	}
+
+	const google::protobuf::Map<std::string, Value> *fields = &document.fields();
+	const Value *value = nullptr;
+	for(const std::string &segment : field.segments)
+	{
+		if(value != nullptr)
+		{
+			if(value->value_type_case() != Value::kMapValue)
+			{
+				return nullptr;
+			}
+			fields = &value->map_value().fields();
+		}
+		auto itr = fields->find(segment);
+		if(itr == fields->end())
+		{
+			return nullptr;
+		}
+		value = &itr->second;
+	}
+	return value;
+}
+
+} // namespace firestore
+} // namespace firebase
@@ -0,0 +1,110 @@
+#ifndef FIRESTORE_SRC_FIREBASE_FIRESTORE_LOCAL_QUERY_H
+#define FIRESTORE_SRC_FIREBASE_FIRESTORE_LOCAL_QUERY_H
+
+#include <string>
+#include <vector>
+
+#include "google/firestore/v1/query.pb.h"
+
+namespace firebase {
+namespace firestore {
+
+/**
+ * Compares two values in the order Firestore sorts them in:
+ * null < booleans < numbers < timestamps < strings < bytes < references < geo points < arrays < maps.
+ * Integers and doubles are compared by their numerical value, with NaN before every other number.
+ * Strings and bytes compare byte by byte, references segment by segment,
+ * arrays element by element, and maps key by key (in key order).
+ *
+ * \returns A negative value, zero or a positive value when 'left' sorts before, together with or after 'right'
+ */
+FIRESTORE_EXPORT int CompareValues(const google::firestore::v1::Value &left, const google::firestore::v1::Value &right);
+
+/**
+ * A StructuredQuery that runs over documents held in memory,
+ * with the same filter and ordering semantics as the Firestore backend:
+ *  - A document only matches a filter (or an ordering) on a field it has
+ *  - Inequality filters only match values of the same type as the filter value;
+ *    integers and doubles count as the same type
+ *  - An equality filter never matches NaN; use an IS_NAN filter for that
+ *  - Results are ordered by the order_by fields, preceded by the field of an inequality
+ *    filter if there is no order_by, and followed by the document name in the
+ *    direction of the last ordering
+ *  - start_at and end_at cursors hold values for these orderings, in order
+ */
+class FIRESTORE_EXPORT LocalQuery
+{
+public:
+	/**
+	 * \param parent_name The full path of the document that holds the queried collections
+	 *                    (see Firestore::GetFullParentPath)
+	 * \param query       The query to run
+	 */
+	LocalQuery(const std::string &parent_name, const google::firestore::v1::StructuredQuery &query);
+
+	/**
+	 * Returns false if the query has a malformed field path
+	 */
+	bool IsValid() const;
+
+	/**
+	 * Returns true if the document is in one of the queried collections and passes the filters
+	 * (regardless of the cursors, offset and limit)
+	 */
+	bool Matches(const google::firestore::v1::Document &document) const;
+
+	/**
+	 * Runs the query over a set of documents.
+	 *
+	 * \param documents    The documents to query; documents outside the queried collections are skipped
+	 * \param results_out  Receives the result set, in order
+	 * \returns            False if the query is not valid
+	 */
+	bool Run(const std::vector<google::firestore::v1::Document> &documents, std::vector<google::firestore::v1::Document> *results_out) const;
+
+private:
+	// A field path split into its segments
+	struct FieldPath
+	{
+		std::vector<std::string> segments;
+		bool is_name; // The __name__ pseudo-field
+	};
+
+	// A field or unary filter; the composite filters are flattened, as they are all ANDs
+	struct Filter
+	{
+		FieldPath field;
+		bool unary;
+		int op; // FieldFilter::Operator or UnaryFilter::Operator
+		google::firestore::v1::Value value;
+	};
+
+	struct Ordering
+	{
+		FieldPath field;
+		bool descending;
+	};
+
+	bool AddFilter(const google::firestore::v1::StructuredQuery::Filter &filter);
+	bool ParseFieldPath(const std::string &field_path, FieldPath *field_out) const;
+	bool IsInQueriedCollection(const std::string &name) const;
+	bool MatchesFilter(const Filter &filter, const google::firestore::v1::Document &document) const;
+	bool HasOrderingFields(const google::firestore::v1::Document &document) const;
+	int CompareDocuments(const google::firestore::v1::Document &left, const google::firestore::v1::Document &right) const;
+	bool SortsBeforeDocument(const google::firestore::v1::Cursor &cursor, const google::firestore::v1::Document &document) const;
+	google::firestore::v1::Document Project(const google::firestore::v1::Document &document) const;
+
+	static const google::firestore::v1::Value *GetField(const google::firestore::v1::Document &document, const FieldPath &field, google::firestore::v1::Value *name_value);
+
+	const std::string parent_name;
+	const google::firestore::v1::StructuredQuery query;
+	std::vector<Filter> filters;
+	std::vector<Ordering> orderings;
+	std::vector<FieldPath> projection;
+	bool valid;
+};
+
+} // namespace firestore
+} // namespace firebase
+
+#endif // FIRESTORE_SRC_FIREBASE_FIRESTORE_LOCAL_QUERY_H
@@ -0,0 +1,194 @@
+#include "mapped_file.h"
+
+#include <cstdio>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace firebase {
+namespace firestore {
+
+MappedFile::MappedFile() :
+	data(nullptr),
+	size(0),
+	open(false)
+#ifdef _WIN32
+	, file_handle(INVALID_HANDLE_VALUE),
+	mapping_handle(nullptr)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+	Close();
+}
+
+bool MappedFile::Open(const std::string &path)
+{
+	Close();
+
+#ifdef _WIN32
+	file_handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if(file_handle == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	LARGE_INTEGER file_size;
+	if(!GetFileSizeEx(file_handle, &file_size))
+	{
+		CloseHandle(file_handle);
+		file_handle = INVALID_HANDLE_VALUE;
+		return false;
+	}
+	size = (size_t)file_size.QuadPart;
+
+	// Empty files can't be mapped
+	if(size > 0)
+	{
+		mapping_handle = CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if(mapping_handle == nullptr)
+		{
+			CloseHandle(file_handle);
+			file_handle = INVALID_HANDLE_VALUE;
+			size = 0;
+			return false;
+		}
+		data = (const char*)MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
+		if(data == nullptr)
+		{
+			CloseHandle(mapping_handle);
+			CloseHandle(file_handle);
+			mapping_handle = nullptr;
+			file_handle = INVALID_HANDLE_VALUE;
+			size = 0;
+			return false;
+		}
+	}
+#else
+	const int fd = ::open(path.c_str(), O_RDONLY);
+	if(fd < 0)
+	{
+		return false;
+	}
+
+	struct stat file_stat;
+	if(fstat(fd, &file_stat) != 0)
+	{
+		::close(fd);
+		return false;
+	}
+	size = (size_t)file_stat.st_size;
+
+	// Empty files can't be mapped
+	if(size > 0)
+	{
+		void *mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+		if(mapping == MAP_FAILED)
+		{
+			::close(fd);
+			size = 0;
+			return false;
+		}
+		data = (const char*)mapping;
+	}
+
+	// The mapping stays valid after the file is closed
+	::close(fd);
+#endif
+
+	open = true;
+	return true;
+}
+
+void MappedFile::Close()
+{
+#ifdef _WIN32
+	if(data != nullptr)
+	{
+		UnmapViewOfFile(data);
+	}
+	if(mapping_handle != nullptr)
+	{
+		CloseHandle(mapping_handle);
+		mapping_handle = nullptr;
+	}
+	if(file_handle != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(file_handle);
+		file_handle = INVALID_HANDLE_VALUE;
+	}
+#else
+	if(data != nullptr)
+	{
+		munmap((void*)data, size);
+	}
+#endif
+	data = nullptr;
+	size = 0;
+	open = false;
+}
+
+bool MappedFile::IsOpen() const
+{
+	return open;
+}
+
+const char *MappedFile::GetData() const
+{
+	return data;
+}
+
+size_t MappedFile::GetSize() const
+{
+	return size;
+}
+
+bool RenameFile(const std::string &source, const std::string &destination)
+{
+#ifdef _WIN32
+	// std::rename fails on Windows when the destination exists
+	return MoveFileExA(source.c_str(), destination.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	return std::rename(source.c_str(), destination.c_str()) == 0;
+#endif
+}
+
+bool SyncFile(FILE *file)
+{
+	if(fflush(file) != 0)
+	{
+		return false;
+	}
+#ifdef _WIN32
+	return _commit(_fileno(file)) == 0;
+#else
+	return fsync(fileno(file)) == 0;
+#endif
+}
+
+uint32_t Checksum(const char *data, const size_t size)
+{
+	// 32-bit FNV-1a
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < size; i++)
+	{
+		hash ^= (uint8_t)data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+} // namespace firestore
+} // namespace firebase
@@ -0,0 +1,73 @@
+#ifndef FIRESTORE_SRC_FIREBASE_FIRESTORE_MAPPED_FILE_H
+#define FIRESTORE_SRC_FIREBASE_FIRESTORE_MAPPED_FILE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+namespace firebase {
+namespace firestore {
+
+/**
+ * A file mapped read-only into memory.
+ * The pages are loaded by the OS as they are touched,
+ * so opening even a large file is close to free.
+ */
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile &operator=(const MappedFile&) = delete;
+
+	/**
+	 * Maps the file at 'path', unmapping the previous file if any.
+	 *
+	 * \param path Path of the file to map
+	 * \returns    True if the file was mapped (an empty file maps to no data)
+	 */
+	bool Open(const std::string &path);
+
+	/**
+	 * Unmaps the file
+	 */
+	void Close();
+
+	bool IsOpen() const;
+	const char *GetData() const;
+	size_t GetSize() const;
+
+private:
+	const char *data;
+	size_t size;
+	bool open;
+
+#ifdef _WIN32
+	void *file_handle;
+	void *mapping_handle;
+#endif
+};
+
+/**
+ * Replaces the file at 'destination' by the file at 'source'.
+ * Either the old or the new file is left at 'destination', even on a crash.
+ */
+bool RenameFile(const std::string &source, const std::string &destination);
+
+/**
+ * Flushes what was written to 'file' and waits for the OS to write it to the disk,
+ * so that it survives an OS crash or a power loss as well
+ */
+bool SyncFile(FILE *file);
+
+/**
+ * Returns the 32-bit FNV-1a hash of 'data', used to detect damaged records
+ */
+uint32_t Checksum(const char *data, const size_t size);
+
+} // namespace firestore
+} // namespace firebase
+
+#endif // FIRESTORE_SRC_FIREBASE_FIRESTORE_MAPPED_FILE_H
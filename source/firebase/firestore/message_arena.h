@@ -0,0 +1,90 @@
+#ifndef FIRESTORE_SRC_FIREBASE_FIRESTORE_MESSAGE_ARENA_H
+#define FIRESTORE_SRC_FIREBASE_FIRESTORE_MESSAGE_ARENA_H
+
+#include <type_traits>
+
+#include <google/protobuf/arena.h>
+
+namespace firebase {
+namespace firestore {
+
+/**
+ * A protobuf arena for the messages of a single call, or of a single
+ * response on a stream.
+ *
+ * The first block of the arena is part of the object itself, so a call whose
+ * messages fit in it does not allocate the arena from the heap at all.
+ * Reset() destroys every message created so far and keeps that first block,
+ * so a stream that resets the arena between responses reuses the same memory.
+ *
+ * Messages from protos compiled with 'option cc_enable_arenas = true' are
+ * placed in the arena with all their fields; for other messages only the
+ * top-level object is, and its fields are freed when the arena is reset.
+ */
+class MessageArena
+{
+public:
+	MessageArena() :
+		arena(GetOptions(initial_block, sizeof(initial_block)))
+	{
+	}
+
+	MessageArena(const MessageArena&) = delete;
+	MessageArena &operator=(const MessageArena&) = delete;
+
+	/**
+	 * Creates an empty message owned by the arena
+	 */
+	template<typename Message>
+	Message *Create()
+	{
+		return Create<Message>(typename google::protobuf::Arena::is_arena_constructable<Message>::type());
+	}
+
+	/**
+	 * Destroys every message created by the arena
+	 */
+	void Reset()
+	{
+		arena.Reset();
+	}
+
+	/**
+	 * Returns the number of bytes the arena has reserved, including the first block
+	 */
+	uint64_t SpaceAllocated() const
+	{
+		return arena.SpaceAllocated();
+	}
+
+private:
+	// Arena-enabled messages get the arena passed to their constructor,
+	// so that their fields are allocated in it as well
+	template<typename Message>
+	Message *Create(std::true_type)
+	{
+		return google::protobuf::Arena::CreateMessage<Message>(&arena);
+	}
+
+	template<typename Message>
+	Message *Create(std::false_type)
+	{
+		return google::protobuf::Arena::Create<Message>(&arena);
+	}
+
+	static google::protobuf::ArenaOptions GetOptions(char *block, const size_t size)
+	{
+		google::protobuf::ArenaOptions options;
+		options.initial_block = block;
+		options.initial_block_size = size;
+		return options;
+	}
+
+	alignas(8) char initial_block[4096]; // Must be declared before the arena
+	google::protobuf::Arena arena;
+};
+
+} // namespace firestore
+} // namespace firebase
+
+#endif // FIRESTORE_SRC_FIREBASE_FIRESTORE_MESSAGE_ARENA_H
@@ -0,0 +1,401 @@
+#include "mutation_queue.h"
+
+#include <cstring>
+
+#include <google/protobuf/util/time_util.h>
+
+#include "mapped_file.h"
+
+namespace firebase {
+namespace firestore {
+
+// Every batch in the log is preceded by its size and a checksum of its contents
+struct RecordHeader
+{
+	uint32_t size;
+	uint32_t checksum;
+};
+
+static bool ReadFile(const std::string &path, std::string *contents_out)
+{
+	FILE *file = fopen(path.c_str(), "rb");
+	if(file == nullptr)
+	{
+		return false;
+	}
+	char buffer[64 * 1024];
+	size_t num_read;
+	while((num_read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+	{
+		contents_out->append(buffer, num_read);
+	}
+	const bool success = ferror(file) == 0;
+	fclose(file);
+	return success;
+}
+
+static bool WriteRecord(FILE *file, const WriteBatch &batch)
+{
+	std::string serialized_batch;
+	if(!batch.SerializeToString(&serialized_batch))
+	{
+		return false;
+	}
+	RecordHeader header;
+	header.size = (uint32_t)serialized_batch.size();
+	header.checksum = Checksum(serialized_batch.data(), serialized_batch.size());
+	return fwrite(&header, sizeof(RecordHeader), 1, file) == 1 &&
+		fwrite(serialized_batch.data(), 1, serialized_batch.size(), file) == serialized_batch.size();
+}
+
+MutationQueue::MutationQueue(Firestore &firestore, const std::string &directory, const BatchCallback &callback) :
+	firestore(firestore),
+	log_path(directory + "/mutations.log"),
+	metadata_path(directory + "/mutations.meta"),
+	callback(callback),
+	log_file(nullptr),
+	next_batch_id(1),
+	batch_in_flight(false),
+	commit_context(nullptr),
+	attempts(0),
+	stopping(false)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		std::string serialized_metadata;
+		if(ReadFile(metadata_path, &serialized_metadata) && !metadata.ParseFromString(serialized_metadata))
+		{
+			std::cerr << "MutationQueue::MutationQueue(): " << metadata_path << " is damaged; resending every queued batch" << std::endl;
+			metadata.Clear();
+		}
+
+		// Pick up the batches left over from the previous run
+		if(ReplayLog() || RewriteLog())
+		{
+			log_file = fopen(log_path.c_str(), "ab");
+		}
+		if(log_file == nullptr)
+		{
+			std::cerr << "MutationQueue::MutationQueue(): Failed to open " << log_path << std::endl;
+		}
+	}
+	thread = std::thread(&MutationQueue::Run, this);
+}
+
+MutationQueue::~MutationQueue()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	condition.notify_all();
+	thread.join();
+
+	// The commit callback refers to this object; cancel the commit
+	// rather than wait for the server to answer or the deadline to pass
+	std::unique_lock<std::mutex> lock(mutex);
+	if(commit_context != nullptr)
+	{
+		commit_context->TryCancel();
+	}
+	condition.wait(lock, [this]() { return !batch_in_flight; });
+	if(log_file != nullptr)
+	{
+		fclose(log_file);
+		log_file = nullptr;
+	}
+}
+
+bool MutationQueue::UpdateDocument(const std::string &document_path, const Document &new_document, int32_t *batch_id_out)
+{
+	std::vector<google::firestore::v1::Write> writes(1);
+	Document *document = writes[0].mutable_update();
+	*document = new_document;
+	document->set_name(firestore.GetFullDocumentPath(document_path));
+	return Write(writes, batch_id_out);
+}
+
+bool MutationQueue::DeleteDocument(const std::string &document_path, int32_t *batch_id_out)
+{
+	std::vector<google::firestore::v1::Write> writes(1);
+	writes[0].set_delete_(firestore.GetFullDocumentPath(document_path));
+	return Write(writes, batch_id_out);
+}
+
+bool MutationQueue::Write(const std::vector<google::firestore::v1::Write> &writes, int32_t *batch_id_out)
+{
+	if(writes.empty() || writes.size() > 500)
+	{
+		std::cerr << "MutationQueue::Write(): A batch must hold between 1 and 500 writes; skipping." << std::endl;
+		return false;
+	}
+
+	WriteBatch batch;
+	for(const google::firestore::v1::Write &write : writes)
+	{
+		if(Firestore::GetWriteDocumentName(write).empty())
+		{
+			std::cerr << "MutationQueue::Write(): Write has no operation; skipping." << std::endl;
+			return false;
+		}
+		*batch.add_writes() = write;
+	}
+	*batch.mutable_local_write_time() = google::protobuf::util::TimeUtil::GetCurrentTime();
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if(log_file == nullptr)
+	{
+		std::cerr << "MutationQueue::Write(): The queue is closed; skipping." << std::endl;
+		return false;
+	}
+
+	batch.set_batch_id(next_batch_id);
+	if(!WriteRecord(log_file, batch) || !SyncFile(log_file))
+	{
+		// The log may end in a partial record now, which the next run cuts off
+		std::cerr << "MutationQueue::Write(): Failed to write to " << log_path << std::endl;
+		fclose(log_file);
+		log_file = nullptr;
+		return false;
+	}
+
+	if(batch_id_out != nullptr)
+	{
+		*batch_id_out = next_batch_id;
+	}
+	next_batch_id++;
+	pending_batches.push_back(std::move(batch));
+	condition.notify_all();
+	return true;
+}
+
+bool MutationQueue::Flush(const std::chrono::steady_clock::duration timeout)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	auto drained = [this]() { return pending_batches.empty() && !batch_in_flight; };
+	if(timeout == std::chrono::steady_clock::duration::max())
+	{
+		condition.wait(lock, drained);
+		return true;
+	}
+	return condition.wait_for(lock, timeout, drained);
+}
+
+bool MutationQueue::IsOpen() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return log_file != nullptr;
+}
+
+size_t MutationQueue::GetNumPendingBatches() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return pending_batches.size();
+}
+
+int32_t MutationQueue::GetLastAcknowledgedBatchId() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return metadata.last_acknowledged_batch_id();
+}
+
+bool MutationQueue::ReplayLog()
+{
+	std::string log;
+	if(!ReadFile(log_path, &log))
+	{
+		return true; // No log yet
+	}
+
+	// Batches that have been committed are left out, as is a record
+	// half-written by a crash; the log is rewritten without them
+	bool clean = true;
+	size_t offset = 0;
+	while(offset < log.size())
+	{
+		RecordHeader header;
+		if(offset + sizeof(RecordHeader) > log.size())
+		{
+			clean = false;
+			break;
+		}
+		memcpy(&header, log.data() + offset, sizeof(RecordHeader));
+		const char *data = log.data() + offset + sizeof(RecordHeader);
+
+		WriteBatch batch;
+		if(offset + sizeof(RecordHeader) + header.size > log.size() ||
+			header.checksum != Checksum(data, header.size) ||
+			!batch.ParseFromArray(data, header.size))
+		{
+			clean = false;
+			break;
+		}
+		offset += sizeof(RecordHeader) + header.size;
+
+		next_batch_id = std::max(next_batch_id, batch.batch_id() + 1);
+		if(batch.batch_id() <= metadata.last_acknowledged_batch_id())
+		{
+			clean = false;
+			continue;
+		}
+		pending_batches.push_back(std::move(batch));
+	}
+	next_batch_id = std::max(next_batch_id, metadata.last_acknowledged_batch_id() + 1);
+	return clean;
+}
+
+bool MutationQueue::RewriteLog()
+{
+	const std::string temporary_path = log_path + ".tmp";
+	FILE *file = fopen(temporary_path.c_str(), "wb");
+	if(file == nullptr)
+	{
+		return false;
+	}
+
+	bool written = true;
+	for(const WriteBatch &batch : pending_batches)
+	{
+		written = written && WriteRecord(file, batch);
+	}
+	written = written && SyncFile(file);
+	if(fclose(file) != 0 || !written || !RenameFile(temporary_path, log_path))
+	{
+		remove(temporary_path.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool MutationQueue::WriteMetadata()
+{
+	const std::string temporary_path = metadata_path + ".tmp";
+	FILE *file = fopen(temporary_path.c_str(), "wb");
+	if(file == nullptr)
+	{
+		return false;
+	}
+
+	const std::string serialized_metadata = metadata.SerializeAsString();
+	const bool written = fwrite(serialized_metadata.data(), 1, serialized_metadata.size(), file) == serialized_metadata.size() &&
+		SyncFile(file);
+	if(fclose(file) != 0 || !written || !RenameFile(temporary_path, metadata_path))
+	{
+		remove(temporary_path.c_str());
+		return false;
+	}
+	return true;
+}
+
+void MutationQueue::SendBatch()
+{
+	batch_in_flight = true;
+	attempts++;
+
+	const WriteBatch &batch = pending_batches.front();
+	google::firestore::v1::CommitRequest request;
+	request.set_database(firestore.database_base_path);
+	*request.mutable_writes() = batch.writes();
+	firestore.CommitAsync(request, [this](const grpc::Status &status, google::firestore::v1::CommitResponse*)
+	{
+		OnBatchCommitted(status);
+	}, &commit_context);
+}
+
+void MutationQueue::OnBatchCommitted(const grpc::Status &status)
+{
+	int32_t batch_id;
+	bool completed = true;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		commit_context = nullptr;
+		batch_id = pending_batches.front().batch_id();
+		if(!status.ok())
+		{
+			// Transient errors are retried until the server can be reached again;
+			// a cancelled commit is retried on the next run at the latest
+			const grpc::StatusCode code = status.error_code();
+			const bool retryable =
+				code == grpc::StatusCode::ABORTED ||
+				code == grpc::StatusCode::CANCELLED ||
+				code == grpc::StatusCode::UNAVAILABLE ||
+				code == grpc::StatusCode::UNAUTHENTICATED ||
+				code == grpc::StatusCode::RESOURCE_EXHAUSTED ||
+				code == grpc::StatusCode::DEADLINE_EXCEEDED;
+			if(retryable)
+			{
+				verbose << "MutationQueue::Run(): Commit of batch " << batch_id << " failed with code=" << code << "; retrying" << std::endl;
+				const std::chrono::milliseconds backoff(std::min(100 << std::min(attempts, 8u), 30000));
+				not_before = std::chrono::steady_clock::now() + backoff;
+				completed = false;
+			}
+			else
+			{
+				std::cout << "MutationQueue::Run(): Received ok=false" << std::endl;
+				std::cout << "Message:" << std::endl;
+				std::cout << status.error_message() << std::endl;
+				std::cout << status.error_details() << std::endl;
+			}
+		}
+
+		if(completed)
+		{
+			pending_batches.pop_front();
+			attempts = 0;
+			metadata.set_last_acknowledged_batch_id(batch_id);
+			if(!WriteMetadata())
+			{
+				std::cerr << "MutationQueue::Run(): Failed to write " << metadata_path << std::endl;
+			}
+
+			// Start the log over once everything has been committed
+			if(pending_batches.empty() && log_file != nullptr)
+			{
+				fclose(log_file);
+				log_file = fopen(log_path.c_str(), "wb");
+				if(log_file == nullptr)
+				{
+					std::cerr << "MutationQueue::Run(): Failed to reopen " << log_path << std::endl;
+				}
+			}
+		}
+	}
+
+	if(completed && callback)
+	{
+		callback(batch_id, status.ok());
+	}
+
+	// The batch stays in flight until the callback has returned
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		batch_in_flight = false;
+	}
+	condition.notify_all();
+}
+
+void MutationQueue::Run()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while(!stopping)
+	{
+		if(pending_batches.empty() || batch_in_flight)
+		{
+			condition.wait(lock);
+			continue;
+		}
+
+		// Wait for the backoff of a failed commit to expire
+		if(not_before > std::chrono::steady_clock::now())
+		{
+			condition.wait_until(lock, not_before);
+			continue;
+		}
+
+		SendBatch();
+	}
+}
+
+} // namespace firestore
+} // namespace firebase
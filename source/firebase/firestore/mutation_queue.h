@@ -0,0 +1,149 @@
+#ifndef FIRESTORE_SRC_FIREBASE_FIRESTORE_MUTATION_QUEUE_H
+#define FIRESTORE_SRC_FIREBASE_FIRESTORE_MUTATION_QUEUE_H
+
+#include <chrono>
+#include <cstdio>
+
+#include "firestore.h"
+#include "firestore/local/mutation.pb.h"
+
+namespace firebase {
+namespace firestore {
+
+typedef ::firestore::client::WriteBatch WriteBatch;
+
+/**
+ * Called once the server has committed a batch of writes (committed=true),
+ * or has rejected it for good (committed=false)
+ */
+typedef std::function<void(const int32_t batch_id, const bool committed)> BatchCallback;
+
+/**
+ * This class queues writes on disk and commits them to the server in the background.
+ *
+ * A write is done as far as the caller is concerned as soon as it has been
+ * appended to the queue file and synced to the disk, so that it survives
+ * a process crash, an OS crash or a power loss. This takes as long as the
+ * disk needs to sync a write, from well under a millisecond on an SSD
+ * to several milliseconds on a spinning disk.
+ * The batches are then committed one at a time, in the order they were
+ * queued. Commits failing with a transient error (such as the server being
+ * unreachable) are retried with exponential backoff for as long as it takes.
+ * Batches rejected by the server are dropped, and reported to the batch callback.
+ *
+ * The queue lives in two files inside a directory:
+ *  - mutations.log:  the queued WriteBatches, appended one after the other
+ *  - mutations.meta: a MutationQueue holding the id of the last batch the server committed
+ *
+ * Batches still queued when the object is destroyed (or the process crashes)
+ * are picked up by the next MutationQueue opened on the same directory.
+ * A batch committed right before a crash may be committed a second time
+ * on the next run, so writes should be idempotent (no transforms).
+ *
+ * The Firestore object must outlive the MutationQueue.
+ */
+class FIRESTORE_EXPORT MutationQueue
+{
+public:
+	/**
+	 * Opens the queue in 'directory', creating its files if needed,
+	 * and starts committing the batches left over from a previous run.
+	 *
+	 * \param firestore  The database to write to
+	 * \param directory  Directory holding the files of the queue; it must exist
+	 *                   and must not be shared by two queues
+	 * \param callback   Called from a background thread as batches complete (optional)
+	 */
+	MutationQueue(Firestore &firestore, const std::string &directory, const BatchCallback &callback=BatchCallback());
+
+	/**
+	 * Cancels the commit in flight, if any, and waits for it to return.
+	 * The batches that are still queued, the cancelled one included,
+	 * stay on disk for the next run.
+	 */
+	~MutationQueue();
+
+	/**
+	 * Queues an update or insert of the document at path 'document_path'.
+	 *
+	 * \param document_path The path of the document to update or insert
+	 * \param new_document  Document to update or insert
+	 * \param batch_id_out  Receives the id of the batch (optional)
+	 * \returns             True if the write was queued
+	 */
+	bool UpdateDocument(const std::string &document_path, const Document &new_document, int32_t *batch_id_out=nullptr);
+
+	/**
+	 * Queues a delete of the document at path 'document_path'.
+	 *
+	 * \param document_path The path of the document to delete
+	 * \param batch_id_out  Receives the id of the batch (optional)
+	 * \returns             True if the delete was queued
+	 */
+	bool DeleteDocument(const std::string &document_path, int32_t *batch_id_out=nullptr);
+
+	/**
+	 * Queues a batch of writes, which the server applies atomically.
+	 * Document names in the writes must be full paths (see Firestore::GetFullDocumentPath).
+	 *
+	 * \param writes        The writes of the batch (at most 500)
+	 * \param batch_id_out  Receives the id of the batch (optional)
+	 * \returns             True if the batch was queued
+	 */
+	bool Write(const std::vector<google::firestore::v1::Write> &writes, int32_t *batch_id_out=nullptr);
+
+	/**
+	 * Blocks until every batch queued so far has completed, or until 'timeout' expires.
+	 *
+	 * \returns True if the queue is empty
+	 */
+	bool Flush(const std::chrono::steady_clock::duration timeout=std::chrono::steady_clock::duration::max());
+
+	/**
+	 * Returns false if the queue files could not be opened; no writes are accepted then
+	 */
+	bool IsOpen() const;
+
+	/**
+	 * Returns the number of batches waiting to be committed, including the one in flight
+	 */
+	size_t GetNumPendingBatches() const;
+
+	/**
+	 * Returns the id of the last batch that has completed
+	 */
+	int32_t GetLastAcknowledgedBatchId() const;
+
+private:
+	bool Append(const WriteBatch &batch);
+	bool ReplayLog();
+	bool RewriteLog();
+	bool WriteMetadata();
+	void SendBatch();
+	void OnBatchCommitted(const grpc::Status &status);
+	void Run();
+
+	Firestore &firestore;
+	const std::string log_path;
+	const std::string metadata_path;
+	const BatchCallback callback;
+
+	std::thread thread; // Commits the batches in order
+
+	mutable std::mutex mutex; // Guards everything below
+	std::condition_variable condition;
+	FILE *log_file;
+	std::deque<WriteBatch> pending_batches; // In the order they were queued
+	::firestore::client::MutationQueue metadata;
+	int32_t next_batch_id;
+	bool batch_in_flight;
+	grpc::ClientContext *commit_context; // Of the commit in flight, until its callback runs
+	uint32_t attempts; // Of the batch at the front of the queue
+	std::chrono::steady_clock::time_point not_before;
+	bool stopping;
+};
+
+} // namespace firestore
+} // namespace firebase
+
+#endif // FIRESTORE_SRC_FIREBASE_FIRESTORE_MUTATION_QUEUE_H
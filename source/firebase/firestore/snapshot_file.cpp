@@ -0,0 +1,253 @@
+#include "snapshot_file.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace firebase {
+namespace firestore {
+
+static const char snapshot_magic[8] = {'F', 'S', 'S', 'N', 'A', 'P', '0', '1'};
+
+SnapshotFile::SnapshotFile() :
+	num_entries(0)
+{
+}
+
+bool SnapshotFile::Write(const std::string &path, const std::vector<google::firestore::v1::Document> &documents)
+{
+	SnapshotWriter writer;
+	if(!writer.Open(path))
+	{
+		return false;
+	}
+	for(const google::firestore::v1::Document &document : documents)
+	{
+		if(!writer.Add(document))
+		{
+			return false;
+		}
+	}
+	return writer.Finish();
+}
+
+bool SnapshotFile::Open(const std::string &path)
+{
+	Close();
+	if(!file.Open(path))
+	{
+		return false;
+	}
+
+	Header header;
+	if(file.GetSize() < sizeof(Header))
+	{
+		Close();
+		return false;
+	}
+	memcpy(&header, file.GetData(), sizeof(Header));
+	if(memcmp(header.magic, snapshot_magic, sizeof(header.magic)) != 0 ||
+		header.num_entries > (file.GetSize() - sizeof(Header)) / sizeof(IndexEntry))
+	{
+		Close();
+		return false;
+	}
+	num_entries = header.num_entries;
+	return true;
+}
+
+void SnapshotFile::Close()
+{
+	file.Close();
+	num_entries = 0;
+}
+
+bool SnapshotFile::IsOpen() const
+{
+	return file.IsOpen();
+}
+
+size_t SnapshotFile::GetNumDocuments() const
+{
+	return (size_t)num_entries;
+}
+
+bool SnapshotFile::Find(const std::string &name, const char **data_out, size_t *size_out) const
+{
+	const char *data = file.GetData();
+	const uint64_t size = file.GetSize();
+
+	// The entries are checked as they are visited, so a damaged file reads as missing documents
+	auto entry_name_valid = [size](const IndexEntry &entry) { return entry.name_offset <= size && entry.name_size <= size - entry.name_offset; };
+	const IndexEntry *entries_begin = GetIndexEntries();
+	const IndexEntry *entries_end = entries_begin + num_entries;
+	const IndexEntry *entry = std::lower_bound(entries_begin, entries_end, name,
+		[data, &entry_name_valid](const IndexEntry &entry, const std::string &name)
+		{
+			return entry_name_valid(entry) && name.compare(0, name.size(), data + entry.name_offset, entry.name_size) > 0;
+		});
+	if(entry == entries_end || !entry_name_valid(*entry) ||
+		name.compare(0, name.size(), data + entry->name_offset, entry->name_size) != 0 ||
+		entry->document_offset > size || entry->document_size > size - entry->document_offset)
+	{
+		return false;
+	}
+
+	*data_out = data + entry->document_offset;
+	*size_out = entry->document_size;
+	return true;
+}
+
+bool SnapshotFile::Get(const std::string &name, google::firestore::v1::Document *document_out) const
+{
+	const char *data;
+	size_t size;
+	if(!Find(name, &data, &size))
+	{
+		return false;
+	}
+	return document_out == nullptr || document_out->ParseFromArray(data, (int)size);
+}
+
+const SnapshotFile::IndexEntry *SnapshotFile::GetIndexEntries() const
+{
+	// The index directly follows the header, which keeps it 8-byte aligned
+	return num_entries > 0 ? (const IndexEntry*)(file.GetData() + sizeof(Header)) : nullptr;
+}
+
+SnapshotWriter::SnapshotWriter() :
+	data_file(nullptr),
+	data_size(0)
+{
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+	Abandon();
+}
+
+bool SnapshotWriter::Open(const std::string &path)
+{
+	Abandon();
+	this->path = path;
+	data_path = path + ".data.tmp";
+	data_file = fopen(data_path.c_str(), "wb");
+	return data_file != nullptr;
+}
+
+bool SnapshotWriter::Add(const google::firestore::v1::Document &document)
+{
+	if(data_file == nullptr)
+	{
+		return false;
+	}
+
+	// Each name is followed by its document
+	serialized_document.clear();
+	const std::string &name = document.name();
+	if(!document.AppendToString(&serialized_document) ||
+		fwrite(name.data(), 1, name.size(), data_file) != name.size() ||
+		fwrite(serialized_document.data(), 1, serialized_document.size(), data_file) != serialized_document.size())
+	{
+		Abandon();
+		return false;
+	}
+
+	SnapshotFile::IndexEntry entry;
+	entry.name_offset = data_size;
+	entry.name_size = (uint32_t)name.size();
+	entry.document_offset = data_size + name.size();
+	entry.document_size = (uint32_t)serialized_document.size();
+	entries.push_back(entry);
+	data_size += name.size() + serialized_document.size();
+	return true;
+}
+
+bool SnapshotWriter::Finish()
+{
+	if(data_file == nullptr)
+	{
+		return false;
+	}
+	const bool data_written = fclose(data_file) == 0;
+	data_file = nullptr;
+
+	// Sort the entries by name, as the lookups binary search the index;
+	// the names are read back from the temporary file
+	MappedFile data;
+	if(!data_written || (data_size > 0 && !data.Open(data_path)) || data.GetSize() != data_size)
+	{
+		Abandon();
+		return false;
+	}
+	auto entry_name = [&data](const SnapshotFile::IndexEntry &entry)
+	{
+		return std::string(data.GetData() + entry.name_offset, entry.name_size);
+	};
+	std::sort(entries.begin(), entries.end(),
+		[&entry_name](const SnapshotFile::IndexEntry &a, const SnapshotFile::IndexEntry &b) { return entry_name(a) < entry_name(b); });
+	for(size_t i = 1; i < entries.size(); i++)
+	{
+		if(entry_name(entries[i]) == entry_name(entries[i - 1]))
+		{
+			data.Close();
+			Abandon();
+			return false;
+		}
+	}
+
+	// The data follows the header and the index
+	SnapshotFile::Header header;
+	memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+	header.num_entries = entries.size();
+	const uint64_t data_offset = sizeof(SnapshotFile::Header) + entries.size() * sizeof(SnapshotFile::IndexEntry);
+	for(SnapshotFile::IndexEntry &entry : entries)
+	{
+		entry.name_offset += data_offset;
+		entry.document_offset += data_offset;
+	}
+
+	const std::string temporary_path = path + ".tmp";
+	FILE *snapshot = fopen(temporary_path.c_str(), "wb");
+	if(snapshot == nullptr)
+	{
+		data.Close();
+		Abandon();
+		return false;
+	}
+	const bool written = fwrite(&header, sizeof(SnapshotFile::Header), 1, snapshot) == 1 &&
+		fwrite(entries.data(), sizeof(SnapshotFile::IndexEntry), entries.size(), snapshot) == entries.size() &&
+		fwrite(data.GetData(), 1, (size_t)data_size, snapshot) == data_size;
+	data.Close();
+	Abandon();
+	if(fclose(snapshot) != 0 || !written || !RenameFile(temporary_path, path))
+	{
+		remove(temporary_path.c_str());
+		return false;
+	}
+	return true;
+}
+
+size_t SnapshotWriter::GetNumDocuments() const
+{
+	return entries.size();
+}
+
+void SnapshotWriter::Abandon()
+{
+	if(data_file != nullptr)
+	{
+		fclose(data_file);
+		data_file = nullptr;
+	}
+	if(!data_path.empty())
+	{
+		remove(data_path.c_str());
+		data_path.clear();
+	}
+	entries.clear();
+	data_size = 0;
+}
+
+} // namespace firestore
+} // namespace firebase
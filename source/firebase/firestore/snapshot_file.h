@@ -0,0 +1,166 @@
+#ifndef FIRESTORE_SRC_FIREBASE_FIRESTORE_SNAPSHOT_FILE_H
+#define FIRESTORE_SRC_FIREBASE_FIRESTORE_SNAPSHOT_FILE_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "google/firestore/v1/document.pb.h"
+#include "mapped_file.h"
+
+namespace firebase {
+namespace firestore {
+
+/**
+ * A read-only set of documents in a single file, meant for data that rarely
+ * changes and is read in bulk (item tables, level configs and such).
+ *
+ * The file is made of:
+ *  - a header:        magic "FSSNAP01" and the number of documents
+ *  - an index:        the location of every document, sorted by document name
+ *  - the names and serialized Documents the index points to
+ *
+ * Opening a snapshot only maps the file into memory; nothing is read or parsed
+ * up front. A lookup is a binary search over the index, touching a handful of
+ * pages, and only the document that is looked up gets parsed.
+ *
+ * Documents are keyed by their full path
+ * (projects/{project_id}/databases/{database_id}/documents/{document_path}).
+ * The file uses the byte order of the machine that wrote it.
+ */
+class FIRESTORE_EXPORT SnapshotFile
+{
+public:
+	SnapshotFile();
+
+	SnapshotFile(const SnapshotFile&) = delete;
+	SnapshotFile &operator=(const SnapshotFile&) = delete;
+
+	/**
+	 * Writes a snapshot holding 'documents' to 'path', replacing the file atomically.
+	 * To write more documents than fit in memory, use a SnapshotWriter.
+	 *
+	 * \param path      Path of the snapshot file
+	 * \param documents The documents of the snapshot; their names must be unique
+	 * \returns         True if the file was written
+	 */
+	static bool Write(const std::string &path, const std::vector<google::firestore::v1::Document> &documents);
+
+	/**
+	 * Maps the snapshot at 'path' into memory, closing the previous one if any.
+	 *
+	 * \returns True if the file is a snapshot
+	 */
+	bool Open(const std::string &path);
+
+	void Close();
+
+	bool IsOpen() const;
+
+	/**
+	 * Returns the number of documents in the snapshot
+	 */
+	size_t GetNumDocuments() const;
+
+	/**
+	 * Looks up the serialized document at 'name', without parsing it.
+	 * The data stays valid until the snapshot is closed.
+	 *
+	 * \param name      Full path of the document
+	 * \param data_out  Receives the serialized Document
+	 * \param size_out  Receives the size of the serialized Document
+	 * \returns         True if the snapshot holds the document
+	 */
+	bool Find(const std::string &name, const char **data_out, size_t *size_out) const;
+
+	/**
+	 * Looks up and parses the document at 'name'.
+	 *
+	 * \param name          Full path of the document
+	 * \param document_out  Receives the document (optional)
+	 * \returns             True if the snapshot holds the document
+	 */
+	bool Get(const std::string &name, google::firestore::v1::Document *document_out) const;
+
+private:
+	friend class SnapshotWriter;
+
+	struct Header
+	{
+		char magic[8];
+		uint64_t num_entries;
+	};
+
+	struct IndexEntry
+	{
+		uint64_t name_offset;     // From the start of the file
+		uint64_t document_offset; // From the start of the file
+		uint32_t name_size;
+		uint32_t document_size;
+	};
+
+	const IndexEntry *GetIndexEntries() const;
+
+	MappedFile file;
+	uint64_t num_entries;
+};
+
+/**
+ * Writes a snapshot file one document at a time, so that snapshots of any size
+ * can be written without holding their documents in memory.
+ *
+ * The documents go to a temporary file as they are added; only their index
+ * entries (24 bytes each) are kept in memory. Finish() sorts the entries and
+ * writes the snapshot, replacing the file atomically. A writer destroyed
+ * before Finish() leaves the file at 'path' untouched.
+ */
+class FIRESTORE_EXPORT SnapshotWriter
+{
+public:
+	SnapshotWriter();
+	~SnapshotWriter();
+
+	SnapshotWriter(const SnapshotWriter&) = delete;
+	SnapshotWriter &operator=(const SnapshotWriter&) = delete;
+
+	/**
+	 * Starts a snapshot that Finish() writes to 'path'
+	 *
+	 * \returns True if the temporary file was created
+	 */
+	bool Open(const std::string &path);
+
+	/**
+	 * Adds a document to the snapshot; names must be unique
+	 *
+	 * \returns True if the document was written to the temporary file
+	 */
+	bool Add(const google::firestore::v1::Document &document);
+
+	/**
+	 * Writes the snapshot to the path given to Open
+	 *
+	 * \returns True if the file was written
+	 */
+	bool Finish();
+
+	/**
+	 * Returns the number of documents added so far
+	 */
+	size_t GetNumDocuments() const;
+
+private:
+	void Abandon();
+
+	std::string path;
+	std::string data_path; // Temporary file holding the names and documents
+	FILE *data_file;
+	uint64_t data_size;
+	std::vector<SnapshotFile::IndexEntry> entries; // Offsets from the start of the temporary file
+	std::string serialized_document;
+};
+
+} // namespace firestore
+} // namespace firebase
+
+#endif // FIRESTORE_SRC_FIREBASE_FIRESTORE_SNAPSHOT_FILE_H
@@ -0,0 +1,261 @@
+#include "write_stream.h"
+
+namespace firebase {
+namespace firestore {
+
+WriteStream::WriteStream(Firestore &firestore, const uint32_t max_writes_per_request) :
+	firestore(firestore),
+	max_writes_per_request(max_writes_per_request > 0 ? max_writes_per_request : 1),
+	channel(firestore.SelectChannel()),
+	start_tag(this, OPERATION_START),
+	read_tag(this, OPERATION_READ),
+	write_tag(this, OPERATION_WRITE),
+	finish_tag(this, OPERATION_FINISH),
+	handshake_done(false),
+	write_in_flight(false),
+	finished(false),
+	open(true)
+{
+	// Need to include google-cloud-resource-prefix in the header,
+	// otherwise it won't connect
+	client_context.AddMetadata("google-cloud-resource-prefix", firestore.database_base_path);
+	firestore.RegisterCall(&client_context);
+
+	// Initiate firestore write call
+	// The stream is driven by the poller threads from here on
+	rpc = channel.Stub()->PrepareAsyncWrite(&client_context, firestore.GetCompletionQueue());
+	rpc->StartCall(&start_tag);
+}
+
+WriteStream::~WriteStream()
+{
+	Flush();
+
+	// Everything has been acknowledged, so the stream can simply be cancelled
+	open = false;
+	client_context.TryCancel();
+
+	// The tags are members of this object, so wait until
+	// the poller threads are done with the stream
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		condition.wait(lock, [this]() { return finished && !write_in_flight; });
+	}
+	firestore.UnregisterCall(&client_context);
+}
+
+std::future<bool> WriteStream::UpdateDocument(const std::string &document_path, const Document &new_document)
+{
+	google::firestore::v1::Write write;
+	Document *document = write.mutable_update();
+	*document = new_document;
+	document->set_name(firestore.GetFullDocumentPath(document_path));
+	return Write(write);
+}
+
+std::future<bool> WriteStream::DeleteDocument(const std::string &document_path)
+{
+	google::firestore::v1::Write write;
+	write.set_delete_(firestore.GetFullDocumentPath(document_path));
+	return Write(write);
+}
+
+std::future<bool> WriteStream::Write(const google::firestore::v1::Write &write)
+{
+	std::promise<bool> result;
+	std::future<bool> future = result.get_future();
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if(!open)
+	{
+		std::cerr << "WriteStream::Write(): The stream is closed; skipping." << std::endl;
+		result.set_value(false);
+		return future;
+	}
+
+	// Coalesce the write into the last request that is waiting to be sent, unless it is full
+	if(pending_requests.empty() || (uint32_t)pending_requests.back()->request.writes_size() >= max_writes_per_request)
+	{
+		pending_requests.emplace_back(new PendingRequest);
+	}
+	PendingRequest &request = *pending_requests.back();
+	*request.request.add_writes() = write;
+	request.results.push_back(std::move(result));
+	request.document_names.push_back(Firestore::GetWriteDocumentName(write));
+
+	WriteNextRequest();
+	return future;
+}
+
+void WriteStream::Flush()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	condition.wait(lock, [this]() { return finished || (pending_requests.empty() && unacknowledged_writes.empty()); });
+}
+
+bool WriteStream::IsOpen() const
+{
+	return open;
+}
+
+std::string WriteStream::GetStreamToken()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return stream_token;
+}
+
+void WriteStream::WriteNextRequest()
+{
+	// Only one write may be outstanding on a stream at a time,
+	// but there is no need to wait for the previous request to be acknowledged
+	if(!handshake_done || write_in_flight || pending_requests.empty() || finished)
+	{
+		return;
+	}
+
+	// The writes are waiting for their acknowledgement as soon as the request is started,
+	// as the response may be picked up before the write completion
+	std::unique_ptr<PendingRequest> next_request = std::move(pending_requests.front());
+	pending_requests.pop_front();
+	request_in_flight.reset(new google::firestore::v1::WriteRequest);
+	request_in_flight->Swap(&next_request->request);
+	unacknowledged_writes.push_back(std::move(next_request));
+
+	// Acknowledge the responses received so far
+	request_in_flight->set_stream_token(stream_token);
+
+	write_in_flight = true;
+	rpc->Write(*request_in_flight, &write_tag);
+}
+
+void WriteStream::CompleteWrites(PendingRequest &request, const bool success)
+{
+	// The server applies transforms to the written documents,
+	// so they are dropped from the cache rather than cached as sent
+	for(const std::string &document_name : request.document_names)
+	{
+		firestore.InvalidateCachedDocument(document_name);
+	}
+	for(std::promise<bool> &result : request.results)
+	{
+		result.set_value(success);
+	}
+}
+
+void WriteStream::FailOutstandingWrites()
+{
+	// Writes that were sent may have been applied anyway
+	for(std::unique_ptr<PendingRequest> &request : unacknowledged_writes)
+	{
+		CompleteWrites(*request, false);
+	}
+	unacknowledged_writes.clear();
+
+	for(std::unique_ptr<PendingRequest> &request : pending_requests)
+	{
+		for(std::promise<bool> &result : request->results)
+		{
+			result.set_value(false);
+		}
+	}
+	pending_requests.clear();
+}
+
+void WriteStream::Proceed(const Operation operation, bool ok)
+{
+	switch(operation)
+	{
+		case OPERATION_START:
+			if(!ok)
+			{
+				std::cout << "WriteStream::WriteStream(): Failed to initialize stream." << std::endl;
+				open = false;
+				rpc->Finish(&status, &finish_tag);
+				break;
+			}
+
+			// The first request opens the stream; the server answers
+			// with the stream id and the token to send from then on
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				request_in_flight.reset(new google::firestore::v1::WriteRequest);
+				request_in_flight->set_database(firestore.database_base_path);
+				write_in_flight = true;
+				rpc->Write(*request_in_flight, &write_tag);
+			}
+			rpc->Read(&reply, &read_tag);
+			break;
+
+		case OPERATION_WRITE:
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			write_in_flight = false;
+			request_in_flight.reset();
+			if(!ok)
+			{
+				// The stream is broken; the pending read will fail as well
+				verbose << "WriteStream::Write(): Failed to write to stream." << std::endl;
+			}
+			else
+			{
+				WriteNextRequest();
+			}
+			condition.notify_all();
+		}
+		break;
+
+		case OPERATION_READ:
+			if(!ok)
+			{
+				// The stream was closed (or cancelled);
+				// retrieve the final status
+				open = false;
+				rpc->Finish(&status, &finish_tag);
+				break;
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stream_token = reply.stream_token();
+				if(!handshake_done)
+				{
+					stream_id = reply.stream_id();
+					handshake_done = true;
+					verbose << "WriteStream::WriteStream(): Opened stream with id=" << stream_id << std::endl;
+					WriteNextRequest();
+				}
+				else if(!unacknowledged_writes.empty())
+				{
+					// Responses arrive in the order the requests were sent
+					CompleteWrites(*unacknowledged_writes.front(), true);
+					unacknowledged_writes.pop_front();
+					condition.notify_all();
+				}
+				else
+				{
+					std::cerr << "WriteStream::Write(): Received a response without any outstanding request" << std::endl;
+				}
+			}
+			rpc->Read(&reply, &read_tag);
+			break;
+
+		case OPERATION_FINISH:
+			if(!status.ok() && status.error_code() != grpc::StatusCode::CANCELLED)
+			{
+				std::cout << "WriteStream::Write(): Received ok=false on finish" << std::endl;
+				std::cout << "Message:" << std::endl;
+				std::cout << status.error_message() << std::endl;
+				std::cout << status.error_details() << std::endl;
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				FailOutstandingWrites();
+				finished = true;
+				condition.notify_all();
+			}
+			break;
+	}
+}
+
+} // namespace firestore
+} // namespace firebase
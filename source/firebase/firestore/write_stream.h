@@ -0,0 +1,156 @@
+#ifndef FIRESTORE_SRC_FIREBASE_FIRESTORE_WRITE_STREAM_H
+#define FIRESTORE_SRC_FIREBASE_FIRESTORE_WRITE_STREAM_H
+
+#include "firestore.h"
+
+namespace firebase {
+namespace firestore {
+
+/**
+ * This class sends writes over a long-lived bi-directional Write stream.
+ *
+ * Writes are pipelined: they are sent as soon as the stream allows,
+ * without waiting for the previous writes to be acknowledged.
+ * The server acknowledges the requests in the order they were sent,
+ * so every acknowledgement is matched to the oldest unacknowledged request.
+ * Writes added while a request is being sent are coalesced into the next request.
+ *
+ * Every write returns a future that becomes true once the server has acknowledged it.
+ * If the stream breaks, all unacknowledged writes fail and the stream stays closed;
+ * create a new WriteStream to continue.
+ *
+ * The Firestore object must outlive the WriteStream.
+ */
+class FIRESTORE_EXPORT WriteStream
+{
+public:
+	/**
+	 * Opens a new write stream
+	 *
+	 * \param firestore                The database to write to
+	 * \param max_writes_per_request   Maximum number of writes coalesced into a single request
+	 */
+	WriteStream(Firestore &firestore, const uint32_t max_writes_per_request=500);
+
+	/**
+	 * Waits for all outstanding writes to be acknowledged and closes the stream
+	 */
+	~WriteStream();
+
+	/**
+	 * Updates or inserts a new document at path 'document_path'.
+	 *
+	 * \param document_path The path of the document to update or insert
+	 * \param new_document  Document to update or insert
+	 * \returns             A future that becomes true once the write is acknowledged
+	 */
+	std::future<bool> UpdateDocument(const std::string &document_path, const Document &new_document);
+
+	/**
+	 * Deletes the document at path 'document_path'.
+	 *
+	 * \param document_path The path of the document to delete
+	 * \returns             A future that becomes true once the delete is acknowledged
+	 */
+	std::future<bool> DeleteDocument(const std::string &document_path);
+
+	/**
+	 * Sends a write operation. Document names in the write must be full paths
+	 * (see Firestore::GetFullDocumentPath).
+	 *
+	 * \param write The write to send
+	 * \returns     A future that becomes true once the write is acknowledged
+	 */
+	std::future<bool> Write(const google::firestore::v1::Write &write);
+
+	/**
+	 * Blocks until every write sent so far has been acknowledged (or has failed)
+	 */
+	void Flush();
+
+	/**
+	 * Returns false once the stream has broken or been closed
+	 */
+	bool IsOpen() const;
+
+	/**
+	 * Returns the most recent stream token received from the server
+	 */
+	std::string GetStreamToken();
+
+private:
+	// Tags of the operations on the stream
+	enum Operation
+	{
+		OPERATION_START = 1,
+		OPERATION_READ,
+		OPERATION_WRITE,
+		OPERATION_FINISH
+	};
+
+	// Forwards the completion of an operation to the stream
+	class OperationTag : public Firestore::AsyncCall
+	{
+	public:
+		OperationTag(WriteStream *stream, const Operation operation) :
+			stream(stream),
+			operation(operation)
+		{
+		}
+
+		bool Proceed(bool ok) override
+		{
+			stream->Proceed(operation, ok);
+			return true;
+		}
+
+	private:
+		WriteStream *const stream;
+		const Operation operation;
+	};
+
+	// A request and the results of the writes it carries
+	struct PendingRequest
+	{
+		google::firestore::v1::WriteRequest request;
+		std::vector<std::promise<bool>> results;
+		std::vector<std::string> document_names; // Dropped from the document cache once acknowledged
+	};
+
+	void Proceed(const Operation operation, bool ok);
+	void WriteNextRequest();
+	void CompleteWrites(PendingRequest &request, const bool success);
+	void FailOutstandingWrites();
+
+	Firestore &firestore;
+	const uint32_t max_writes_per_request;
+	const Firestore::ChannelLease channel;
+
+	grpc::ClientContext client_context;
+	std::unique_ptr<grpc::ClientAsyncReaderWriter<google::firestore::v1::WriteRequest, google::firestore::v1::WriteResponse>> rpc;
+	google::firestore::v1::WriteResponse reply;
+	grpc::Status status;
+
+	OperationTag start_tag;
+	OperationTag read_tag;
+	OperationTag write_tag;
+	OperationTag finish_tag;
+
+	std::mutex mutex; // Guards everything below
+	std::condition_variable condition;
+	std::deque<std::unique_ptr<PendingRequest>> pending_requests; // Not yet sent
+	std::unique_ptr<google::firestore::v1::WriteRequest> request_in_flight;
+	std::deque<std::unique_ptr<PendingRequest>> unacknowledged_writes; // Sent (without the request), in the order they were sent
+	std::string stream_id;
+	std::string stream_token;
+	bool handshake_done;
+	bool write_in_flight;
+	bool finished;
+
+	std::atomic<bool> open;
+};
+
+} // namespace firestore
+} // namespace firebase
+
+#endif // FIRESTORE_SRC_FIREBASE_FIRESTORE_WRITE_STREAM_H